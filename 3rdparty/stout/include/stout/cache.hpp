@@ -1,21 +1,32 @@
 #ifndef __STOUT_CACHE_HPP__
 #define __STOUT_CACHE_HPP__
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include <functional>
 #include <iostream>
-#include <list>
-#include <map>
+#include <new>
+#include <vector>
 
 #include <tr1/functional>
-#include <tr1/unordered_map>
 
+#include <boost/type_traits/aligned_storage.hpp>
+#include <boost/type_traits/alignment_of.hpp>
+
+#include "duration.hpp"
 #include "none.hpp"
 #include "option.hpp"
+#include "stopwatch.hpp"
+#include "try.hpp"
 
-// Forward declaration.
+// Forward declarations.
 template <typename Key, typename Value>
 class cache;
 
+template <typename Key, typename Value>
+class sharded_cache;
+
 // Outputs the key/value pairs from least to most-recently used.
 template <typename Key, typename Value>
 std::ostream& operator << (
@@ -23,39 +34,222 @@ std::ostream& operator << (
     const cache<Key, Value>& c);
 
 
+// The policies a cache can use to pick the entry to evict.
+struct Eviction
+{
+  enum Policy {
+    // Evicts the least-recently used entry. Every use reorders the
+    // entries, which means a "read" mutates the cache.
+    LRU,
+
+    // Approximates LRU using the CLOCK (a.k.a. "second chance")
+    // algorithm: a "read" only sets a reference bit on the entry and
+    // eviction sweeps over the entries, clearing reference bits until
+    // it finds an entry that hasn't been used since the last sweep.
+    // Since a "read" never reorders the entries, multiple "reads" can
+    // safely be done concurrently (see stout/sharded_cache.hpp).
+    CLOCK,
+
+    // Window TinyLFU: new entries go into a small LRU "window" (1% of
+    // the capacity). An entry pushed out of the window is only
+    // admitted into the main cache (a segmented LRU with "probation"
+    // and "protected" segments) if it has been used more frequently
+    // than the entry that would need to be evicted from the main
+    // cache to make room for it. Frequencies (of hits and misses) are
+    // estimated with a count-min sketch that is periodically halved
+    // so that it favors recent history. Unlike LRU, a scan of entries
+    // that are used only once can not flush the frequently used
+    // entries out of the cache.
+    WINDOW_TINYLFU
+  };
+};
+
+
+// Statistics describing how a cache has been used.
+struct CacheStats
+{
+  CacheStats()
+    : hits(0), misses(0), evictions(0), loads(0), failures(0) {}
+
+  // Returns the fraction of lookups that were hits.
+  double ratio() const
+  {
+    return hits + misses > 0
+      ? static_cast<double>(hits) / (hits + misses)
+      : 1.0;
+  }
+
+  uint64_t hits; // Lookups that found an entry.
+  uint64_t misses; // Lookups that didn't.
+  uint64_t evictions; // Entries removed to stay within capacity.
+  uint64_t loads; // Values successfully loaded (see 'getOrLoad').
+  uint64_t failures; // Loads that returned an error.
+  Duration loading; // Total time spent loading values.
+};
+
+
 // Provides a least-recently used (LRU) cache of some predefined
-// capacity. A "write" and a "read" both count as uses.
+// capacity. A "write" and a "read" both count as uses. Optionally,
+// a different eviction policy can be used instead (see Eviction
+// above) and the capacity can be in terms of the total "weight" of
+// the entries (e.g., bytes) rather than the number of entries.
+//
+// The cache is "intrusive": every entry lives in a single node taken
+// from a pool of nodes. Each node stores its key exactly once
+// together with the links for the eviction lists and its hash bucket
+// chain. Without a weigher the pool is allocated once, up front, and
+// (when using LRU or CLOCK) the node of an evicted entry is reused
+// for the new entry. As a result neither 'put' nor 'get' allocate
+// (beyond any copying done by the key/value types themselves) and
+// evicting an entry never requires looking its key up again.
 template <typename Key, typename Value>
 class cache
 {
 public:
-  typedef std::list<Key> list;
-  typedef std::tr1::unordered_map<
-    Key, std::pair<Value, typename list::iterator> > map;
+  // Returns the "weight" of an entry, e.g., its size in bytes.
+  typedef std::tr1::function<size_t(const Key&, const Value&)> Weigher;
+
+  // Computes the value for a key that isn't in the cache.
+  typedef std::tr1::function<Try<Value>(const Key&)> Loader;
+
+  // Creates a cache of at most 'capacity' entries or, if a weigher is
+  // provided, of entries weighing at most 'capacity' in total.
+  explicit cache(
+      size_t _capacity,
+      Eviction::Policy _policy = Eviction::LRU,
+      const Weigher& _weigher = Weigher())
+    : capacity(_capacity),
+      policy(_policy),
+      weigher(_weigher),
+      nodes(NULL),
+      pool(0),
+      used(0),
+      free(NIL),
+      buckets(NULL),
+      mask(0),
+      count(0),
+      weight(0),
+      hand(0)
+  {
+    for (int i = 0; i < LISTS; i++) {
+      lists[i].head = NIL;
+      lists[i].tail = NIL;
+      lists[i].weight = 0;
+    }
 
-  explicit cache(int _capacity) : capacity(_capacity) {}
+    // Divide up the capacity for Window TinyLFU: the window gets 1%
+    // and the protected segment 80% of the rest.
+    window = capacity / 100;
+    if (window == 0 && capacity > 0) {
+      window = 1;
+    }
+    protect = (capacity - window) * 8 / 10;
+
+    // Without a weigher we know exactly how many nodes we need so we
+    // allocate them now (although Window TinyLFU briefly needs an
+    // extra node since it decides what to evict after inserting).
+    size_t size = 0;
+    if (!weigher) {
+      size = policy == Eviction::WINDOW_TINYLFU ? capacity + 1 : capacity;
+    }
+
+    rehash(size);
+    reserve(size);
+
+    if (policy == Eviction::WINDOW_TINYLFU) {
+      sketch.resize(size);
+    }
+  }
+
+  ~cache()
+  {
+    for (size_t i = 0; i < used; i++) {
+      if (nodes[i].list != FREE) {
+        nodes[i].entry().~Entry();
+      }
+    }
+    delete[] nodes;
+    delete[] buckets;
+  }
 
   void put(const Key& key, const Value& value)
   {
-    typename map::iterator i = values.find(key);
-    if (i == values.end()) {
-      insert(key, value);
+    put(key, value, hasher(key));
+  }
+
+  Option<Value> get(const Key& key)
+  {
+    Option<Value> value = get(key, hasher(key));
+    if (value.isSome()) {
+      statistics.hits++;
     } else {
-      (*i).second.first = value;
-      use(i);
+      statistics.misses++;
     }
+    return value;
   }
 
-  Option<Value> get(const Key& key)
+  // Returns the value for the key, using the loader to compute (and
+  // then cache) the value if it isn't in the cache. Errors returned
+  // by the loader are not cached.
+  Try<Value> getOrLoad(const Key& key, const Loader& loader)
   {
-    typename map::iterator i = values.find(key);
+    size_t hash = hasher(key);
 
-    if (i != values.end()) {
-      use(i);
-      return (*i).second.first;
+    Option<Value> value = get(key, hash);
+    if (value.isSome()) {
+      statistics.hits++;
+      return value.get();
     }
 
-    return None();
+    statistics.misses++;
+
+    Stopwatch stopwatch;
+    stopwatch.start();
+
+    Try<Value> result = loader(key);
+
+    stopwatch.stop();
+    statistics.loading += stopwatch.elapsed();
+
+    if (result.isSome()) {
+      statistics.loads++;
+      put(key, result.get(), hash);
+    } else {
+      statistics.failures++;
+    }
+
+    return result;
+  }
+
+  // NOTE: Lookups done via a sharded_cache are counted by the
+  // sharded_cache rather than here.
+  CacheStats stats() const
+  {
+    return statistics;
+  }
+
+  // Returns the number of entries in the cache.
+  size_t size() const
+  {
+    return count;
+  }
+
+  // Returns the total weight of the entries in the cache (the same as
+  // 'size' if no weigher was provided).
+  size_t weighs() const
+  {
+    return weight;
+  }
+
+  // Returns the number of bytes used by the cache itself (the node
+  // pool, the hash buckets and the frequency sketch), excluding any
+  // memory that the keys or values might have allocated on their own.
+  size_t footprint() const
+  {
+    return sizeof(*this) +
+      sizeof(Node) * pool +
+      sizeof(uint32_t) * (mask + 1) +
+      sketch.footprint();
   }
 
 private:
@@ -68,62 +262,633 @@ private:
       std::ostream& stream,
       const cache<Key, Value>& c);
 
+  // A sharded cache has already computed the hash of the key in
+  // order to pick a shard so let it pass the hash along.
+  friend class sharded_cache<Key, Value>;
+
+  // Nodes refer to each other by their index in the pool (rather
+  // than by pointer) which keeps them small and lets the pool grow.
+  // NIL terminates a list.
+  static const uint32_t NIL = 0xFFFFFFFF;
+
+  // The lists a node can be on. LRU uses only the WINDOW list (i.e.,
+  // it is a Window TinyLFU cache that is all window) and CLOCK uses
+  // no list at all. Unused nodes are FREE.
+  enum {
+    WINDOW,
+    PROBATION,
+    PROTECTED,
+    LISTS,
+    FREE = LISTS
+  };
+
+  struct Entry
+  {
+    Entry(const Key& _key, const Value& _value)
+      : key(_key), value(_value) {}
+
+    Key key;
+    Value value;
+  };
+
+  struct Node
+  {
+    // The entry is only constructed while the node is in use.
+    Entry& entry()
+    {
+      return *reinterpret_cast<Entry*>(storage.address());
+    }
+
+    const Entry& entry() const
+    {
+      return *reinterpret_cast<const Entry*>(storage.address());
+    }
+
+    boost::aligned_storage<
+      sizeof(Entry), boost::alignment_of<Entry>::value> storage;
+
+    size_t hash; // Cached so we never need to rehash the key.
+    size_t weight;
+    uint32_t prev; // Less-recently used neighbor.
+    uint32_t next; // More-recently used neighbor (or next FREE node).
+    uint32_t chain; // Next node in the same hash bucket.
+    uint32_t unchain; // Previous node in the same hash bucket.
+    uint8_t list;
+    bool referenced; // Used since the last CLOCK sweep.
+  };
+
+  struct List
+  {
+    uint32_t head; // Least-recently used.
+    uint32_t tail; // Most-recently used.
+    size_t weight;
+  };
+
+  // A count-min sketch of 4-bit counters, 16 to a word, used to
+  // estimate how often a key has been used.
+  class Sketch
+  {
+  public:
+    Sketch() : mask(0), additions(0), period(0) {}
+
+    // Resets the sketch with enough counters for 'entries' keys.
+    void resize(size_t entries)
+    {
+      size_t size = 16;
+      while (size < entries) {
+        size <<= 1;
+      }
+      table.assign(size, 0);
+      mask = size - 1;
+      additions = 0;
+      period = size * 10;
+    }
+
+    size_t size() const
+    {
+      return table.size();
+    }
+
+    size_t footprint() const
+    {
+      return sizeof(uint64_t) * table.capacity();
+    }
+
+    void increment(size_t hash)
+    {
+      bool added = false;
+      for (int i = 0; i < 4; i++) {
+        size_t index;
+        int shift;
+        locate(hash, i, &index, &shift);
+        if (((table[index] >> shift) & 0xF) < 0xF) {
+          table[index] += static_cast<uint64_t>(1) << shift;
+          added = true;
+        }
+      }
+
+      // Halve all the counters periodically so that the frequencies
+      // reflect recent history.
+      if (added && ++additions == period) {
+        for (size_t i = 0; i < table.size(); i++) {
+          table[i] = (table[i] >> 1) & 0x7777777777777777ULL;
+        }
+        additions /= 2;
+      }
+    }
+
+    unsigned frequency(size_t hash) const
+    {
+      unsigned result = 0xF;
+      for (int i = 0; i < 4; i++) {
+        size_t index;
+        int shift;
+        locate(hash, i, &index, &shift);
+        unsigned counter = (table[index] >> shift) & 0xF;
+        if (counter < result) {
+          result = counter;
+        }
+      }
+      return result;
+    }
+
+  private:
+    // Determines the word and the counter within the word for the
+    // i'th of the hash functions.
+    void locate(size_t hash, int i, size_t* index, int* shift) const
+    {
+      static const uint64_t SEEDS[] = {
+        0xC3A5C85C97CB3127ULL,
+        0xB492B66FBE98F273ULL,
+        0x9AE16A3B2F90404FULL,
+        0xCBF29CE484222325ULL
+      };
+
+      uint64_t h = static_cast<uint64_t>(hash) * SEEDS[i];
+      h ^= h >> 29;
+      *index = static_cast<size_t>(h >> 4) & mask;
+      *shift = static_cast<int>(h & 0xF) << 2;
+    }
+
+    std::vector<uint64_t> table;
+    size_t mask;
+    size_t additions;
+    size_t period;
+  };
+
+  void put(const Key& key, const Value& value, size_t hash)
+  {
+    uint32_t i = find(key, hash);
+    if (i == NIL) {
+      insert(key, value, hash);
+    } else {
+      update(i, value);
+    }
+  }
+
+  // NOTE: When using Eviction::CLOCK this does not modify anything
+  // other than the entry's reference bit (atomically) and can thus
+  // be invoked concurrently with other invocations of this 'get'
+  // (which is how a sharded_cache uses it).
+  Option<Value> get(const Key& key, size_t hash)
+  {
+    uint32_t i = find(key, hash);
+
+    if (i != NIL) {
+      use(i);
+      return nodes[i].entry().value;
+    }
+
+    if (policy == Eviction::WINDOW_TINYLFU) {
+      sketch.increment(hash); // Misses count towards the frequency.
+    }
+
+    return None();
+  }
+
+  // Returns the index of the node for the key or NIL.
+  uint32_t find(const Key& key, size_t hash) const
+  {
+    uint32_t i = buckets[hash & mask];
+    while (i != NIL) {
+      const Node& node = nodes[i];
+      if (node.hash == hash && node.entry().key == key) {
+        return i;
+      }
+      i = node.chain;
+    }
+    return NIL;
+  }
+
   // Insert key/value into the cache.
-  void insert(const Key& key, const Value& value)
+  void insert(const Key& key, const Value& value, size_t hash)
+  {
+    size_t w = weigher ? weigher(key, value) : 1;
+
+    if (w > capacity) {
+      return; // It would never fit.
+    }
+
+    uint32_t i;
+
+    if (!weigher && policy != Eviction::WINDOW_TINYLFU && count == capacity) {
+      // Evict an element from the cache by reusing its node for the
+      // new entry.
+      i = victim();
+      if (policy != Eviction::CLOCK) {
+        unlink(i);
+      }
+      unchain(i);
+
+      statistics.evictions++;
+
+      Node& node = nodes[i];
+      node.entry().key = key;
+      node.entry().value = value;
+      node.hash = hash;
+      node.referenced = false;
+    } else {
+      i = allocate();
+
+      Node& node = nodes[i];
+      new (node.storage.address()) Entry(key, value);
+      node.hash = hash;
+      node.weight = w;
+      node.referenced = false;
+      node.list = WINDOW;
+
+      count++;
+      weight += w;
+    }
+
+    chain(i);
+
+    if (policy != Eviction::CLOCK) {
+      link(WINDOW, i);
+    }
+
+    if (policy == Eviction::WINDOW_TINYLFU) {
+      sketch.increment(hash);
+    }
+
+    shrink();
+  }
+
+  // Updates the value (and weight) of an entry in the cache.
+  void update(uint32_t i, const Value& value)
   {
-    if (keys.size() == capacity) {
-      evict();
+    Node& node = nodes[i];
+    node.entry().value = value;
+
+    use(i);
+
+    if (weigher) {
+      size_t w = weigher(node.entry().key, value);
+      if (node.list != FREE && policy != Eviction::CLOCK) {
+        lists[node.list].weight += w - node.weight;
+      }
+      weight += w - node.weight;
+      node.weight = w;
+
+      if (w > capacity) {
+        remove(i); // It no longer fits.
+        statistics.evictions++;
+      }
+
+      shrink();
     }
+  }
 
-    // Get a "pointer" into the lru list for efficient update.
-    typename list::iterator i = keys.insert(keys.end(), key);
+  // Evicts entries until the cache is within its capacity.
+  void shrink()
+  {
+    if (policy == Eviction::WINDOW_TINYLFU) {
+      while (lists[WINDOW].weight > window) {
+        admit(lists[WINDOW].head);
+      }
+    }
 
-    // Save key/value and "pointer" into lru list.
-    values.insert(std::make_pair(key, std::make_pair(value, i)));
+    while (weight > capacity) {
+      remove(victim());
+      statistics.evictions++;
+    }
   }
 
-  // Updates the LRU ordering in the cache for the given iterator.
-  void use(const typename map::iterator& i)
+  // Moves the least-recently used entry of the window into the main
+  // cache if it is used more frequently than the entries it would
+  // replace, otherwise evicts it.
+  void admit(uint32_t candidate)
   {
-    // Move the "pointer" to the end of the lru list.
-    keys.splice(keys.end(), keys, (*i).second.second);
+    const size_t main = capacity - window;
+    const unsigned frequency = sketch.frequency(nodes[candidate].hash);
+
+    while (lists[PROBATION].weight +
+           lists[PROTECTED].weight +
+           nodes[candidate].weight > main) {
+      uint32_t i = lists[PROBATION].head != NIL
+        ? lists[PROBATION].head
+        : lists[PROTECTED].head;
 
-    // Now update the "pointer" so we can do this again.
-    (*i).second.second = --keys.end();
+      if (i == NIL) {
+        break; // Let 'shrink' sort it out.
+      } else if (frequency > sketch.frequency(nodes[i].hash)) {
+        remove(i);
+        statistics.evictions++;
+      } else {
+        remove(candidate);
+        statistics.evictions++;
+        return;
+      }
+    }
+
+    unlink(candidate);
+    link(PROBATION, candidate);
   }
 
-  // Evict the least-recently used element from the cache.
-  void evict()
+  // Picks the next entry to evict.
+  uint32_t victim()
   {
-    const typename map::iterator& i = values.find(keys.front());
-    CHECK(i != values.end());
-    values.erase(i);
-    keys.pop_front();
+    if (policy == Eviction::CLOCK) {
+      // Sweep the pool giving each referenced node a second chance.
+      // This terminates since we clear the bits as we go.
+      while (true) {
+        uint32_t i = hand;
+        hand = (hand + 1) % used;
+        if (nodes[i].list != FREE) {
+          if (!nodes[i].referenced) {
+            return i;
+          }
+          nodes[i].referenced = false;
+        }
+      }
+    }
+
+    for (int list = 0; list < LISTS; list++) {
+      // Prefer evicting from the probation segment (which always
+      // has the least valuable entries), then protected, then window.
+      static const int ORDER[] = { PROBATION, PROTECTED, WINDOW };
+      if (lists[ORDER[list]].head != NIL) {
+        return lists[ORDER[list]].head;
+      }
+    }
+
+    return NIL;
+  }
+
+  // Updates the eviction ordering in the cache for the given node.
+  void use(uint32_t i)
+  {
+    Node& node = nodes[i];
+
+    if (policy == Eviction::CLOCK) {
+      // Avoid dirtying the cache line (and racing with concurrent
+      // readers) if the bit is already set.
+      if (!node.referenced) {
+        (void) __sync_lock_test_and_set(&node.referenced, true);
+      }
+      return;
+    }
+
+    if (policy == Eviction::WINDOW_TINYLFU) {
+      sketch.increment(node.hash);
+
+      if (node.list == PROBATION) {
+        // Promote the entry and demote the least-recently used
+        // protected entries if the protected segment is now full.
+        unlink(i);
+        link(PROTECTED, i);
+        while (lists[PROTECTED].weight > protect) {
+          uint32_t j = lists[PROTECTED].head;
+          unlink(j);
+          link(PROBATION, j);
+        }
+        return;
+      }
+    }
+
+    if (i != lists[node.list].tail) {
+      int list = node.list;
+      unlink(i);
+      link(list, i);
+    }
+  }
+
+  // Removes the entry from the cache, freeing its node.
+  void remove(uint32_t i)
+  {
+    Node& node = nodes[i];
+
+    if (policy != Eviction::CLOCK) {
+      unlink(i);
+    }
+    unchain(i);
+
+    count--;
+    weight -= node.weight;
+
+    node.entry().~Entry();
+    node.list = FREE;
+    node.next = free;
+    free = i;
+  }
+
+  // Returns an unused node, growing the pool if necessary.
+  uint32_t allocate()
+  {
+    if (free != NIL) {
+      uint32_t i = free;
+      free = nodes[i].next;
+      return i;
+    }
+
+    if (used == pool) {
+      reserve(pool == 0 ? 16 : pool * 2);
+      if (mask + 1 < pool) {
+        rehash(pool);
+      }
+      if (policy == Eviction::WINDOW_TINYLFU && sketch.size() < pool) {
+        sketch.resize(pool);
+      }
+    }
+
+    return used++;
+  }
+
+  // Grows the pool to 'size' nodes.
+  void reserve(size_t size)
+  {
+    if (size <= pool) {
+      return;
+    }
+
+    Node* previous = nodes;
+    nodes = new Node[size];
+
+    for (size_t i = 0; i < used; i++) {
+      Node& node = nodes[i];
+      node.hash = previous[i].hash;
+      node.weight = previous[i].weight;
+      node.prev = previous[i].prev;
+      node.next = previous[i].next;
+      node.chain = previous[i].chain;
+      node.unchain = previous[i].unchain;
+      node.list = previous[i].list;
+      node.referenced = previous[i].referenced;
+
+      if (node.list != FREE) {
+        new (node.storage.address()) Entry(previous[i].entry());
+        previous[i].entry().~Entry();
+      }
+    }
+
+    delete[] previous;
+    pool = size;
+  }
+
+  // Sets the number of hash buckets to at least 'size' (a power of
+  // two so we can map a hash to a bucket with a mask).
+  void rehash(size_t size)
+  {
+    size_t count = 1;
+    while (count < size) {
+      count <<= 1;
+    }
+
+    delete[] buckets;
+    buckets = new uint32_t[count];
+    mask = count - 1;
+
+    for (size_t i = 0; i < count; i++) {
+      buckets[i] = NIL;
+    }
+
+    for (size_t i = 0; i < used; i++) {
+      if (nodes[i].list != FREE) {
+        chain(i);
+      }
+    }
+  }
+
+  // Appends the node to the most-recently used end of the list.
+  void link(int list, uint32_t i)
+  {
+    Node& node = nodes[i];
+    List& l = lists[list];
+    node.list = list;
+    node.prev = l.tail;
+    node.next = NIL;
+    if (l.tail != NIL) {
+      nodes[l.tail].next = i;
+    } else {
+      l.head = i;
+    }
+    l.tail = i;
+    l.weight += node.weight;
+  }
+
+  // Removes the node from its list.
+  void unlink(uint32_t i)
+  {
+    Node& node = nodes[i];
+    List& l = lists[node.list];
+    if (node.prev != NIL) {
+      nodes[node.prev].next = node.next;
+    } else {
+      l.head = node.next;
+    }
+    if (node.next != NIL) {
+      nodes[node.next].prev = node.prev;
+    } else {
+      l.tail = node.prev;
+    }
+    l.weight -= node.weight;
+  }
+
+  // Pushes the node onto the front of its hash bucket chain.
+  void chain(uint32_t i)
+  {
+    Node& node = nodes[i];
+    uint32_t& bucket = buckets[node.hash & mask];
+    node.chain = bucket;
+    node.unchain = NIL;
+    if (bucket != NIL) {
+      nodes[bucket].unchain = i;
+    }
+    bucket = i;
+  }
+
+  // Removes the node from its hash bucket chain.
+  void unchain(uint32_t i)
+  {
+    Node& node = nodes[i];
+    if (node.unchain != NIL) {
+      nodes[node.unchain].chain = node.chain;
+    } else {
+      buckets[node.hash & mask] = node.chain;
+    }
+    if (node.chain != NIL) {
+      nodes[node.chain].unchain = node.unchain;
+    }
   }
 
   // Size of the cache.
-  int capacity;
+  const size_t capacity;
+
+  const Eviction::Policy policy;
+
+  const Weigher weigher;
+
+  std::tr1::hash<Key> hasher;
 
-  // Cache of values and "pointers" into the least-recently used list.
-  map values;
+  // Pool of nodes, the first 'used' have been handed out at least
+  // once and the FREE ones among those are linked from 'free'.
+  Node* nodes;
+  size_t pool;
+  size_t used;
+  uint32_t free;
 
-  // Keys ordered by least-recently used.
-  list keys;
+  // Heads of the hash bucket chains.
+  uint32_t* buckets;
+  size_t mask;
+
+  // Number of entries and their total weight.
+  size_t count;
+  size_t weight;
+
+  // Eviction lists (see above). The head of a list is the least
+  // recently used entry and thus the next to be evicted.
+  List lists[LISTS];
+
+  // Capacity of the WINDOW and PROTECTED lists. Only used for
+  // Window TinyLFU.
+  size_t window;
+  size_t protect;
+
+  // Position of the CLOCK sweep in the pool. Only used for CLOCK.
+  uint32_t hand;
+
+  // Estimated frequencies. Only used for Window TinyLFU.
+  Sketch sketch;
+
+  CacheStats statistics;
 };
 
 
+template <typename Key, typename Value>
+const uint32_t cache<Key, Value>::NIL;
+
+
 template <typename Key, typename Value>
 std::ostream& operator << (
     std::ostream& stream,
     const cache<Key, Value>& c)
 {
-  typename cache<Key, Value>::list::const_iterator i1;
-  for (i1 = c.keys.begin(); i1 != c.keys.end(); i1++) {
-    stream << *i1 << ": ";
-    typename cache<Key, Value>::map::const_iterator i2;
-    i2 = c.values.find(*i1);
-    CHECK(i2 != c.values.end());
-    stream << *i2 << std::endl;
+  if (c.policy == Eviction::CLOCK) {
+    // There is no strict order, start where the next sweep starts.
+    for (size_t n = 0; n < c.used; n++) {
+      size_t i = (c.hand + n) % c.used;
+      if (c.nodes[i].list != cache<Key, Value>::FREE) {
+        stream << c.nodes[i].entry().key << ": "
+               << c.nodes[i].entry().value << std::endl;
+      }
+    }
+    return stream;
+  }
+
+  // Output the lists in the order they get evicted from.
+  static const int ORDER[] = {
+    cache<Key, Value>::PROBATION,
+    cache<Key, Value>::PROTECTED,
+    cache<Key, Value>::WINDOW
+  };
+
+  for (int list = 0; list < cache<Key, Value>::LISTS; list++) {
+    uint32_t i = c.lists[ORDER[list]].head;
+    while (i != cache<Key, Value>::NIL) {
+      stream << c.nodes[i].entry().key << ": "
+             << c.nodes[i].entry().value << std::endl;
+      i = c.nodes[i].next;
+    }
   }
   return stream;
 }
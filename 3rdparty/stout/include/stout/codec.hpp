@@ -0,0 +1,760 @@
+#ifndef __STOUT_CODEC_HPP__
+#define __STOUT_CODEC_HPP__
+
+#ifdef HAVE_LIBLZ4
+#include <lz4frame.h>
+#endif
+
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "error.hpp"
+#include "gzip.hpp"
+#include "nothing.hpp"
+#include "option.hpp"
+#include "owned.hpp"
+#include "try.hpp"
+
+// A common interface to the available compression codecs. The gzip
+// codec is always present (but fails without libz, see gzip.hpp).
+// Faster codecs are included when their libraries were found at
+// configure time:
+//
+//   HAVE_LIBLZ4   "lz4"   LZ4 frames (lz4frame.h), fastest.
+//   HAVE_LIBZSTD  "zstd"  Zstandard frames, much better ratio than
+//                         lz4 at a similar speed to gzip -1.
+//
+// For example:
+//
+//   Try<codec::Codec*> codec = codec::get("lz4");
+//   ...
+//   std::string compressed;
+//   codec.get()->compress(data, &compressed);
+namespace codec {
+
+// Incrementally (de)compresses chunks of input, passing the output to
+// a sink (see gzip::Compressor and gzip::Decompressor).
+class Stream
+{
+public:
+  virtual ~Stream() {}
+
+  virtual Try<Nothing> write(const char* data, size_t size) = 0;
+
+  // Flushes any remaining output. For a decompressor this also
+  // verifies that the input was complete.
+  virtual Try<Nothing> finish() = 0;
+
+  Try<Nothing> write(const std::string& data)
+  {
+    return write(data.data(), data.size());
+  }
+};
+
+
+typedef gzip::Sink Sink;
+
+
+class Codec
+{
+public:
+  virtual ~Codec() {}
+
+  virtual std::string name() const = 0;
+
+  // Replaces the contents of 'output' with the (de)compressed input,
+  // reusing the capacity of 'output'.
+  virtual Try<Nothing> compress(
+      const std::string& input,
+      std::string* output) const = 0;
+
+  virtual Try<Nothing> decompress(
+      const std::string& input,
+      std::string* output) const = 0;
+
+  // Returns streams that (de)compress into the sink using a bounded
+  // amount of memory.
+  virtual Owned<Stream> compressor(const Sink& sink) const = 0;
+  virtual Owned<Stream> decompressor(const Sink& sink) const = 0;
+};
+
+
+namespace internal {
+
+// Adapts gzip::Compressor and gzip::Decompressor to Stream.
+template <typename T>
+class GzipStream : public Stream
+{
+public:
+  explicit GzipStream(const Sink& sink) : t(sink) {}
+
+  virtual Try<Nothing> write(const char* data, size_t size)
+  {
+    return t.write(data, size);
+  }
+
+  virtual Try<Nothing> finish()
+  {
+    return t.finish();
+  }
+
+private:
+  T t;
+};
+
+
+class Gzip : public Codec
+{
+public:
+  virtual std::string name() const
+  {
+    return "gzip";
+  }
+
+  virtual Try<Nothing> compress(
+      const std::string& input,
+      std::string* output) const
+  {
+    return gzip::compress(input, output);
+  }
+
+  virtual Try<Nothing> decompress(
+      const std::string& input,
+      std::string* output) const
+  {
+    return gzip::decompress(input, output);
+  }
+
+  virtual Owned<Stream> compressor(const Sink& sink) const
+  {
+    return Owned<Stream>(new GzipStream<gzip::Compressor>(sink));
+  }
+
+  virtual Owned<Stream> decompressor(const Sink& sink) const
+  {
+    return Owned<Stream>(new GzipStream<gzip::Decompressor>(sink));
+  }
+};
+
+
+#ifdef HAVE_LIBLZ4
+// We compress (at most) this much input at a time when streaming so
+// that the output buffer stays small.
+#define CODEC_LZ4_CHUNK_SIZE 65536
+
+
+class Lz4Compressor : public Stream
+{
+public:
+  explicit Lz4Compressor(const Sink& _sink)
+    : sink(_sink), context(NULL), started(false), finished(false)
+  {
+    memset(&preferences, 0, sizeof(preferences));
+
+    size_t code = LZ4F_createCompressionContext(&context, LZ4F_VERSION);
+    if (LZ4F_isError(code)) {
+      error = std::string(LZ4F_getErrorName(code));
+      context = NULL;
+    }
+
+    buffer.resize(LZ4F_compressBound(CODEC_LZ4_CHUNK_SIZE, &preferences));
+  }
+
+  virtual ~Lz4Compressor()
+  {
+    if (context != NULL) {
+      LZ4F_freeCompressionContext(context);
+    }
+  }
+
+  virtual Try<Nothing> write(const char* data, size_t size)
+  {
+    Try<Nothing> begun = begin();
+    if (begun.isError()) {
+      return begun;
+    }
+
+    while (size > 0) {
+      size_t length = std::min<size_t>(size, CODEC_LZ4_CHUNK_SIZE);
+      Try<Nothing> written = emit(LZ4F_compressUpdate(
+          context, &buffer[0], buffer.size(), data, length, NULL));
+      if (written.isError()) {
+        return written;
+      }
+      data += length;
+      size -= length;
+    }
+
+    return Nothing();
+  }
+
+  virtual Try<Nothing> finish()
+  {
+    Try<Nothing> begun = begin();
+    if (begun.isError()) {
+      return begun;
+    }
+
+    finished = true;
+    return emit(LZ4F_compressEnd(context, &buffer[0], buffer.size(), NULL));
+  }
+
+private:
+  // Writes the frame header (once).
+  Try<Nothing> begin()
+  {
+    if (error.isSome()) {
+      return Error(error.get());
+    } else if (finished) {
+      return Error("Compressor has already been finished");
+    } else if (started) {
+      return Nothing();
+    }
+
+    started = true;
+    return emit(LZ4F_compressBegin(
+        context, &buffer[0], buffer.size(), &preferences));
+  }
+
+  // Passes 'size' bytes of the buffer to the sink (unless 'size' is
+  // an LZ4 error code).
+  Try<Nothing> emit(size_t size)
+  {
+    if (LZ4F_isError(size)) {
+      error = std::string(LZ4F_getErrorName(size));
+      return Error(error.get());
+    } else if (size > 0) {
+      Try<Nothing> consumed = sink(&buffer[0], size);
+      if (consumed.isError()) {
+        error = consumed.error();
+        return Error(error.get());
+      }
+    }
+    return Nothing();
+  }
+
+  Sink sink;
+  LZ4F_compressionContext_t context;
+  LZ4F_preferences_t preferences;
+  std::vector<char> buffer;
+  Option<std::string> error;
+  bool started;
+  bool finished;
+};
+
+
+class Lz4Decompressor : public Stream
+{
+public:
+  explicit Lz4Decompressor(const Sink& _sink)
+    : sink(_sink), context(NULL), ended(false)
+  {
+    size_t code = LZ4F_createDecompressionContext(&context, LZ4F_VERSION);
+    if (LZ4F_isError(code)) {
+      error = std::string(LZ4F_getErrorName(code));
+      context = NULL;
+    }
+  }
+
+  virtual ~Lz4Decompressor()
+  {
+    if (context != NULL) {
+      LZ4F_freeDecompressionContext(context);
+    }
+  }
+
+  virtual Try<Nothing> write(const char* data, size_t size)
+  {
+    if (error.isSome()) {
+      return Error(error.get());
+    }
+
+    // NOTE: Like gunzip, concatenated frames are decompressed into
+    // the concatenation of their contents. We keep going while the
+    // buffer gets filled since more output might still be pending.
+    size_t produced = GZIP_BUFFER_SIZE;
+    while (size > 0 || produced == GZIP_BUFFER_SIZE) {
+      size_t consumed = size;
+      produced = GZIP_BUFFER_SIZE;
+      size_t code = LZ4F_decompress(
+          context, buffer, &produced, data, &consumed, NULL);
+
+      if (LZ4F_isError(code)) {
+        error = std::string(LZ4F_getErrorName(code));
+        return Error(error.get());
+      }
+
+      ended = code == 0; // The end of a frame.
+      data += consumed;
+      size -= consumed;
+
+      if (produced > 0) {
+        Try<Nothing> written = sink(buffer, produced);
+        if (written.isError()) {
+          error = written.error();
+          return Error(error.get());
+        }
+      }
+    }
+
+    return Nothing();
+  }
+
+  virtual Try<Nothing> finish()
+  {
+    if (error.isSome()) {
+      return Error(error.get());
+    } else if (!ended) {
+      return Error("Truncated lz4 frame");
+    }
+    return Nothing();
+  }
+
+private:
+  Sink sink;
+  LZ4F_decompressionContext_t context;
+  char buffer[GZIP_BUFFER_SIZE];
+  Option<std::string> error;
+  bool ended;
+};
+
+
+class Lz4 : public Codec
+{
+public:
+  virtual std::string name() const
+  {
+    return "lz4";
+  }
+
+  virtual Try<Nothing> compress(
+      const std::string& input,
+      std::string* output) const
+  {
+    LZ4F_preferences_t preferences;
+    memset(&preferences, 0, sizeof(preferences));
+
+    // Record the size so that decompression can allocate once.
+    preferences.frameInfo.contentSize = input.size();
+
+    output->resize(LZ4F_compressFrameBound(input.size(), &preferences));
+
+    size_t size = LZ4F_compressFrame(
+        &(*output)[0],
+        output->size(),
+        input.data(),
+        input.size(),
+        &preferences);
+
+    if (LZ4F_isError(size)) {
+      output->clear();
+      return Error(LZ4F_getErrorName(size));
+    }
+
+    output->resize(size);
+    return Nothing();
+  }
+
+  virtual Try<Nothing> decompress(
+      const std::string& input,
+      std::string* output) const
+  {
+    LZ4F_decompressionContext_t context;
+    size_t code = LZ4F_createDecompressionContext(&context, LZ4F_VERSION);
+    if (LZ4F_isError(code)) {
+      return Error(LZ4F_getErrorName(code));
+    }
+
+    const char* data = input.data();
+    size_t size = input.size();
+
+    // Use the content size from the frame header (when present) to
+    // size the output up front.
+    LZ4F_frameInfo_t info;
+    size_t consumed = size;
+    code = LZ4F_getFrameInfo(context, &info, data, &consumed);
+    if (LZ4F_isError(code)) {
+      LZ4F_freeDecompressionContext(context);
+      output->clear();
+      return Error(LZ4F_getErrorName(code));
+    }
+
+    data += consumed;
+    size -= consumed;
+
+    // NOTE: One extra byte lets the end of the frame be consumed
+    // without first growing an exactly sized output. The size is
+    // bounded by the best possible ratio (255:1) so that a corrupt
+    // header can't cause a huge allocation.
+    output->resize(info.contentSize > 0
+        ? std::min<size_t>(info.contentSize + 1, input.size() * 255)
+        : 2 * input.size() + GZIP_BUFFER_SIZE);
+
+    size_t offset = 0;
+    bool full = false; // Whether the output was filled last time.
+    while (code != 0) {
+      if (offset == output->size()) {
+        output->resize(output->size() * 2);
+      }
+
+      if (size == 0 && !full) {
+        LZ4F_freeDecompressionContext(context);
+        output->clear();
+        return Error("Truncated lz4 frame");
+      }
+
+      size_t produced = output->size() - offset;
+      consumed = size;
+      code = LZ4F_decompress(
+          context, &(*output)[offset], &produced, data, &consumed, NULL);
+
+      if (LZ4F_isError(code)) {
+        LZ4F_freeDecompressionContext(context);
+        output->clear();
+        return Error(LZ4F_getErrorName(code));
+      }
+
+      full = produced == output->size() - offset;
+      offset += produced;
+      data += consumed;
+      size -= consumed;
+    }
+
+    LZ4F_freeDecompressionContext(context);
+
+    output->resize(offset);
+    return Nothing();
+  }
+
+  virtual Owned<Stream> compressor(const Sink& sink) const
+  {
+    return Owned<Stream>(new Lz4Compressor(sink));
+  }
+
+  virtual Owned<Stream> decompressor(const Sink& sink) const
+  {
+    return Owned<Stream>(new Lz4Decompressor(sink));
+  }
+};
+#endif // HAVE_LIBLZ4
+
+
+#ifdef HAVE_LIBZSTD
+// Favor speed, this is what "zstd -1" uses.
+#define CODEC_ZSTD_LEVEL 1
+
+
+class ZstdCompressor : public Stream
+{
+public:
+  explicit ZstdCompressor(const Sink& _sink)
+    : sink(_sink), stream(ZSTD_createCStream()), finished(false)
+  {
+    if (stream == NULL) {
+      error = std::string("Failed to create zstd stream");
+    } else {
+      size_t code = ZSTD_initCStream(stream, CODEC_ZSTD_LEVEL);
+      if (ZSTD_isError(code)) {
+        error = std::string(ZSTD_getErrorName(code));
+      }
+    }
+
+    buffer.resize(ZSTD_CStreamOutSize());
+  }
+
+  virtual ~ZstdCompressor()
+  {
+    if (stream != NULL) {
+      ZSTD_freeCStream(stream);
+    }
+  }
+
+  virtual Try<Nothing> write(const char* data, size_t size)
+  {
+    if (error.isSome()) {
+      return Error(error.get());
+    } else if (finished) {
+      return Error("Compressor has already been finished");
+    }
+
+    ZSTD_inBuffer in = { data, size, 0 };
+    while (in.pos < in.size) {
+      ZSTD_outBuffer out = { &buffer[0], buffer.size(), 0 };
+      Try<Nothing> written = emit(ZSTD_compressStream(stream, &out, &in), out);
+      if (written.isError()) {
+        return written;
+      }
+    }
+
+    return Nothing();
+  }
+
+  virtual Try<Nothing> finish()
+  {
+    if (error.isSome()) {
+      return Error(error.get());
+    } else if (finished) {
+      return Error("Compressor has already been finished");
+    }
+
+    finished = true;
+
+    size_t remaining;
+    do {
+      ZSTD_outBuffer out = { &buffer[0], buffer.size(), 0 };
+      remaining = ZSTD_endStream(stream, &out);
+      Try<Nothing> written = emit(remaining, out);
+      if (written.isError()) {
+        return written;
+      }
+    } while (remaining > 0);
+
+    return Nothing();
+  }
+
+private:
+  // Passes the output to the sink (unless 'code' is a zstd error).
+  Try<Nothing> emit(size_t code, const ZSTD_outBuffer& out)
+  {
+    if (ZSTD_isError(code)) {
+      error = std::string(ZSTD_getErrorName(code));
+      return Error(error.get());
+    } else if (out.pos > 0) {
+      Try<Nothing> consumed = sink(&buffer[0], out.pos);
+      if (consumed.isError()) {
+        error = consumed.error();
+        return Error(error.get());
+      }
+    }
+    return Nothing();
+  }
+
+  Sink sink;
+  ZSTD_CStream* stream;
+  std::vector<char> buffer;
+  Option<std::string> error;
+  bool finished;
+};
+
+
+class ZstdDecompressor : public Stream
+{
+public:
+  explicit ZstdDecompressor(const Sink& _sink)
+    : sink(_sink), stream(ZSTD_createDStream()), ended(false)
+  {
+    if (stream == NULL) {
+      error = std::string("Failed to create zstd stream");
+    } else {
+      size_t code = ZSTD_initDStream(stream);
+      if (ZSTD_isError(code)) {
+        error = std::string(ZSTD_getErrorName(code));
+      }
+    }
+
+    buffer.resize(ZSTD_DStreamOutSize());
+  }
+
+  virtual ~ZstdDecompressor()
+  {
+    if (stream != NULL) {
+      ZSTD_freeDStream(stream);
+    }
+  }
+
+  virtual Try<Nothing> write(const char* data, size_t size)
+  {
+    if (error.isSome()) {
+      return Error(error.get());
+    }
+
+    // Keep going while the buffer gets filled since more output might
+    // still be pending.
+    ZSTD_inBuffer in = { data, size, 0 };
+    ZSTD_outBuffer out = { &buffer[0], buffer.size(), buffer.size() };
+    while (in.pos < in.size || out.pos == out.size) {
+      out.pos = 0;
+      size_t code = ZSTD_decompressStream(stream, &out, &in);
+
+      if (ZSTD_isError(code)) {
+        error = std::string(ZSTD_getErrorName(code));
+        return Error(error.get());
+      }
+
+      ended = code == 0; // The end of a frame.
+
+      if (out.pos > 0) {
+        Try<Nothing> consumed = sink(&buffer[0], out.pos);
+        if (consumed.isError()) {
+          error = consumed.error();
+          return Error(error.get());
+        }
+      }
+    }
+
+    return Nothing();
+  }
+
+  virtual Try<Nothing> finish()
+  {
+    if (error.isSome()) {
+      return Error(error.get());
+    } else if (!ended) {
+      return Error("Truncated zstd frame");
+    }
+    return Nothing();
+  }
+
+private:
+  Sink sink;
+  ZSTD_DStream* stream;
+  std::vector<char> buffer;
+  Option<std::string> error;
+  bool ended;
+};
+
+
+class Zstd : public Codec
+{
+public:
+  virtual std::string name() const
+  {
+    return "zstd";
+  }
+
+  virtual Try<Nothing> compress(
+      const std::string& input,
+      std::string* output) const
+  {
+    output->resize(ZSTD_compressBound(input.size()));
+
+    size_t size = ZSTD_compress(
+        &(*output)[0],
+        output->size(),
+        input.data(),
+        input.size(),
+        CODEC_ZSTD_LEVEL);
+
+    if (ZSTD_isError(size)) {
+      output->clear();
+      return Error(ZSTD_getErrorName(size));
+    }
+
+    output->resize(size);
+    return Nothing();
+  }
+
+  virtual Try<Nothing> decompress(
+      const std::string& input,
+      std::string* output) const
+  {
+    // Frames written by 'compress' record their size, in which case
+    // we can decompress in one go.
+    unsigned long long size =
+      ZSTD_getFrameContentSize(input.data(), input.size());
+
+    // NOTE: A size beyond the best possible ratio (an RLE block turns
+    // 4 bytes into 128KB, i.e., 32768:1) can only come from a corrupt
+    // header, so rather than allocating it we let the streaming path
+    // (which allocates as it goes) report the error.
+    if (size != ZSTD_CONTENTSIZE_UNKNOWN &&
+        size != ZSTD_CONTENTSIZE_ERROR &&
+        size / 32768 <= input.size()) {
+      output->resize(static_cast<size_t>(size));
+
+      size_t decompressed = ZSTD_decompress(
+          output->empty() ? NULL : &(*output)[0],
+          output->size(),
+          input.data(),
+          input.size());
+
+      if (!ZSTD_isError(decompressed)) {
+        output->resize(decompressed);
+        return Nothing();
+      }
+    }
+
+    // Otherwise (e.g., there are multiple frames or the size is
+    // implausible) stream it.
+    output->clear();
+    ZstdDecompressor decompressor(gzip::appender(output));
+
+    Try<Nothing> written = decompressor.write(input.data(), input.size());
+    if (written.isError()) {
+      output->clear();
+      return written;
+    }
+
+    return decompressor.finish();
+  }
+
+  virtual Owned<Stream> compressor(const Sink& sink) const
+  {
+    return Owned<Stream>(new ZstdCompressor(sink));
+  }
+
+  virtual Owned<Stream> decompressor(const Sink& sink) const
+  {
+    return Owned<Stream>(new ZstdDecompressor(sink));
+  }
+};
+#endif // HAVE_LIBZSTD
+
+} // namespace internal {
+
+
+// Returns the names of the available codecs, fastest first.
+inline std::vector<std::string> names()
+{
+  std::vector<std::string> names;
+#ifdef HAVE_LIBLZ4
+  names.push_back("lz4");
+#endif
+#ifdef HAVE_LIBZSTD
+  names.push_back("zstd");
+#endif
+  names.push_back("gzip");
+  return names;
+}
+
+
+// Returns the named codec, or an error if it's unknown or wasn't
+// available at configure time. The codecs are stateless and shared.
+inline Try<Codec*> get(const std::string& name)
+{
+  if (name == "gzip") {
+    static internal::Gzip gzip;
+    return &gzip;
+  }
+
+#ifdef HAVE_LIBLZ4
+  if (name == "lz4") {
+    static internal::Lz4 lz4;
+    return &lz4;
+  }
+#endif // HAVE_LIBLZ4
+
+#ifdef HAVE_LIBZSTD
+  if (name == "zstd") {
+    static internal::Zstd zstd;
+    return &zstd;
+  }
+#endif // HAVE_LIBZSTD
+
+  if (name == "lz4" || name == "zstd") {
+    return Error("Codec '" + name + "' is not available");
+  }
+
+  return Error("Unknown codec '" + name + "'");
+}
+
+} // namespace codec {
+
+#endif // __STOUT_CODEC_HPP__
@@ -0,0 +1,163 @@
+#ifndef __STOUT_CRC32C_HPP__
+#define __STOUT_CRC32C_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+
+// The SSE 4.2 instruction set includes a CRC-32C instruction. Since
+// it might not be available on the machine we're running on, we
+// compile it in (for x86-64 when the compiler supports selecting the
+// target per function) and then check for it at runtime.
+#if defined(__x86_64__) && !defined(__clang__) && \
+  (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define CRC32C_SSE42
+#include <nmmintrin.h>
+#endif
+
+// Computes CRC-32C (Castagnoli) checksums, as used by iSCSI, ext4,
+// LevelDB, etc. It detects more errors in short messages (i.e.,
+// records) than the CRC-32 used by gzip.
+namespace crc32c {
+
+namespace internal {
+
+// Lookup tables for the "slicing-by-8" algorithm which consumes 8
+// bytes at a time: table[0] is the usual byte-at-a-time table and
+// table[k] advances a byte through k additional zero bytes.
+struct Table
+{
+  Table()
+  {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; bit++) {
+        crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+      }
+      values[0][i] = crc;
+    }
+
+    for (uint32_t i = 0; i < 256; i++) {
+      for (int k = 1; k < 8; k++) {
+        uint32_t crc = values[k - 1][i];
+        values[k][i] = (crc >> 8) ^ values[0][crc & 0xFF];
+      }
+    }
+  }
+
+  uint32_t values[8][256];
+};
+
+
+inline const Table& table()
+{
+  static const Table* table = new Table();
+  return *table;
+}
+
+
+// Computes the checksum a byte at a time (or rather 8 bytes at a time
+// on little-endian machines) using the lookup tables.
+inline uint32_t software(uint32_t crc, const char* data, size_t size)
+{
+  const uint32_t (*values)[256] = table().values;
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+
+  crc = ~crc;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (size >= 8) {
+    uint32_t low;
+    uint32_t high;
+    memcpy(&low, p, sizeof(low));
+    memcpy(&high, p + 4, sizeof(high));
+    low ^= crc;
+    crc = values[7][low & 0xFF] ^
+      values[6][(low >> 8) & 0xFF] ^
+      values[5][(low >> 16) & 0xFF] ^
+      values[4][low >> 24] ^
+      values[3][high & 0xFF] ^
+      values[2][(high >> 8) & 0xFF] ^
+      values[1][(high >> 16) & 0xFF] ^
+      values[0][high >> 24];
+    p += 8;
+    size -= 8;
+  }
+#endif // __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+
+  while (size > 0) {
+    crc = values[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    size--;
+  }
+
+  return ~crc;
+}
+
+
+#ifdef CRC32C_SSE42
+inline bool sse42()
+{
+  static const bool supported = __builtin_cpu_supports("sse4.2");
+  return supported;
+}
+
+
+__attribute__((target("sse4.2")))
+inline uint32_t sse42(uint32_t crc, const char* data, size_t size)
+{
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+
+  crc = ~crc;
+
+  uint64_t crc64 = crc;
+  while (size >= 8) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    crc64 = _mm_crc32_u64(crc64, value);
+    p += 8;
+    size -= 8;
+  }
+  crc = static_cast<uint32_t>(crc64);
+
+  while (size > 0) {
+    crc = _mm_crc32_u8(crc, *p++);
+    size--;
+  }
+
+  return ~crc;
+}
+#endif // CRC32C_SSE42
+
+} // namespace internal {
+
+
+// Returns the checksum of the data appended to data with checksum
+// 'crc', i.e., extend(value(a), b) == value(a + b).
+inline uint32_t extend(uint32_t crc, const char* data, size_t size)
+{
+#ifdef CRC32C_SSE42
+  if (internal::sse42()) {
+    return internal::sse42(crc, data, size);
+  }
+#endif // CRC32C_SSE42
+
+  return internal::software(crc, data, size);
+}
+
+
+inline uint32_t value(const char* data, size_t size)
+{
+  return extend(0, data, size);
+}
+
+
+inline uint32_t value(const std::string& s)
+{
+  return value(s.data(), s.size());
+}
+
+} // namespace crc32c {
+
+#endif // __STOUT_CRC32C_HPP__
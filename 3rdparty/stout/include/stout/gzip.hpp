@@ -5,27 +5,216 @@
 #include <zlib.h>
 #endif
 
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <string>
+#include <vector>
+
+#include <tr1/functional>
 
 #include "error.hpp"
+#include "nothing.hpp"
+#include "option.hpp"
+#include "stringify.hpp"
 #include "try.hpp"
 
 // Compression utilities.
-// TODO(bmahler): Provide streaming compression / decompression as well.
 namespace gzip {
 
 // We use a 16KB buffer with zlib compression / decompression.
 #define GZIP_BUFFER_SIZE 16384
 
-// Returns a gzip compressed version of the provided string.
-// The compression level should be within the range [-1, 9].
+// Consumes the output of a Compressor or Decompressor, one chunk at a
+// time. Returning an error aborts the (de)compression.
+typedef std::tr1::function<Try<Nothing>(const char*, size_t)> Sink;
+
+
+namespace internal {
+
+inline Try<Nothing> collect(std::string* s, const char* data, size_t size)
+{
+  s->append(data, size);
+  return Nothing();
+}
+
+} // namespace internal {
+
+
+// Returns a Sink that appends everything written to the string.
+inline Sink appender(std::string* s)
+{
+  return std::tr1::bind(
+      &internal::collect,
+      s,
+      std::tr1::placeholders::_1,
+      std::tr1::placeholders::_2);
+}
+
+
+#ifdef HAVE_LIBZ
+namespace internal {
+
+// The zlib streams used by the one-shot compress / decompress below.
+// Each thread keeps its own streams and resets them between uses
+// rather than paying to initialize (allocate) them every time.
+struct Streams
+{
+  Streams() : deflating(false), inflating(false) {}
+
+  ~Streams()
+  {
+    if (deflating) {
+      deflateEnd(&deflater);
+    }
+    if (inflating) {
+      inflateEnd(&inflater);
+    }
+  }
+
+  z_stream_s deflater;
+  int level; // Of the deflater.
+  bool deflating; // Whether the deflater has been initialized.
+
+  z_stream_s inflater;
+  bool inflating; // Whether the inflater has been initialized.
+};
+
+
+inline void destroy(void* streams)
+{
+  delete static_cast<Streams*>(streams);
+}
+
+
+inline pthread_key_t* key()
+{
+  static pthread_key_t key;
+  return &key;
+}
+
+
+inline void initialize()
+{
+  pthread_key_create(key(), &destroy);
+}
+
+
+// Returns the calling thread's streams.
+inline Streams* streams()
+{
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, &initialize);
+
+  Streams* streams = static_cast<Streams*>(pthread_getspecific(*key()));
+  if (streams == NULL) {
+    streams = new Streams();
+    pthread_setspecific(*key(), streams);
+  }
+  return streams;
+}
+
+
+inline std::string message(const z_stream_s& stream, const std::string& s)
+{
+  return stream.msg != NULL ? std::string(stream.msg) : s;
+}
+
+
+// Returns a reset deflate stream for the calling thread.
+inline Try<z_stream_s*> deflater(int level)
+{
+  Streams* streams = internal::streams();
+  z_stream_s* stream = &streams->deflater;
+
+  if (streams->deflating) {
+    if (deflateReset(stream) != Z_OK) {
+      return Error("Failed to reset zlib");
+    }
+    if (streams->level != level) {
+      if (deflateParams(stream, level, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return Error("Failed to set the zlib compression level");
+      }
+      streams->level = level;
+    }
+    return stream;
+  }
+
+  stream->zalloc = Z_NULL;
+  stream->zfree = Z_NULL;
+  stream->opaque = Z_NULL;
+
+  int code = deflateInit2(
+      stream,
+      level,          // Compression level.
+      Z_DEFLATED,     // Compression method.
+      MAX_WBITS + 16, // Zlib magic for gzip compression / decompression.
+      8,              // Default memLevel value.
+      Z_DEFAULT_STRATEGY);
+
+  if (code != Z_OK) {
+    return Error(
+        "Failed to initialize zlib: " + message(*stream, stringify(code)));
+  }
+
+  streams->deflating = true;
+  streams->level = level;
+  return stream;
+}
+
+
+// Returns a reset inflate stream for the calling thread.
+inline Try<z_stream_s*> inflater()
+{
+  Streams* streams = internal::streams();
+  z_stream_s* stream = &streams->inflater;
+
+  if (streams->inflating) {
+    if (inflateReset(stream) != Z_OK) {
+      return Error("Failed to reset zlib");
+    }
+    return stream;
+  }
+
+  stream->next_in = Z_NULL;
+  stream->avail_in = 0;
+  stream->zalloc = Z_NULL;
+  stream->zfree = Z_NULL;
+  stream->opaque = Z_NULL;
+
+  int code = inflateInit2(
+      stream,
+      MAX_WBITS + 16); // Zlib magic for gzip compression / decompression.
+
+  if (code != Z_OK) {
+    return Error(
+        "Failed to initialize zlib: " + message(*stream, stringify(code)));
+  }
+
+  streams->inflating = true;
+  return stream;
+}
+
+} // namespace internal {
+#endif // HAVE_LIBZ
+
+
+// Replaces the contents of 'compressed' with a gzip compressed
+// version of the provided string. The capacity of 'compressed' is
+// reused, so a caller doing many compressions can avoid allocating
+// by passing the same string each time. The compression level should
+// be within the range [-1, 9].
 // See zlib.h:
 //   #define Z_NO_COMPRESSION         0
 //   #define Z_BEST_SPEED             1
 //   #define Z_BEST_COMPRESSION       9
 //   #define Z_DEFAULT_COMPRESSION  (-1)
-inline Try<std::string> compress(
+inline Try<Nothing> compress(
     const std::string& decompressed,
+    std::string* compressed,
 #ifdef HAVE_LIBZ
     int level = Z_DEFAULT_COMPRESSION)
 #else
@@ -38,110 +227,753 @@ inline Try<std::string> compress(
   // Verify the level is within range.
   if (!(level == Z_DEFAULT_COMPRESSION ||
       (level >= Z_NO_COMPRESSION && level <= Z_BEST_COMPRESSION))) {
-    return Error("Invalid compression level: " + level);
+    return Error("Invalid compression level: " + stringify(level));
   }
 
-  z_stream_s stream;
-  stream.next_in =
-    const_cast<Bytef*>(reinterpret_cast<const Bytef*>(decompressed.data()));
-  stream.avail_in = decompressed.length();
-  stream.zalloc = Z_NULL;
-  stream.zfree = Z_NULL;
-  stream.opaque = Z_NULL;
+  Try<z_stream_s*> deflater = internal::deflater(level);
+  if (deflater.isError()) {
+    return Error(deflater.error());
+  }
 
-  int code = deflateInit2(
-      &stream,
-      level,          // Compression level.
-      Z_DEFLATED,     // Compression method.
-      MAX_WBITS + 16, // Zlib magic for gzip compression / decompression.
-      8,              // Default memLevel value.
-      Z_DEFAULT_STRATEGY);
+  z_stream_s* stream = deflater.get();
+  stream->next_in =
+    const_cast<Bytef*>(reinterpret_cast<const Bytef*>(decompressed.data()));
+  stream->avail_in = decompressed.length();
 
-  if (code != Z_OK) {
-    return Error("Failed to initialize zlib: " + std::string(stream.msg));
-  }
+  // Deflate directly into the result, which is (almost always) big
+  // enough to hold everything in one go.
+  compressed->resize(deflateBound(stream, decompressed.length()));
 
-  // Build up the compressed result.
-  Bytef buffer[GZIP_BUFFER_SIZE];
-  std::string result = "";
+  size_t offset = 0;
+  int code;
   do {
-    stream.next_out = buffer;
-    stream.avail_out = GZIP_BUFFER_SIZE;
-    code = deflate(&stream, stream.avail_in > 0 ? Z_NO_FLUSH : Z_FINISH);
+    if (offset == compressed->size()) {
+      compressed->resize(compressed->size() * 2 + GZIP_BUFFER_SIZE);
+    }
 
-    if (code != Z_OK && code != Z_STREAM_END) {
-      Error error(std::string(stream.msg));
-      deflateEnd(&stream);
-      return error;
+    stream->next_out = reinterpret_cast<Bytef*>(&(*compressed)[offset]);
+    stream->avail_out = compressed->size() - offset;
+    code = deflate(stream, Z_FINISH);
+
+    if (code != Z_OK && code != Z_STREAM_END && code != Z_BUF_ERROR) {
+      compressed->clear();
+      return Error(internal::message(*stream, "Failed to deflate"));
     }
 
-    // Consume output and reset the buffer.
-    result.append(
-        reinterpret_cast<char*>(buffer),
-        GZIP_BUFFER_SIZE - stream.avail_out);
-    stream.next_out = buffer;
-    stream.avail_out = GZIP_BUFFER_SIZE;
+    offset = compressed->size() - stream->avail_out;
   } while (code != Z_STREAM_END);
 
-  code = deflateEnd(&stream);
-  if (code != Z_OK) {
-    return Error("Failed to clean up zlib: " + std::string(stream.msg));
+  compressed->resize(offset);
+  return Nothing();
+#endif // HAVE_LIBZ
+}
+
+
+// Returns a gzip compressed version of the provided string.
+// See above for the valid compression levels.
+inline Try<std::string> compress(
+    const std::string& decompressed,
+#ifdef HAVE_LIBZ
+    int level = Z_DEFAULT_COMPRESSION)
+#else
+    int level = -1)
+#endif
+{
+  std::string result;
+  Try<Nothing> compressed = compress(decompressed, &result, level);
+  if (compressed.isError()) {
+    return Error(compressed.error());
   }
   return result;
-#endif // HAVE_LIBZ
 }
 
 
-// Returns a gzip decompressed version of the provided string.
-inline Try<std::string> decompress(const std::string& compressed)
+// Replaces the contents of 'decompressed' with a gzip decompressed
+// version of the provided string, reusing the capacity of
+// 'decompressed' (see 'compress' above). Concatenated gzip members
+// are decompressed into the concatenation of their contents.
+inline Try<Nothing> decompress(
+    const std::string& compressed,
+    std::string* decompressed)
 {
 #ifndef HAVE_LIBZ
   return Error("libz is not available");
 #else
-  z_stream_s stream;
-  stream.next_in =
+  Try<z_stream_s*> inflater = internal::inflater();
+  if (inflater.isError()) {
+    return Error(inflater.error());
+  }
+
+  z_stream_s* stream = inflater.get();
+  stream->next_in =
     const_cast<Bytef*>(reinterpret_cast<const Bytef*>(compressed.data()));
-  stream.avail_in = compressed.length();
+  stream->avail_in = compressed.length();
+
+  // The gzip trailer ends with the size of the (last member's)
+  // decompressed data modulo 2^32 ("ISIZE", little endian) which we
+  // use as a hint to size the result up front. The hint is bounded by
+  // the best possible deflate compression ratio (~1032:1) so that a
+  // corrupt trailer can't cause a huge allocation.
+  size_t size = GZIP_BUFFER_SIZE;
+  if (compressed.length() >= 18) {
+    const unsigned char* trailer = reinterpret_cast<const unsigned char*>(
+        compressed.data() + compressed.length() - 4);
+
+    size_t isize =
+      static_cast<size_t>(trailer[0]) |
+      static_cast<size_t>(trailer[1]) << 8 |
+      static_cast<size_t>(trailer[2]) << 16 |
+      static_cast<size_t>(trailer[3]) << 24;
+
+    size = std::min(isize, compressed.length() * 1032);
+  }
+
+  decompressed->resize(size);
+
+  // Inflate directly into the tail of the result, growing it when
+  // the hint was too small.
+  size_t offset = 0;
+  int code;
+  while (true) {
+    if (offset == decompressed->size()) {
+      decompressed->resize(decompressed->size() * 2 + GZIP_BUFFER_SIZE);
+    }
+
+    stream->next_out = reinterpret_cast<Bytef*>(&(*decompressed)[offset]);
+    stream->avail_out = decompressed->size() - offset;
+    code = inflate(stream, Z_NO_FLUSH);
+
+    offset = decompressed->size() - stream->avail_out;
+
+    if (code == Z_STREAM_END) {
+      if (stream->avail_in == 0) {
+        break;
+      }
+      // Another gzip member follows.
+      inflateReset(stream);
+    } else if (code == Z_BUF_ERROR && stream->avail_in == 0) {
+      decompressed->clear();
+      return Error("Truncated gzip stream");
+    } else if (code != Z_OK && code != Z_BUF_ERROR) {
+      decompressed->clear();
+      return Error(internal::message(*stream, "Failed to inflate"));
+    }
+  }
+
+  decompressed->resize(offset);
+  return Nothing();
+#endif // HAVE_LIBZ
+}
+
+
+// Returns a gzip decompressed version of the provided string.
+inline Try<std::string> decompress(const std::string& compressed)
+{
+  std::string result;
+  Try<Nothing> decompressed = decompress(compressed, &result);
+  if (decompressed.isError()) {
+    return Error(decompressed.error());
+  }
+  return result;
+}
+
+
+#ifdef HAVE_LIBZ
+namespace internal {
+
+// Deflate's window size, the most of the previous block that is
+// useful as a dictionary for the next one.
+#define GZIP_WINDOW_SIZE 32768
+
+// The state shared by the threads doing a parallel compression.
+struct Blocks
+{
+  const std::string* input;
+  size_t size; // Of each block (except possibly the last).
+  size_t count;
+  int level;
+
+  size_t next; // The next block to compress.
+
+  // Per block results.
+  std::vector<std::string> outputs;
+  std::vector<uLong> crcs;
+  std::vector<Option<std::string> > errors;
+};
+
+
+// Compresses blocks (picked up one at a time) until there are none
+// left. Each block is a raw deflate stream which is primed with the
+// end of the previous block as a dictionary so that the compression
+// ratio is close to that of compressing the whole input at once.
+// All but the last block are ended with a sync flush so they're byte
+// aligned and can simply be concatenated.
+inline void* compress(void* arg)
+{
+  Blocks* blocks = static_cast<Blocks*>(arg);
+
+  z_stream_s stream;
   stream.zalloc = Z_NULL;
   stream.zfree = Z_NULL;
   stream.opaque = Z_NULL;
 
-  int code = inflateInit2(
+  int code = deflateInit2(
       &stream,
-      MAX_WBITS + 16); // Zlib magic for gzip compression / decompression.
+      blocks->level,
+      Z_DEFLATED,
+      -MAX_WBITS, // Raw deflate, the gzip wrapper is added separately.
+      8,
+      Z_DEFAULT_STRATEGY);
 
-  if (code != Z_OK) {
-    return Error("Failed to initialize zlib: " + std::string(stream.msg));
+  bool initialized = code == Z_OK;
+
+  while (true) {
+    size_t index = __sync_fetch_and_add(&blocks->next, 1);
+    if (index >= blocks->count) {
+      break;
+    }
+
+    if (!initialized) {
+      blocks->errors[index] =
+        "Failed to initialize zlib: " + message(stream, stringify(code));
+      continue;
+    }
+
+    const Bytef* data =
+      reinterpret_cast<const Bytef*>(blocks->input->data());
+    size_t offset = index * blocks->size;
+    size_t length = std::min(blocks->size, blocks->input->size() - offset);
+    bool last = index == blocks->count - 1;
+
+    blocks->crcs[index] = crc32(crc32(0L, Z_NULL, 0), data + offset, length);
+
+    deflateReset(&stream);
+
+    if (index > 0) {
+      size_t size = std::min<size_t>(GZIP_WINDOW_SIZE, offset);
+      deflateSetDictionary(&stream, data + offset - size, size);
+    }
+
+    std::string& output = blocks->outputs[index];
+    output.resize(deflateBound(&stream, length) + 16);
+
+    stream.next_in = const_cast<Bytef*>(data + offset);
+    stream.avail_in = length;
+
+    size_t written = 0;
+    while (true) {
+      if (written == output.size()) {
+        output.resize(output.size() * 2);
+      }
+
+      stream.next_out = reinterpret_cast<Bytef*>(&output[written]);
+      stream.avail_out = output.size() - written;
+      code = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+      written = output.size() - stream.avail_out;
+
+      if (code == Z_STREAM_END ||
+          (!last && code == Z_OK && stream.avail_out > 0)) {
+        break;
+      } else if (code != Z_OK && code != Z_BUF_ERROR) {
+        blocks->errors[index] = message(stream, "Failed to deflate");
+        break;
+      }
+    }
+
+    output.resize(written);
+  }
+
+  if (initialized) {
+    deflateEnd(&stream);
+  }
+
+  return NULL;
+}
+
+
+inline void append(std::string* s, uint32_t value)
+{
+  // Little endian, as used by the gzip header and trailer.
+  for (int i = 0; i < 4; i++) {
+    s->push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+  }
+}
+
+} // namespace internal {
+#endif // HAVE_LIBZ
+
+
+// Replaces the contents of 'compressed' with a gzip compressed
+// version of the provided string like 'compress' above, but splits
+// the input into blocks which are compressed in parallel (like pigz)
+// using the specified number of threads. The result is a standard
+// (single member) gzip stream. The blocks are compressed
+// independently except for using the end of the previous block as a
+// dictionary, so the result is usually only slightly larger than
+// compressing on a single thread.
+inline Try<Nothing> compress(
+    const std::string& decompressed,
+    std::string* compressed,
+    int level,
+    size_t threads,
+    size_t block = 128 * 1024)
+{
+#ifndef HAVE_LIBZ
+  return Error("libz is not available");
+#else
+  if (!(level == Z_DEFAULT_COMPRESSION ||
+      (level >= Z_NO_COMPRESSION && level <= Z_BEST_COMPRESSION))) {
+    return Error("Invalid compression level: " + stringify(level));
+  }
+
+  if (block == 0) {
+    return Error("Invalid block size: 0");
+  }
+
+  internal::Blocks blocks;
+  blocks.input = &decompressed;
+  blocks.size = block;
+  blocks.count = std::max<size_t>(
+      1, (decompressed.size() + block - 1) / block);
+  blocks.level = level;
+  blocks.next = 0;
+
+  threads = std::min(threads, blocks.count);
+
+  if (threads <= 1) {
+    return compress(decompressed, compressed, level);
+  }
+
+  blocks.outputs.resize(blocks.count);
+  blocks.crcs.resize(blocks.count);
+  blocks.errors.resize(blocks.count);
+
+  // The calling thread compresses too.
+  std::vector<pthread_t> ids(threads - 1);
+  for (size_t i = 0; i < ids.size(); i++) {
+    if (pthread_create(&ids[i], NULL, &internal::compress, &blocks) != 0) {
+      ids.resize(i);
+      break;
+    }
+  }
+
+  internal::compress(&blocks);
+
+  for (size_t i = 0; i < ids.size(); i++) {
+    pthread_join(ids[i], NULL);
+  }
+
+  size_t size = 10 + 8; // Header and trailer.
+  for (size_t i = 0; i < blocks.count; i++) {
+    if (blocks.errors[i].isSome()) {
+      compressed->clear();
+      return Error(blocks.errors[i].get());
+    }
+    size += blocks.outputs[i].size();
+  }
+
+  compressed->clear();
+  compressed->reserve(size);
+
+  // The gzip header (see RFC 1952): magic, deflate method, no flags,
+  // no modification time, no extra flags and a Unix OS.
+  const char header[] = {
+    '\x1f', '\x8b', '\x08', '\x00',
+    '\x00', '\x00', '\x00', '\x00',
+    '\x00', '\x03'
+  };
+  compressed->append(header, sizeof(header));
+
+  uLong crc = crc32(0L, Z_NULL, 0);
+  for (size_t i = 0; i < blocks.count; i++) {
+    compressed->append(blocks.outputs[i]);
+
+    size_t length = std::min(block, decompressed.size() - i * block);
+    crc = crc32_combine(crc, blocks.crcs[i], length);
+  }
+
+  // The gzip trailer: the CRC-32 and the size modulo 2^32.
+  internal::append(compressed, static_cast<uint32_t>(crc));
+  internal::append(compressed, static_cast<uint32_t>(decompressed.size()));
+
+  return Nothing();
+#endif // HAVE_LIBZ
+}
+
+
+// Incrementally compresses chunks of input into a gzip stream which
+// gets passed to the sink in chunks (of at most GZIP_BUFFER_SIZE
+// bytes) as it gets produced. Only a bounded amount of memory is
+// used regardless of the amount of input. For example:
+//
+//   gzip::Compressor compressor(sink);
+//   while (...) {
+//     compressor.write(data, size);
+//   }
+//   compressor.finish();
+//
+// Once an error has occurred all subsequent calls return the error.
+class Compressor
+{
+public:
+  // See 'compress' above for the valid compression levels.
+  explicit Compressor(
+      const Sink& _sink,
+#ifdef HAVE_LIBZ
+      int level = Z_DEFAULT_COMPRESSION)
+#else
+      int level = -1)
+#endif
+    : sink(_sink), initialized(false), finished(false)
+  {
+#ifndef HAVE_LIBZ
+    error = std::string("libz is not available");
+#else
+    if (!(level == Z_DEFAULT_COMPRESSION ||
+        (level >= Z_NO_COMPRESSION && level <= Z_BEST_COMPRESSION))) {
+      error = "Invalid compression level: " + stringify(level);
+      return;
+    }
+
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+
+    int code = deflateInit2(
+        &stream,
+        level,          // Compression level.
+        Z_DEFLATED,     // Compression method.
+        MAX_WBITS + 16, // Zlib magic for gzip compression / decompression.
+        8,              // Default memLevel value.
+        Z_DEFAULT_STRATEGY);
+
+    if (code != Z_OK) {
+      error = "Failed to initialize zlib: " +
+        internal::message(stream, stringify(code));
+      return;
+    }
+
+    initialized = true;
+#endif // HAVE_LIBZ
+  }
+
+  ~Compressor()
+  {
+#ifdef HAVE_LIBZ
+    if (initialized) {
+      deflateEnd(&stream);
+    }
+#endif // HAVE_LIBZ
+  }
+
+  // Compresses the data, passing any output that is ready to the sink.
+  Try<Nothing> write(const char* data, size_t size)
+  {
+    if (error.isSome()) {
+      return Error(error.get());
+    } else if (finished) {
+      return Error("Compressor has already been finished");
+    }
+
+#ifdef HAVE_LIBZ
+    stream.next_in = const_cast<Bytef*>(reinterpret_cast<const Bytef*>(data));
+    stream.avail_in = size;
+    return process(Z_NO_FLUSH);
+#else
+    return Nothing();
+#endif // HAVE_LIBZ
+  }
+
+  Try<Nothing> write(const std::string& data)
+  {
+    return write(data.data(), data.size());
+  }
+
+  // Passes the rest of the compressed output (and the gzip trailer)
+  // to the sink. Nothing can be written after finishing.
+  Try<Nothing> finish()
+  {
+    if (error.isSome()) {
+      return Error(error.get());
+    } else if (finished) {
+      return Error("Compressor has already been finished");
+    }
+
+    finished = true;
+
+#ifdef HAVE_LIBZ
+    stream.next_in = Z_NULL;
+    stream.avail_in = 0;
+    return process(Z_FINISH);
+#else
+    return Nothing();
+#endif // HAVE_LIBZ
+  }
+
+private:
+  // Not copyable, not assignable.
+  Compressor(const Compressor&);
+  Compressor& operator = (const Compressor&);
+
+#ifdef HAVE_LIBZ
+  // Deflates all of the available input, passing output to the sink.
+  Try<Nothing> process(int flush)
+  {
+    int code;
+    do {
+      stream.next_out = buffer;
+      stream.avail_out = GZIP_BUFFER_SIZE;
+      code = deflate(&stream, flush);
+
+      // NOTE: Z_BUF_ERROR just means no progress could be made.
+      if (code != Z_OK && code != Z_STREAM_END && code != Z_BUF_ERROR) {
+        error = internal::message(stream, "Failed to deflate");
+        return Error(error.get());
+      }
+
+      size_t size = GZIP_BUFFER_SIZE - stream.avail_out;
+      if (size > 0) {
+        Try<Nothing> consumed =
+          sink(reinterpret_cast<const char*>(buffer), size);
+        if (consumed.isError()) {
+          error = consumed.error();
+          return Error(error.get());
+        }
+      }
+    } while (stream.avail_out == 0 ||
+             (flush == Z_FINISH && code != Z_STREAM_END));
+
+    return Nothing();
   }
 
-  // Build up the decompressed result.
+  z_stream_s stream;
   Bytef buffer[GZIP_BUFFER_SIZE];
-  std::string result = "";
-  do {
-    stream.next_out = buffer;
-    stream.avail_out = GZIP_BUFFER_SIZE;
-    code = inflate(&stream, stream.avail_in > 0 ? Z_NO_FLUSH : Z_FINISH);
+#endif // HAVE_LIBZ
+
+  Sink sink;
+  Option<std::string> error;
+  bool initialized;
+  bool finished;
+};
+
+
+// Incrementally decompresses chunks of a gzip stream, passing the
+// decompressed output to the sink in chunks (of at most
+// GZIP_BUFFER_SIZE bytes). A stream made up of multiple concatenated
+// gzip members (as allowed by RFC 1952) is decompressed into the
+// concatenation of their contents, like gunzip does.
+//
+// Once an error has occurred all subsequent calls return the error.
+class Decompressor
+{
+public:
+  explicit Decompressor(const Sink& _sink)
+    : sink(_sink), initialized(false), ended(false)
+  {
+#ifndef HAVE_LIBZ
+    error = std::string("libz is not available");
+#else
+    stream.next_in = Z_NULL;
+    stream.avail_in = 0;
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+
+    int code = inflateInit2(
+        &stream,
+        MAX_WBITS + 16); // Zlib magic for gzip compression / decompression.
+
+    if (code != Z_OK) {
+      error = "Failed to initialize zlib: " +
+        internal::message(stream, stringify(code));
+      return;
+    }
 
-    if (code != Z_OK && code != Z_STREAM_END) {
-      Error error(std::string(stream.msg));
+    initialized = true;
+#endif // HAVE_LIBZ
+  }
+
+  ~Decompressor()
+  {
+#ifdef HAVE_LIBZ
+    if (initialized) {
       inflateEnd(&stream);
-      return error;
     }
+#endif // HAVE_LIBZ
+  }
 
-    // Consume output and reset the buffer.
-    result.append(
-        reinterpret_cast<char*>(buffer),
-        GZIP_BUFFER_SIZE - stream.avail_out);
-    stream.next_out = buffer;
-    stream.avail_out = GZIP_BUFFER_SIZE;
-  } while (code != Z_STREAM_END);
+  // Decompresses the data, passing any output to the sink.
+  Try<Nothing> write(const char* data, size_t size)
+  {
+    if (error.isSome()) {
+      return Error(error.get());
+    }
 
-  code = inflateEnd(&stream);
-  if (code != Z_OK) {
-    return Error("Failed to clean up zlib: " + std::string(stream.msg));
+#ifdef HAVE_LIBZ
+    stream.next_in = const_cast<Bytef*>(reinterpret_cast<const Bytef*>(data));
+    stream.avail_in = size;
+
+    while (true) {
+      if (ended) {
+        if (stream.avail_in == 0) {
+          break;
+        }
+        // Another gzip member follows.
+        inflateReset(&stream);
+        ended = false;
+      }
+
+      stream.next_out = buffer;
+      stream.avail_out = GZIP_BUFFER_SIZE;
+      int code = inflate(&stream, Z_NO_FLUSH);
+
+      if (code == Z_STREAM_END) {
+        ended = true;
+      } else if (code != Z_OK && code != Z_BUF_ERROR) {
+        error = internal::message(stream, "Failed to inflate");
+        return Error(error.get());
+      }
+
+      size_t size = GZIP_BUFFER_SIZE - stream.avail_out;
+      if (size > 0) {
+        Try<Nothing> consumed =
+          sink(reinterpret_cast<const char*>(buffer), size);
+        if (consumed.isError()) {
+          error = consumed.error();
+          return Error(error.get());
+        }
+      }
+
+      // Stop once all the input is consumed and flushed out.
+      if (code == Z_BUF_ERROR ||
+          (!ended && stream.avail_in == 0 && stream.avail_out > 0)) {
+        break;
+      }
+    }
+#endif // HAVE_LIBZ
+
+    return Nothing();
   }
-  return result;
+
+  Try<Nothing> write(const std::string& data)
+  {
+    return write(data.data(), data.size());
+  }
+
+  // Verifies that the input ended with a complete gzip stream.
+  Try<Nothing> finish()
+  {
+    if (error.isSome()) {
+      return Error(error.get());
+    } else if (!ended) {
+      return Error("Truncated gzip stream");
+    }
+    return Nothing();
+  }
+
+private:
+  // Not copyable, not assignable.
+  Decompressor(const Decompressor&);
+  Decompressor& operator = (const Decompressor&);
+
+#ifdef HAVE_LIBZ
+  z_stream_s stream;
+  Bytef buffer[GZIP_BUFFER_SIZE];
 #endif // HAVE_LIBZ
+
+  Sink sink;
+  Option<std::string> error;
+  bool initialized;
+  bool ended; // Whether the last gzip member has been completed.
+};
+
+
+namespace internal {
+
+// Writes all of the data to the fd (a Sink for the fd functions).
+inline Try<Nothing> write(int fd, const char* data, size_t size)
+{
+  while (size > 0) {
+    ssize_t length = ::write(fd, data, size);
+    if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return ErrnoError("Failed to write");
+    }
+    data += length;
+    size -= length;
+  }
+  return Nothing();
+}
+
+
+// Reads everything from the fd (until EOF) into the (de)compressor.
+template <typename T>
+Try<Nothing> transfer(int fd, T* t)
+{
+  char buffer[GZIP_BUFFER_SIZE];
+  while (true) {
+    ssize_t length = ::read(fd, buffer, GZIP_BUFFER_SIZE);
+    if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return ErrnoError("Failed to read");
+    } else if (length == 0) {
+      break;
+    }
+
+    Try<Nothing> written = t->write(buffer, length);
+    if (written.isError()) {
+      return written;
+    }
+  }
+
+  return t->finish();
+}
+
+} // namespace internal {
+
+
+// Compresses everything read from the 'in' fd (until EOF) writing
+// the gzip stream to the 'out' fd, using a bounded amount of memory.
+// NOTE: On error, this may have written partial data to 'out'.
+inline Try<Nothing> compress(
+    int in,
+    int out,
+#ifdef HAVE_LIBZ
+    int level = Z_DEFAULT_COMPRESSION)
+#else
+    int level = -1)
+#endif
+{
+  Compressor compressor(
+      std::tr1::bind(
+          &internal::write,
+          out,
+          std::tr1::placeholders::_1,
+          std::tr1::placeholders::_2),
+      level);
+
+  return internal::transfer(in, &compressor);
+}
+
+
+// Decompresses the gzip stream read from the 'in' fd (until EOF)
+// writing the output to the 'out' fd, using a bounded amount of
+// memory.
+// NOTE: On error, this may have written partial data to 'out'.
+inline Try<Nothing> decompress(int in, int out)
+{
+  Decompressor decompressor(
+      std::tr1::bind(
+          &internal::write,
+          out,
+          std::tr1::placeholders::_1,
+          std::tr1::placeholders::_2));
+
+  return internal::transfer(in, &decompressor);
 }
 
 } // namespace gzip {
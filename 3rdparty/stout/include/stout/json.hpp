@@ -1,17 +1,38 @@
 #ifndef __STOUT_JSON__
 #define __STOUT_JSON__
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <list>
 #include <map>
 #include <string>
+#include <vector>
 
 #include <boost/variant.hpp>
 
-#include <stout/foreach.hpp>
+#include <tr1/functional>
 
-// TODO(jsirois): Implement parsing that constructs JSON objects.
+#include <stout/error.hpp>
+#include <stout/foreach.hpp>
+#include <stout/nothing.hpp>
+#include <stout/option.hpp>
+#include <stout/stringify.hpp>
+#include <stout/try.hpp>
 
 
 namespace JSON {
@@ -85,99 +106,314 @@ struct False {};
 struct Null {};
 
 
-// Implementation of rendering JSON objects built above using standard
-// C++ output streams. The visitor pattern is used thanks to to build
-// a "renderer" with boost::static_visitor and two top-level render
-// routines are provided for rendering JSON objects and arrays.
+// Implementation of rendering JSON objects built above. Values are
+// rendered into a contiguous (growable) buffer, i.e., a std::string,
+// which is much faster than writing a character at a time to an
+// output stream. Rendering to a std::ostream renders to a buffer
+// first. The output is either compact (no whitespace at all) or
+// "pretty" (each member or element on its own line, indented by two
+// spaces per level).
 
-struct Renderer : boost::static_visitor<>
+namespace internal {
+
+// Returns the first character at or after 'p' which needs to be
+// escaped in a JSON string (see 'escape' below), or 'end'.
+inline const char* plain(const char* p, const char* end)
 {
-  Renderer(std::ostream& _out) : out(_out) {}
+#ifdef __SSE2__
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i slash = _mm_set1_epi8('/');
+  const __m128i control = _mm_set1_epi8(0x1F);
+  const __m128i del = _mm_set1_epi8(0x7F);
 
-  void operator () (const String& string) const
-  {
-    // TODO(benh): This escaping DOES NOT handle unicode, it encodes as ASCII.
-    // See RFC4627 for the JSON string specificiation.
-    out << "\"";
-    foreach (unsigned char c, string.value) {
-      switch (c) {
-        case '"':  out << "\\\""; break;
-        case '\\': out << "\\\\"; break;
-        case '/':  out << "\\/";  break;
-        case '\b': out << "\\b";  break;
-        case '\f': out << "\\f";  break;
-        case '\n': out << "\\n";  break;
-        case '\r': out << "\\r";  break;
-        case '\t': out << "\\t";  break;
-        default:
-          // See RFC4627 for these ranges.
-          if ((c >= 0x20 && c <= 0x21) ||
-              (c >= 0x23 && c <= 0x5B) ||
-              (c >= 0x5D && c < 0x7F)) {
-            out << c;
-          } else {
-            // NOTE: We also escape all bytes > 0x7F since they imply more than
-            // 1 byte in UTF-8. This is why we don't escape UTF-8 properly.
-            // See RFC4627 for the escaping format: \uXXXX (X is a hex digit).
-            // Each byte here will be of the form: \u00XX (this is why we need
-            // setw and the cast to unsigned int).
-            out << "\\u" << std::setfill('0') << std::setw(4)
-                << std::hex << std::uppercase << (unsigned int) c;
+  while (end - p >= 16) {
+    __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i special = _mm_or_si128(
+        _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(c, quote),
+                         _mm_cmpeq_epi8(c, backslash)),
+            _mm_or_si128(_mm_cmpeq_epi8(c, slash),
+                         _mm_cmpeq_epi8(c, del))),
+        // Unsigned c <= 0x1F.
+        _mm_cmpeq_epi8(_mm_max_epu8(c, control), control));
+    // NOTE: The high bit of each byte (i.e., bytes >= 0x80) is
+    // included by taking the mask of 'c' itself.
+    int mask = _mm_movemask_epi8(special) | _mm_movemask_epi8(c);
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 16;
+  }
+#endif // __SSE2__
+
+  while (p < end) {
+    unsigned char c = *p;
+    if (c < 0x20 || c >= 0x7F || c == '"' || c == '\\' || c == '/') {
+      break;
+    }
+    p++;
+  }
+  return p;
+}
+
+
+// Returns the length of the valid UTF-8 encoded character (of 2 to 4
+// bytes) starting at 'p', or 0 if the bytes are not valid UTF-8 (a
+// stray continuation byte, an overlong encoding, a surrogate, a code
+// point beyond U+10FFFF or a truncated sequence).
+inline size_t utf8(const char* p, const char* end)
+{
+  const unsigned char* s = reinterpret_cast<const unsigned char*>(p);
+  const size_t available = end - p;
+
+  // The valid range of the second byte depends on the first byte (see
+  // table 3-7 in the Unicode standard), the rest are 0x80 to 0xBF.
+  unsigned char low = 0x80;
+  unsigned char high = 0xBF;
+  size_t length;
+
+  if (s[0] >= 0xC2 && s[0] <= 0xDF) {
+    length = 2;
+  } else if (s[0] >= 0xE0 && s[0] <= 0xEF) {
+    length = 3;
+    if (s[0] == 0xE0) {
+      low = 0xA0;
+    } else if (s[0] == 0xED) {
+      high = 0x9F;
+    }
+  } else if (s[0] >= 0xF0 && s[0] <= 0xF4) {
+    length = 4;
+    if (s[0] == 0xF0) {
+      low = 0x90;
+    } else if (s[0] == 0xF4) {
+      high = 0x8F;
+    }
+  } else {
+    return 0;
+  }
+
+  if (available < length || s[1] < low || s[1] > high) {
+    return 0;
+  }
+
+  for (size_t i = 2; i < length; i++) {
+    if ((s[i] & 0xC0) != 0x80) {
+      return 0;
+    }
+  }
+
+  return length;
+}
+
+
+// Appends the string, quoted and escaped (see RFC 4627). Valid UTF-8
+// is passed through unchanged while any other bytes > 0x7F (as well
+// as 0x7F and control characters) are escaped as \u00XX.
+inline void escape(std::string* out, const char* data, size_t size)
+{
+  static const char hex[] = "0123456789ABCDEF";
+
+  const char* end = data + size;
+
+  out->push_back('"');
+
+  while (data < end) {
+    const char* p = plain(data, end);
+    out->append(data, p - data);
+    if (p == end) {
+      break;
+    }
+
+    unsigned char c = *p;
+    switch (c) {
+      case '"':  out->append("\\\"", 2); break;
+      case '\\': out->append("\\\\", 2); break;
+      case '/':  out->append("\\/", 2); break;
+      case '\b': out->append("\\b", 2); break;
+      case '\f': out->append("\\f", 2); break;
+      case '\n': out->append("\\n", 2); break;
+      case '\r': out->append("\\r", 2); break;
+      case '\t': out->append("\\t", 2); break;
+      default: {
+        if (c > 0x7F) {
+          size_t length = utf8(p, end);
+          if (length > 0) {
+            out->append(p, length);
+            data = p + length;
+            continue;
           }
-          break;
+        }
+        char escaped[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
+        out->append(escaped, 6);
+        break;
       }
     }
-    out << "\"";
+
+    data = p + 1;
+  }
+
+  out->push_back('"');
+}
+
+
+// Appends the shortest representation of the number that parses
+// back to exactly the same double. Since JSON can't represent them,
+// NaN and infinities are rendered as null.
+inline void number(std::string* out, double value)
+{
+  if (value != value || value - value != 0) {
+    out->append("null", 4);
+    return;
+  }
+
+  // Integers (the common case) are rendered directly.
+  if (value >= -1e15 && value <= 1e15 &&
+      value == static_cast<double>(static_cast<int64_t>(value))) {
+    int64_t integer = static_cast<int64_t>(value);
+    bool negative = integer < 0 || (integer == 0 && signbit(value));
+    uint64_t u = integer < 0 ? -integer : integer;
+
+    char buffer[24];
+    char* p = buffer + sizeof(buffer);
+    do {
+      *--p = '0' + (u % 10);
+      u /= 10;
+    } while (u != 0);
+    if (negative) {
+      *--p = '-';
+    }
+
+    out->append(p, buffer + sizeof(buffer) - p);
+    return;
+  }
+
+  // Otherwise use the fewest digits which round trip (17 always do).
+  char buffer[32];
+  int size = 0;
+  for (int precision = 15; precision <= 17; precision++) {
+    size = snprintf(buffer, sizeof(buffer), "%.*g", precision, value);
+    if (strtod(buffer, NULL) == value) {
+      break;
+    }
+  }
+
+  out->append(buffer, size);
+}
+
+
+// Starts a new line (when pretty) indented for the specified depth.
+inline void indent(std::string* out, bool pretty, size_t depth)
+{
+  if (pretty) {
+    out->push_back('\n');
+    out->append(2 * depth, ' ');
+  }
+}
+
+
+struct ValueRenderer : boost::static_visitor<>
+{
+  ValueRenderer(std::string* _out, bool _pretty, size_t _depth = 0)
+    : out(_out), pretty(_pretty), depth(_depth) {}
+
+  void operator () (const String& string) const
+  {
+    escape(out, string.value.data(), string.value.size());
   }
 
-  void operator () (const Number& number) const
+  void operator () (const Number& n) const
   {
-    out.precision(10);
-    out << number.value;
+    number(out, n.value);
   }
 
   void operator () (const Object& object) const
   {
-    out << "{";
+    if (object.values.empty()) {
+      out->append("{}", 2);
+      return;
+    }
+
+    ValueRenderer renderer(out, pretty, depth + 1);
+
+    out->push_back('{');
     std::map<std::string, Value>::const_iterator iterator;
-    iterator = object.values.begin();
-    while (iterator != object.values.end()) {
-      out << "\"" << (*iterator).first << "\":";
-      boost::apply_visitor(Renderer(out), (*iterator).second);
-      if (++iterator != object.values.end()) {
-        out << ",";
+    for (iterator = object.values.begin();
+         iterator != object.values.end();
+         ++iterator) {
+      if (iterator != object.values.begin()) {
+        out->push_back(',');
       }
+      indent(out, pretty, depth + 1);
+      escape(out, iterator->first.data(), iterator->first.size());
+      out->append(pretty ? ": " : ":");
+      boost::apply_visitor(renderer, iterator->second);
     }
-    out << "}";
+    indent(out, pretty, depth);
+    out->push_back('}');
   }
 
   void operator () (const Array& array) const
   {
-    out << "[";
+    if (array.values.empty()) {
+      out->append("[]", 2);
+      return;
+    }
+
+    ValueRenderer renderer(out, pretty, depth + 1);
+
+    out->push_back('[');
     std::list<Value>::const_iterator iterator;
-    iterator = array.values.begin();
-    while (iterator != array.values.end()) {
-      boost::apply_visitor(Renderer(out), *iterator);
-      if (++iterator != array.values.end()) {
-        out << ",";
+    for (iterator = array.values.begin();
+         iterator != array.values.end();
+         ++iterator) {
+      if (iterator != array.values.begin()) {
+        out->push_back(',');
       }
+      indent(out, pretty, depth + 1);
+      boost::apply_visitor(renderer, *iterator);
     }
-    out << "]";
+    indent(out, pretty, depth);
+    out->push_back(']');
   }
 
   void operator () (const True&) const
   {
-    out << "true";
+    out->append("true", 4);
   }
 
   void operator () (const False&) const
   {
-    out << "false";
+    out->append("false", 5);
   }
 
   void operator () (const Null&) const
   {
-    out << "null";
+    out->append("null", 4);
+  }
+
+private:
+  std::string* out;
+  const bool pretty;
+  const size_t depth;
+};
+
+} // namespace internal {
+
+
+// Renders JSON objects using standard C++ output streams (via a
+// buffer, see above). The visitor pattern is used thanks to to build
+// a "renderer" with boost::static_visitor.
+struct Renderer : boost::static_visitor<>
+{
+  Renderer(std::ostream& _out) : out(_out) {}
+
+  template <typename T>
+  void operator () (const T& t) const
+  {
+    std::string buffer;
+    internal::ValueRenderer(&buffer, false)(t);
+    out.write(buffer.data(), buffer.size());
   }
 
 private:
@@ -185,9 +421,18 @@ private:
 };
 
 
+// Appends the rendered value to the buffer.
+inline void render(std::string* out, const Value& value, bool pretty = false)
+{
+  boost::apply_visitor(internal::ValueRenderer(out, pretty), value);
+}
+
+
 inline void render(std::ostream& out, const Value& value)
 {
-  boost::apply_visitor(Renderer(out), value);
+  std::string buffer;
+  render(&buffer, value);
+  out.write(buffer.data(), buffer.size());
 }
 
 
@@ -197,6 +442,1663 @@ inline std::ostream& operator<<(std::ostream& out, const JSON::Value& value)
   return out;
 }
 
+
+// Implementation of parsing JSON text (see RFC 4627). The parser is
+// event driven: it calls a Handler for each value as it goes rather
+// than building anything itself, so large documents can be processed
+// (e.g., searched, summarized or converted) without ever building the
+// whole tree in memory. The 'parse' overload returning a JSON::Value
+// simply uses a handler that builds the tree.
+//
+// Strings without escapes are passed to the handler directly out of
+// the input (i.e., without copying). Otherwise the unescaped string is
+// only valid for the duration of the call.
+
+class Handler
+{
+public:
+  virtual ~Handler() {}
+
+  virtual void null() {}
+  virtual void boolean(bool) {}
+  virtual void number(double) {}
+  virtual void string(const char* /* data */, size_t /* size */) {}
+
+  virtual void beginObject() {}
+  virtual void key(const char* /* data */, size_t /* size */) {}
+  virtual void endObject() {}
+
+  virtual void beginArray() {}
+  virtual void endArray() {}
+};
+
+
+namespace internal {
+
+// Limits how deeply objects and arrays can be nested (the parser is
+// recursive).
+#define JSON_MAX_DEPTH 1024
+
+// Returns the first character at or after 'p' that isn't whitespace.
+inline const char* skip(const char* p, const char* end)
+{
+  // Most of the time there isn't any whitespace at all.
+  if (p < end && static_cast<unsigned char>(*p) > ' ') {
+    return p;
+  }
+
+#ifdef __SSE2__
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i newline = _mm_set1_epi8('\n');
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i tab = _mm_set1_epi8('\t');
+
+  while (end - p >= 16) {
+    __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i whitespace = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(c, space), _mm_cmpeq_epi8(c, newline)),
+        _mm_or_si128(_mm_cmpeq_epi8(c, cr), _mm_cmpeq_epi8(c, tab)));
+    int mask = ~_mm_movemask_epi8(whitespace) & 0xFFFF;
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 16;
+  }
+#endif // __SSE2__
+
+  while (p < end &&
+         (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')) {
+    p++;
+  }
+  return p;
+}
+
+
+// Returns the first character at or after 'p' which ends a run of
+// plain string characters, i.e., a quote, a backslash or a control
+// character (which must be escaped), or 'end'.
+inline const char* scan(const char* p, const char* end)
+{
+#ifdef __SSE2__
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control = _mm_set1_epi8(0x1F);
+
+  while (end - p >= 16) {
+    __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i special = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(c, quote), _mm_cmpeq_epi8(c, backslash)),
+        // Unsigned c <= 0x1F.
+        _mm_cmpeq_epi8(_mm_max_epu8(c, control), control));
+    int mask = _mm_movemask_epi8(special);
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 16;
+  }
+#endif // __SSE2__
+
+  while (p < end) {
+    unsigned char c = *p;
+    if (c == '"' || c == '\\' || c < 0x20) {
+      break;
+    }
+    p++;
+  }
+  return p;
+}
+
+
+// Parses up to 8 digits at a time into 'value'. Returns the number of
+// digits consumed (0 if there weren't 8 digits available, in which
+// case the caller must continue one digit at a time).
+inline int digits8(const char* p, const char* end, uint64_t* value)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  if (end - p < 8) {
+    return 0;
+  }
+
+  uint64_t v;
+  memcpy(&v, p, 8);
+
+  // Are all 8 bytes in '0'..'9'?
+  if (((v & 0xF0F0F0F0F0F0F0F0ULL) |
+       (((v + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) !=
+      0x3333333333333333ULL) {
+    return 0;
+  }
+
+  // Combine pairs of digits, then pairs of pairs, etc. (SWAR).
+  v -= 0x3030303030303030ULL;
+  v = (v * 10) + (v >> 8);
+  v = (((v & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+       (((v >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+
+  *value = *value * 100000000ULL + v;
+  return 8;
+#else
+  return 0;
+#endif
+}
+
+
+class Parser
+{
+public:
+  Parser(const char* _begin, const char* _end, Handler* _handler)
+    : begin(_begin), end(_end), p(_begin), handler(_handler) {}
+
+  Try<Nothing> parse()
+  {
+    p = skip(p, end);
+    if (!value(0)) {
+      return Error(message);
+    }
+
+    p = skip(p, end);
+    if (p != end) {
+      return Error(unexpected("end of input"));
+    }
+
+    return Nothing();
+  }
+
+private:
+  bool value(size_t depth)
+  {
+    if (p == end) {
+      return fail("Unexpected end of input");
+    }
+
+    switch (*p) {
+      case '{': return object(depth + 1);
+      case '[': return array(depth + 1);
+      case '"': {
+        const char* data;
+        size_t size;
+        if (!string(&data, &size)) {
+          return false;
+        }
+        handler->string(data, size);
+        return true;
+      }
+      case 't':
+        if (literal("true", 4)) {
+          handler->boolean(true);
+          return true;
+        }
+        return false;
+      case 'f':
+        if (literal("false", 5)) {
+          handler->boolean(false);
+          return true;
+        }
+        return false;
+      case 'n':
+        if (literal("null", 4)) {
+          handler->null();
+          return true;
+        }
+        return false;
+      default:
+        return number();
+    }
+  }
+
+  bool object(size_t depth)
+  {
+    if (depth > JSON_MAX_DEPTH) {
+      return fail("Exceeded the maximum nesting depth");
+    }
+
+    handler->beginObject();
+    p = skip(p + 1, end);
+
+    if (p < end && *p == '}') {
+      p++;
+      handler->endObject();
+      return true;
+    }
+
+    while (true) {
+      if (p == end || *p != '"') {
+        return fail(unexpected("'\"'"));
+      }
+
+      const char* data;
+      size_t size;
+      if (!string(&data, &size)) {
+        return false;
+      }
+      handler->key(data, size);
+
+      p = skip(p, end);
+      if (p == end || *p != ':') {
+        return fail(unexpected("':'"));
+      }
+
+      p = skip(p + 1, end);
+      if (!value(depth)) {
+        return false;
+      }
+
+      p = skip(p, end);
+      if (p < end && *p == ',') {
+        p = skip(p + 1, end);
+      } else if (p < end && *p == '}') {
+        p++;
+        handler->endObject();
+        return true;
+      } else {
+        return fail(unexpected("',' or '}'"));
+      }
+    }
+  }
+
+  bool array(size_t depth)
+  {
+    if (depth > JSON_MAX_DEPTH) {
+      return fail("Exceeded the maximum nesting depth");
+    }
+
+    handler->beginArray();
+    p = skip(p + 1, end);
+
+    if (p < end && *p == ']') {
+      p++;
+      handler->endArray();
+      return true;
+    }
+
+    while (true) {
+      if (!value(depth)) {
+        return false;
+      }
+
+      p = skip(p, end);
+      if (p < end && *p == ',') {
+        p = skip(p + 1, end);
+      } else if (p < end && *p == ']') {
+        p++;
+        handler->endArray();
+        return true;
+      } else {
+        return fail(unexpected("',' or ']'"));
+      }
+    }
+  }
+
+  // Parses the string starting at 'p' (a quote). The result points
+  // into the input if the string has no escapes, otherwise into
+  // 'buffer'.
+  bool string(const char** data, size_t* size)
+  {
+    const char* start = ++p;
+
+    p = scan(p, end);
+    if (p < end && *p == '"') {
+      *data = start;
+      *size = p - start;
+      p++;
+      return true;
+    }
+
+    buffer.assign(start, p - start);
+
+    while (true) {
+      if (p == end) {
+        return fail("Unterminated string");
+      }
+
+      unsigned char c = *p;
+      if (c == '"') {
+        p++;
+        break;
+      } else if (c < 0x20) {
+        return fail("Unescaped control character in string");
+      }
+
+      // An escape.
+      if (++p == end) {
+        return fail("Unterminated string");
+      }
+
+      switch (*p++) {
+        case '"':  buffer += '"'; break;
+        case '\\': buffer += '\\'; break;
+        case '/':  buffer += '/'; break;
+        case 'b':  buffer += '\b'; break;
+        case 'f':  buffer += '\f'; break;
+        case 'n':  buffer += '\n'; break;
+        case 'r':  buffer += '\r'; break;
+        case 't':  buffer += '\t'; break;
+        case 'u':
+          if (!unicode()) {
+            return false;
+          }
+          break;
+        default:
+          p--;
+          return fail("Invalid escape in string");
+      }
+
+      start = p;
+      p = scan(p, end);
+      buffer.append(start, p - start);
+    }
+
+    *data = buffer.data();
+    *size = buffer.size();
+    return true;
+  }
+
+  // Parses the 4 hex digits of a \u escape.
+  bool hex(uint32_t* value)
+  {
+    if (end - p < 4) {
+      return fail("Invalid \\u escape in string");
+    }
+
+    *value = 0;
+    for (int i = 0; i < 4; i++) {
+      char c = *p++;
+      *value <<= 4;
+      if (c >= '0' && c <= '9') {
+        *value |= c - '0';
+      } else if (c >= 'a' && c <= 'f') {
+        *value |= c - 'a' + 10;
+      } else if (c >= 'A' && c <= 'F') {
+        *value |= c - 'A' + 10;
+      } else {
+        return fail("Invalid \\u escape in string");
+      }
+    }
+    return true;
+  }
+
+  // Appends the UTF-8 encoding of a \u escape (after the 'u'),
+  // including UTF-16 surrogate pairs.
+  bool unicode()
+  {
+    uint32_t code = 0;
+    if (!hex(&code)) {
+      return false;
+    }
+
+    if (code >= 0xD800 && code <= 0xDBFF) {
+      uint32_t low = 0;
+      if (end - p < 2 || p[0] != '\\' || p[1] != 'u') {
+        return fail("Unpaired surrogate in \\u escape");
+      }
+      p += 2;
+      if (!hex(&low)) {
+        return false;
+      } else if (low < 0xDC00 || low > 0xDFFF) {
+        return fail("Unpaired surrogate in \\u escape");
+      }
+      code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+    } else if (code >= 0xDC00 && code <= 0xDFFF) {
+      return fail("Unpaired surrogate in \\u escape");
+    }
+
+    if (code < 0x80) {
+      buffer += static_cast<char>(code);
+    } else if (code < 0x800) {
+      buffer += static_cast<char>(0xC0 | (code >> 6));
+      buffer += static_cast<char>(0x80 | (code & 0x3F));
+    } else if (code < 0x10000) {
+      buffer += static_cast<char>(0xE0 | (code >> 12));
+      buffer += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+      buffer += static_cast<char>(0x80 | (code & 0x3F));
+    } else {
+      buffer += static_cast<char>(0xF0 | (code >> 18));
+      buffer += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+      buffer += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+      buffer += static_cast<char>(0x80 | (code & 0x3F));
+    }
+
+    return true;
+  }
+
+  // Parses a number, using exact integer arithmetic when possible and
+  // only falling back to strtod for numbers which can't be converted
+  // exactly that way (more than 19 significant digits or a large
+  // exponent).
+  bool number()
+  {
+    const char* start = p;
+
+    bool negative = false;
+    if (*p == '-') {
+      negative = true;
+      p++;
+    }
+
+    if (p == end || *p < '0' || *p > '9') {
+      p = start;
+      return fail(unexpected("a value"));
+    }
+
+    uint64_t mantissa = 0;
+    int digits = 0; // Significant digits in the mantissa.
+    int exponent = 0;
+    bool exact = true;
+
+    if (*p == '0') {
+      p++;
+    } else {
+      while (true) {
+        if (digits <= 11) {
+          int count = digits8(p, end, &mantissa);
+          if (count > 0) {
+            digits += count;
+            p += count;
+            continue;
+          }
+        }
+        if (p == end || *p < '0' || *p > '9') {
+          break;
+        }
+        if (digits < 19) {
+          mantissa = mantissa * 10 + (*p - '0');
+          digits++;
+        } else {
+          exact = false;
+        }
+        p++;
+      }
+    }
+
+    if (p < end && *p == '.') {
+      p++;
+      if (p == end || *p < '0' || *p > '9') {
+        return fail("Expecting a digit after the decimal point");
+      }
+      while (p < end && *p >= '0' && *p <= '9') {
+        if (digits < 19) {
+          mantissa = mantissa * 10 + (*p - '0');
+          if (mantissa != 0) {
+            digits++;
+          }
+          exponent--;
+        } else {
+          exact = false;
+        }
+        p++;
+      }
+    }
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+      p++;
+      bool minus = false;
+      if (p < end && (*p == '+' || *p == '-')) {
+        minus = *p == '-';
+        p++;
+      }
+      if (p == end || *p < '0' || *p > '9') {
+        return fail("Expecting a digit in the exponent");
+      }
+      int e = 0;
+      while (p < end && *p >= '0' && *p <= '9') {
+        if (e < 100000) {
+          e = e * 10 + (*p - '0');
+        }
+        p++;
+      }
+      exponent += minus ? -e : e;
+    }
+
+    // Both the mantissa and 10^exponent are exactly representable as
+    // doubles so a single multiplication or division (which is
+    // correctly rounded) gives the correctly rounded result.
+    static const double powers[] = {
+      1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    double value;
+    if (exact &&
+        mantissa <= (1ULL << 53) &&
+        exponent >= -22 && exponent <= 22) {
+      value = static_cast<double>(mantissa);
+      value = exponent < 0
+        ? value / powers[-exponent]
+        : value * powers[exponent];
+      if (negative) {
+        value = -value;
+      }
+    } else {
+      // NOTE: strtod needs a terminated string.
+      std::string s(start, p - start);
+      value = strtod(s.c_str(), NULL);
+    }
+
+    handler->number(value);
+    return true;
+  }
+
+  bool literal(const char* s, size_t size)
+  {
+    if (static_cast<size_t>(end - p) < size || memcmp(p, s, size) != 0) {
+      return fail(unexpected("a value"));
+    }
+    p += size;
+    return true;
+  }
+
+  std::string unexpected(const std::string& expecting)
+  {
+    return "Expecting " + expecting + " at offset " + stringify(p - begin);
+  }
+
+  bool fail(const std::string& _message)
+  {
+    message = _message;
+    if (message.find(" at offset ") == std::string::npos) {
+      message += " at offset " + stringify(p - begin);
+    }
+    return false;
+  }
+
+  const char* begin;
+  const char* end;
+  const char* p;
+  Handler* handler;
+
+  std::string buffer; // For unescaping strings.
+  std::string message; // Describing the first error.
+};
+
+
+// Builds a JSON::Value from the parser's events.
+class Builder : public Handler
+{
+public:
+  virtual void null() { add(Null()); }
+
+  virtual void boolean(bool b)
+  {
+    if (b) {
+      add(True());
+    } else {
+      add(False());
+    }
+  }
+
+  virtual void number(double d) { add(Number(d)); }
+
+  virtual void string(const char* data, size_t size)
+  {
+    add(String(std::string(data, size)));
+  }
+
+  virtual void beginObject()
+  {
+    Value* value = add(Object());
+    Frame frame;
+    frame.object = boost::get<Object>(value);
+    frame.array = NULL;
+    frames.push_back(frame);
+  }
+
+  virtual void key(const char* data, size_t size)
+  {
+    frames.back().key.assign(data, size);
+  }
+
+  virtual void endObject() { frames.pop_back(); }
+
+  virtual void beginArray()
+  {
+    Value* value = add(Array());
+    Frame frame;
+    frame.object = NULL;
+    frame.array = boost::get<Array>(value);
+    frames.push_back(frame);
+  }
+
+  virtual void endArray() { frames.pop_back(); }
+
+  Value root;
+
+private:
+  // Adds the value to the innermost object or array (or makes it the
+  // root) and returns where it was stored.
+  template <typename T>
+  Value* add(const T& t)
+  {
+    if (frames.empty()) {
+      root = t;
+      return &root;
+    }
+
+    Frame& frame = frames.back();
+    if (frame.object != NULL) {
+      Value& value = frame.object->values[frame.key];
+      value = t;
+      return &value;
+    }
+
+    frame.array->values.push_back(t);
+    return &frame.array->values.back();
+  }
+
+  // An object or array that is being built.
+  struct Frame
+  {
+    Object* object;
+    Array* array;
+    std::string key; // The key for the next value of an object.
+  };
+
+  std::vector<Frame> frames;
+};
+
+} // namespace internal {
+
+
+// Parses the JSON text, calling the handler for each value.
+inline Try<Nothing> parse(const std::string& s, Handler* handler)
+{
+  return internal::Parser(s.data(), s.data() + s.size(), handler).parse();
+}
+
+
+// Parses the JSON text into a JSON::Value.
+inline Try<Value> parse(const std::string& s)
+{
+  internal::Builder builder;
+  Try<Nothing> parsed = parse(s, &builder);
+  if (parsed.isError()) {
+    return Error(parsed.error());
+  }
+  return builder.root;
+}
+
+
+// A compact, read-only representation of a parsed JSON document.
+// Unlike a JSON::Value (where every string, object member and array
+// element is a separate allocation) all of a document's values are
+// stored in a few large blocks of memory (an "arena") that get freed
+// together with the document: arrays are stored as contiguous
+// elements, objects as contiguous members (in the order they appear
+// in the text) and each distinct key is only stored once. For
+// example:
+//
+//   JSON::Document document;
+//   Try<Nothing> parse = document.parse(s);
+//   ...
+//   const JSON::Node* tasks = document.root().find("tasks");
+//   for (size_t i = 0; i < tasks->size(); i++) {
+//     ... tasks->at(i).find("id")->string() ...
+//   }
+
+class Document;
+
+
+class Node
+{
+public:
+  enum Type {
+    NULL_VALUE,
+    BOOLEAN,
+    NUMBER,
+    STRING,
+    ARRAY,
+    OBJECT
+  };
+
+  Type type() const { return static_cast<Type>(kind); }
+
+  bool isNull() const { return kind == NULL_VALUE; }
+  bool isBoolean() const { return kind == BOOLEAN; }
+  bool isNumber() const { return kind == NUMBER; }
+  bool isString() const { return kind == STRING; }
+  bool isArray() const { return kind == ARRAY; }
+  bool isObject() const { return kind == OBJECT; }
+
+  bool boolean() const { return count != 0; }
+  double number() const { return contents.number; }
+
+  // The (NUL terminated) bytes of a string.
+  const char* data() const { return contents.string; }
+  std::string string() const { return std::string(contents.string, count); }
+
+  // The length of a string or the number of elements of an array or
+  // members of an object.
+  size_t size() const { return count; }
+
+  // Returns the i'th element of an array.
+  const Node& at(size_t i) const { return contents.elements[i]; }
+
+  // Returns the key and value of the i'th member of an object.
+  std::string key(size_t i) const;
+  const char* keyData(size_t i) const;
+  size_t keySize(size_t i) const;
+  const Node& value(size_t i) const;
+
+  // Returns the value of the object's member with the specified key,
+  // or NULL if there isn't one (or this isn't an object).
+  const Node* find(const std::string& key) const;
+
+private:
+  friend class Document;
+
+  struct Member;
+
+  uint8_t kind;
+  uint32_t count;
+
+  union {
+    double number;
+    const char* string;
+    const Node* elements;
+    const Member* members;
+  } contents;
+};
+
+
+// NOTE: Interned keys are NUL terminated and preceded by their length
+// (as a uint32_t) which keeps members small.
+struct Node::Member
+{
+  const char* key;
+  Node value;
+
+  uint32_t length() const
+  {
+    uint32_t length;
+    memcpy(&length, key - sizeof(length), sizeof(length));
+    return length;
+  }
+};
+
+
+inline std::string Node::key(size_t i) const
+{
+  return std::string(contents.members[i].key, contents.members[i].length());
+}
+
+
+inline const char* Node::keyData(size_t i) const
+{
+  return contents.members[i].key;
+}
+
+
+inline size_t Node::keySize(size_t i) const
+{
+  return contents.members[i].length();
+}
+
+
+inline const Node& Node::value(size_t i) const
+{
+  return contents.members[i].value;
+}
+
+
+inline const Node* Node::find(const std::string& key) const
+{
+  if (kind != OBJECT) {
+    return NULL;
+  }
+
+  // Objects are usually small so a linear search is fast.
+  for (uint32_t i = 0; i < count; i++) {
+    const Member& member = contents.members[i];
+    if (member.length() == key.size() &&
+        memcmp(member.key, key.data(), key.size()) == 0) {
+      return &member.value;
+    }
+  }
+
+  return NULL;
+}
+
+
+namespace internal {
+
+// Allocates memory out of large blocks which are all freed at once
+// when the arena is destroyed.
+class Arena
+{
+public:
+  Arena() : next(NULL), remaining(0), last(0), allocated(0) {}
+
+  ~Arena()
+  {
+    foreach (char* block, blocks) {
+      delete[] block;
+    }
+  }
+
+  void* allocate(size_t size)
+  {
+    // Keep everything 8 byte aligned.
+    size = (size + 7) & ~static_cast<size_t>(7);
+
+    if (size > remaining) {
+      // Blocks double in size (up to 1MB) so small documents stay
+      // small; anything larger than a block gets its own block.
+      size_t capacity = blocks.empty() ? 4096 : 2 * last;
+      if (capacity > 1024 * 1024) {
+        capacity = 1024 * 1024;
+      }
+      last = capacity;
+
+      if (size > capacity) {
+        char* block = new char[size];
+        blocks.push_back(block);
+        allocated += size;
+        return block;
+      }
+
+      next = new char[capacity];
+      blocks.push_back(next);
+      remaining = capacity;
+      allocated += capacity;
+    }
+
+    void* result = next;
+    next += size;
+    remaining -= size;
+    return result;
+  }
+
+  // Frees all the blocks, invalidating everything allocated so far.
+  void clear()
+  {
+    foreach (char* block, blocks) {
+      delete[] block;
+    }
+    blocks.clear();
+    next = NULL;
+    remaining = 0;
+    last = 0;
+    allocated = 0;
+  }
+
+  // Returns the total number of bytes allocated for blocks.
+  size_t size() const { return allocated; }
+
+private:
+  Arena(const Arena&);
+  Arena& operator = (const Arena&);
+
+  std::vector<char*> blocks;
+  char* next;
+  size_t remaining;
+  size_t last; // Capacity of the last (regular sized) block.
+  size_t allocated;
+};
+
+} // namespace internal {
+
+
+class Document
+{
+public:
+  Document() : keys(64, Key()), interned(0)
+  {
+    top.kind = Node::NULL_VALUE;
+    top.count = 0;
+  }
+
+  // Parses the JSON text, replacing the contents of the document
+  // (which invalidates any nodes from a previous parse). See
+  // JSON::parse for details.
+  Try<Nothing> parse(const std::string& s)
+  {
+    arena.clear();
+    std::vector<Key>(64, Key()).swap(keys);
+    interned = 0;
+
+    Builder builder(this);
+    Try<Nothing> parsed = JSON::parse(s, &builder);
+    if (parsed.isError() || builder.error.isSome()) {
+      top.kind = Node::NULL_VALUE;
+      top.count = 0;
+      if (parsed.isError()) {
+        return parsed;
+      }
+      return Error(builder.error.get());
+    }
+    return parsed;
+  }
+
+  const Node& root() const { return top; }
+
+  // Returns the number of bytes of memory used by the document.
+  size_t memory() const
+  {
+    return arena.size() + keys.capacity() * sizeof(Key);
+  }
+
+private:
+  Document(const Document&);
+  Document& operator = (const Document&);
+
+  // An entry in the table of interned keys.
+  struct Key
+  {
+    Key() : data(NULL), length(0), hash(0) {}
+
+    const char* data;
+    uint32_t length;
+    uint32_t hash;
+  };
+
+  // Copies the bytes into the arena (NUL terminated).
+  const char* copy(const char* data, size_t size)
+  {
+    char* result = static_cast<char*>(arena.allocate(size + 1));
+    memcpy(result, data, size);
+    result[size] = '\0';
+    return result;
+  }
+
+  // Returns the one copy of the key (in the arena) using an open
+  // addressing hash table (with linear probing).
+  const char* intern(const char* data, size_t size)
+  {
+    // FNV-1a.
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+      hash = (hash ^ static_cast<unsigned char>(data[i])) * 16777619u;
+    }
+
+    size_t mask = keys.size() - 1;
+    size_t i = hash & mask;
+    while (keys[i].data != NULL) {
+      if (keys[i].hash == hash &&
+          keys[i].length == size &&
+          memcmp(keys[i].data, data, size) == 0) {
+        return keys[i].data;
+      }
+      i = (i + 1) & mask;
+    }
+
+    char* result = static_cast<char*>(
+        arena.allocate(sizeof(uint32_t) + size + 1)) + sizeof(uint32_t);
+    uint32_t length = size;
+    memcpy(result - sizeof(length), &length, sizeof(length));
+    memcpy(result, data, size);
+    result[size] = '\0';
+
+    keys[i].data = result;
+    keys[i].length = size;
+    keys[i].hash = hash;
+
+    // Keep the table at most half full.
+    if (++interned * 2 > keys.size()) {
+      std::vector<Key> old(keys.size() * 2, Key());
+      old.swap(keys);
+      mask = keys.size() - 1;
+      foreach (const Key& key, old) {
+        if (key.data != NULL) {
+          size_t j = key.hash & mask;
+          while (keys[j].data != NULL) {
+            j = (j + 1) & mask;
+          }
+          keys[j] = key;
+        }
+      }
+    }
+
+    return result;
+  }
+
+  // Builds the document from the parser's events. The values of the
+  // objects and arrays that are still being parsed are kept on a
+  // stack and copied into the arena (contiguously) once each object
+  // or array has ended.
+  class Builder : public Handler
+  {
+  public:
+    explicit Builder(Document* _document)
+      : document(_document), pending(NULL) {}
+
+    virtual void null()
+    {
+      Node node;
+      node.kind = Node::NULL_VALUE;
+      node.count = 0;
+      add(node);
+    }
+
+    virtual void boolean(bool b)
+    {
+      Node node;
+      node.kind = Node::BOOLEAN;
+      node.count = b ? 1 : 0;
+      add(node);
+    }
+
+    virtual void number(double d)
+    {
+      Node node;
+      node.kind = Node::NUMBER;
+      node.count = 0;
+      node.contents.number = d;
+      add(node);
+    }
+
+    virtual void string(const char* data, size_t size)
+    {
+      if (!fits(size, "String")) {
+        return;
+      }
+
+      Node node;
+      node.kind = Node::STRING;
+      node.count = size;
+      node.contents.string = document->copy(data, size);
+      add(node);
+    }
+
+    virtual void beginObject() { begin(); }
+
+    virtual void key(const char* data, size_t size)
+    {
+      if (!fits(size, "Key")) {
+        return;
+      }
+
+      pending = document->intern(data, size);
+    }
+
+    virtual void endObject()
+    {
+      Frame frame = end();
+
+      size_t count = stack.size() - frame.start;
+      if (!fits(count, "Object")) {
+        stack.resize(frame.start);
+        pending = frame.key;
+        null();
+        return;
+      }
+
+      Node::Member* members = static_cast<Node::Member*>(
+          document->arena.allocate(count * sizeof(Node::Member)));
+      std::copy(stack.begin() + frame.start, stack.end(), members);
+
+      Node node;
+      node.kind = Node::OBJECT;
+      node.count = count;
+      node.contents.members = members;
+      finish(frame, node);
+    }
+
+    virtual void beginArray() { begin(); }
+
+    virtual void endArray()
+    {
+      Frame frame = end();
+
+      size_t count = stack.size() - frame.start;
+      if (!fits(count, "Array")) {
+        stack.resize(frame.start);
+        pending = frame.key;
+        null();
+        return;
+      }
+
+      Node* elements = static_cast<Node*>(
+          document->arena.allocate(count * sizeof(Node)));
+      for (size_t i = 0; i < count; i++) {
+        elements[i] = stack[frame.start + i].value;
+      }
+
+      Node node;
+      node.kind = Node::ARRAY;
+      node.count = count;
+      node.contents.elements = elements;
+      finish(frame, node);
+    }
+
+    // Set if the document can't be represented.
+    Option<std::string> error;
+
+  private:
+    // An object or array that is being built.
+    struct Frame
+    {
+      size_t start; // Of its values on the stack.
+      const char* key; // Of the object or array in its parent.
+    };
+
+    // Returns false (and sets the error) if the size of a string or
+    // number of entries in an object or array exceeds what a node can
+    // hold.
+    bool fits(size_t size, const std::string& what)
+    {
+      if (size > std::numeric_limits<uint32_t>::max()) {
+        if (error.isNone()) {
+          error = what + " has more than 2^32 - 1 entries";
+        }
+        return false;
+      }
+      return true;
+    }
+
+    void begin()
+    {
+      Frame frame;
+      frame.start = stack.size();
+      frame.key = pending;
+      frames.push_back(frame);
+    }
+
+    Frame end()
+    {
+      Frame frame = frames.back();
+      frames.pop_back();
+      return frame;
+    }
+
+    void finish(const Frame& frame, const Node& node)
+    {
+      stack.resize(frame.start);
+      pending = frame.key;
+      add(node);
+    }
+
+    void add(const Node& node)
+    {
+      if (frames.empty()) {
+        document->top = node;
+        return;
+      }
+
+      Node::Member member;
+      member.key = pending;
+      member.value = node;
+      stack.push_back(member);
+    }
+
+    Document* document;
+    std::vector<Node::Member> stack;
+    std::vector<Frame> frames;
+    const char* pending; // Key for the next value (if in an object).
+  };
+
+  internal::Arena arena;
+  std::vector<Key> keys;
+  size_t interned;
+  Node top;
+};
+
+
+namespace internal {
+
+inline void render(
+    std::string* out,
+    const Node& node,
+    bool pretty,
+    size_t depth)
+{
+  switch (node.type()) {
+    case Node::NULL_VALUE:
+      out->append("null", 4);
+      break;
+    case Node::BOOLEAN:
+      out->append(node.boolean() ? "true" : "false");
+      break;
+    case Node::NUMBER:
+      number(out, node.number());
+      break;
+    case Node::STRING:
+      escape(out, node.data(), node.size());
+      break;
+    case Node::ARRAY:
+      if (node.size() == 0) {
+        out->append("[]", 2);
+        break;
+      }
+      out->push_back('[');
+      for (size_t i = 0; i < node.size(); i++) {
+        if (i > 0) {
+          out->push_back(',');
+        }
+        indent(out, pretty, depth + 1);
+        render(out, node.at(i), pretty, depth + 1);
+      }
+      indent(out, pretty, depth);
+      out->push_back(']');
+      break;
+    case Node::OBJECT:
+      if (node.size() == 0) {
+        out->append("{}", 2);
+        break;
+      }
+      out->push_back('{');
+      for (size_t i = 0; i < node.size(); i++) {
+        if (i > 0) {
+          out->push_back(',');
+        }
+        indent(out, pretty, depth + 1);
+        escape(out, node.keyData(i), node.keySize(i));
+        out->append(pretty ? ": " : ":");
+        render(out, node.value(i), pretty, depth + 1);
+      }
+      indent(out, pretty, depth);
+      out->push_back('}');
+      break;
+  }
+}
+
+} // namespace internal {
+
+
+// Appends the rendered node to the buffer.
+inline void render(std::string* out, const Node& node, bool pretty = false)
+{
+  internal::render(out, node, pretty, 0);
+}
+
+
+inline void render(std::ostream& out, const Node& node)
+{
+  std::string buffer;
+  render(&buffer, node);
+  out.write(buffer.data(), buffer.size());
+}
+
+
+inline std::ostream& operator << (std::ostream& out, const Node& node)
+{
+  render(out, node);
+  return out;
+}
+
+
+// Default number of bytes a Writer buffers before passing them on.
+#define JSON_WRITER_BUFFER_SIZE (64 * 1024)
+
+
+// A sink gets passed each chunk of output from a Writer (see below).
+typedef std::tr1::function<Try<Nothing>(const char*, size_t)> Sink;
+
+
+namespace internal {
+
+// Writes all of the data to the fd (a Sink for the Writer). If the fd
+// is non-blocking this waits until the fd is writable again rather
+// than failing, so a slow reader pushes back on the writer.
+inline Try<Nothing> write(int fd, const char* data, size_t size)
+{
+  while (size > 0) {
+    ssize_t length = ::write(fd, data, size);
+    if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        if (::poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+          return ErrnoError("Failed to poll");
+        }
+        continue;
+      }
+      return ErrnoError("Failed to write");
+    }
+    data += length;
+    size -= length;
+  }
+  return Nothing();
+}
+
+} // namespace internal {
+
+
+// Writes a JSON document incrementally (i.e., without building a
+// JSON::Value first) producing the same output as 'render' above.
+// For example:
+//
+//   JSON::Writer writer(fd);
+//   writer.beginObject();
+//   writer.key("pids");
+//   writer.beginArray();
+//   foreach (pid_t pid, pids) {
+//     writer.value(pid);
+//   }
+//   writer.endArray();
+//   writer.endObject();
+//   writer.finish();
+//
+// Output is buffered and passed to the sink (or written to the fd)
+// whenever the buffer reaches the threshold, so only a bounded amount
+// of memory is used regardless of the size of the document and a
+// slow sink blocks the writer. A Writer can also append everything to
+// a string, in which case nothing gets flushed until 'finish'.
+//
+// Every call checks that it produces valid JSON (e.g., that a key
+// precedes each value in an object and that there is only one value
+// at the top level). Once an error has occurred (including an error
+// from the sink) all subsequent calls return the error.
+class Writer
+{
+public:
+  explicit Writer(
+      const Sink& _sink,
+      bool _pretty = false,
+      size_t _threshold = JSON_WRITER_BUFFER_SIZE)
+    : sink(_sink),
+      pretty(_pretty),
+      threshold(_threshold),
+      out(&buffer),
+      values(0),
+      pending(false),
+      finished(false) {}
+
+  explicit Writer(
+      int fd,
+      bool _pretty = false,
+      size_t _threshold = JSON_WRITER_BUFFER_SIZE)
+    : sink(std::tr1::bind(
+          &internal::write,
+          fd,
+          std::tr1::placeholders::_1,
+          std::tr1::placeholders::_2)),
+      pretty(_pretty),
+      threshold(_threshold),
+      out(&buffer),
+      values(0),
+      pending(false),
+      finished(false) {}
+
+  explicit Writer(std::string* _out, bool _pretty = false)
+    : pretty(_pretty),
+      threshold(0),
+      out(_out),
+      values(0),
+      pending(false),
+      finished(false) {}
+
+  Try<Nothing> beginObject()
+  {
+    return begin('{', true);
+  }
+
+  // Writes the key of the next member of the current object.
+  Try<Nothing> key(const std::string& key)
+  {
+    return this->key(key.data(), key.size());
+  }
+
+  Try<Nothing> key(const char* data, size_t size)
+  {
+    if (error.isSome()) {
+      return Error(error.get());
+    } else if (finished) {
+      return Error("Writer has already been finished");
+    } else if (frames.empty() || !frames.back().object) {
+      return fail("Expecting a value, not a key, outside of an object");
+    } else if (pending) {
+      return fail("Expecting a value after a key");
+    }
+
+    separate();
+    internal::escape(out, data, size);
+    out->append(pretty ? ": " : ":");
+    pending = true;
+    return Nothing();
+  }
+
+  Try<Nothing> endObject()
+  {
+    return end('}', true);
+  }
+
+  Try<Nothing> beginArray()
+  {
+    return begin('[', false);
+  }
+
+  Try<Nothing> endArray()
+  {
+    return end(']', false);
+  }
+
+  Try<Nothing> value(const std::string& string)
+  {
+    return value(string.data(), string.size());
+  }
+
+  Try<Nothing> value(const char* string)
+  {
+    return value(string, strlen(string));
+  }
+
+  Try<Nothing> value(const char* data, size_t size)
+  {
+    Try<Nothing> prepared = prepare();
+    if (prepared.isError()) {
+      return prepared;
+    }
+    internal::escape(out, data, size);
+    return flush(false);
+  }
+
+  Try<Nothing> value(double number)
+  {
+    Try<Nothing> prepared = prepare();
+    if (prepared.isError()) {
+      return prepared;
+    }
+    internal::number(out, number);
+    return flush(false);
+  }
+
+  // Integers would otherwise be ambiguous between double and bool.
+  Try<Nothing> value(int number) { return value(double(number)); }
+  Try<Nothing> value(long number) { return value(double(number)); }
+  Try<Nothing> value(long long number) { return value(double(number)); }
+  Try<Nothing> value(unsigned int number) { return value(double(number)); }
+  Try<Nothing> value(unsigned long number) { return value(double(number)); }
+
+  Try<Nothing> value(unsigned long long number)
+  {
+    return value(double(number));
+  }
+
+  Try<Nothing> value(bool boolean)
+  {
+    Try<Nothing> prepared = prepare();
+    if (prepared.isError()) {
+      return prepared;
+    }
+    out->append(boolean ? "true" : "false");
+    return flush(false);
+  }
+
+  Try<Nothing> null()
+  {
+    Try<Nothing> prepared = prepare();
+    if (prepared.isError()) {
+      return prepared;
+    }
+    out->append("null", 4);
+    return flush(false);
+  }
+
+  // Writes an entire (already built) value or document node.
+  Try<Nothing> value(const Value& value)
+  {
+    Try<Nothing> prepared = prepare();
+    if (prepared.isError()) {
+      return prepared;
+    }
+    boost::apply_visitor(
+        internal::ValueRenderer(out, pretty, frames.size()),
+        value);
+    return flush(false);
+  }
+
+  Try<Nothing> value(const Node& node)
+  {
+    Try<Nothing> prepared = prepare();
+    if (prepared.isError()) {
+      return prepared;
+    }
+    internal::render(out, node, pretty, frames.size());
+    return flush(false);
+  }
+
+  // Passes everything buffered so far to the sink.
+  Try<Nothing> flush()
+  {
+    if (error.isSome()) {
+      return Error(error.get());
+    }
+    return flush(true);
+  }
+
+  // Checks that the document is complete and flushes it. Nothing can
+  // be written after finishing.
+  Try<Nothing> finish()
+  {
+    if (error.isSome()) {
+      return Error(error.get());
+    } else if (finished) {
+      return Error("Writer has already been finished");
+    } else if (values == 0 || !frames.empty()) {
+      return fail("Incomplete JSON document");
+    }
+
+    finished = true;
+    return flush(true);
+  }
+
+private:
+  // Not copyable, not assignable.
+  Writer(const Writer&);
+  Writer& operator = (const Writer&);
+
+  // An object or array that has been begun but not yet ended.
+  struct Frame
+  {
+    explicit Frame(bool _object) : object(_object), count(0) {}
+
+    bool object;
+    size_t count; // Number of members or elements so far.
+  };
+
+  Error fail(const std::string& message)
+  {
+    error = message;
+    return Error(message);
+  }
+
+  // Writes the separator (and indentation) for the next member or
+  // element of the current object or array.
+  void separate()
+  {
+    Frame& frame = frames.back();
+    if (frame.count++ > 0) {
+      out->push_back(',');
+    }
+    internal::indent(out, pretty, frames.size());
+  }
+
+  // Checks that a value can be written here, and writes a separator
+  // if necessary.
+  Try<Nothing> prepare()
+  {
+    if (error.isSome()) {
+      return Error(error.get());
+    } else if (finished) {
+      return Error("Writer has already been finished");
+    }
+
+    if (frames.empty()) {
+      if (values > 0) {
+        return fail("Expecting only one value at the top level");
+      }
+      values++;
+    } else if (frames.back().object) {
+      if (!pending) {
+        return fail("Expecting a key before a value in an object");
+      }
+      pending = false;
+    } else {
+      separate();
+    }
+
+    return Nothing();
+  }
+
+  Try<Nothing> begin(char c, bool object)
+  {
+    Try<Nothing> prepared = prepare();
+    if (prepared.isError()) {
+      return prepared;
+    } else if (frames.size() >= JSON_MAX_DEPTH) {
+      return fail("Exceeded the maximum nesting depth");
+    }
+    out->push_back(c);
+    frames.push_back(Frame(object));
+    return Nothing();
+  }
+
+  Try<Nothing> end(char c, bool object)
+  {
+    if (error.isSome()) {
+      return Error(error.get());
+    } else if (finished) {
+      return Error("Writer has already been finished");
+    } else if (frames.empty() || frames.back().object != object) {
+      return fail(std::string("Unexpected end of ") +
+                  (object ? "object" : "array"));
+    } else if (pending) {
+      return fail("Expecting a value after a key");
+    }
+
+    size_t count = frames.back().count;
+    frames.pop_back();
+    if (count > 0) {
+      internal::indent(out, pretty, frames.size());
+    }
+    out->push_back(c);
+    return flush(false);
+  }
+
+  // Passes the buffer to the sink if forced or it has reached the
+  // threshold (when there is a sink).
+  Try<Nothing> flush(bool force)
+  {
+    if (out != &buffer || buffer.empty() ||
+        (!force && buffer.size() < threshold)) {
+      return Nothing();
+    }
+
+    Try<Nothing> written = sink(buffer.data(), buffer.size());
+    buffer.clear();
+    if (written.isError()) {
+      return fail(written.error());
+    }
+    return Nothing();
+  }
+
+  Sink sink;
+  const bool pretty;
+  const size_t threshold;
+
+  std::string buffer;
+  std::string* out; // Either the buffer or the caller's string.
+
+  std::vector<Frame> frames;
+  size_t values; // Number of values at the top level.
+  bool pending; // Whether a key has been written without its value.
+  bool finished;
+  Option<std::string> error;
+};
+
 } // namespace JSON {
 
 #endif // __STOUT_JSON__
@@ -4,14 +4,19 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <fts.h>
 #include <glob.h>
 #include <libgen.h>
 #include <limits.h>
 #include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <regex.h>
 #include <signal.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -22,21 +27,38 @@
 #include <linux/version.h>
 #endif
 
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #ifdef __APPLE__
 #include <sys/sysctl.h>
 #endif
 #ifdef __linux__
+#include <sys/syscall.h>
 #include <sys/sysinfo.h>
 #endif
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/utsname.h>
 
+// io_uring (Linux 5.1+) is used through raw system calls (rather than
+// liburing) when the headers know about it, see AsyncWriter below.
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define OS_IO_URING
+#endif
+#endif
+
+#include <algorithm>
+#include <deque>
 #include <list>
 #include <set>
 #include <sstream>
 #include <string>
+#include <vector>
+
+#include <tr1/functional>
 
 #include "bytes.hpp"
 #include "duration.hpp"
@@ -44,6 +66,7 @@
 #include "foreach.hpp"
 #include "none.hpp"
 #include "nothing.hpp"
+#include "option.hpp"
 #include "path.hpp"
 #include "result.hpp"
 #include "strings.hpp"
@@ -223,19 +246,55 @@ inline Try<std::string> mktemp(const std::string& path = "/tmp/XXXXXX")
 }
 
 
-// Write out the string to the file at the current fd position.
-inline Try<Nothing> write(int fd, const std::string& message)
+// Called by the writes below when a non-blocking fd isn't writable,
+// to wait until it is (or fail, e.g., to give up after a timeout). By
+// default we wait with poll, but an event loop could, e.g., yield to
+// other work until the fd becomes writable.
+typedef std::tr1::function<Try<Nothing>(int)> Writable;
+
+
+namespace internal {
+
+inline Try<Nothing> writable(int fd)
+{
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLOUT;
+  pfd.revents = 0;
+
+  if (::poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+    return ErrnoError("Failed to poll");
+  }
+
+  return Nothing();
+}
+
+} // namespace internal {
+
+
+// Writes out all of the data to the file at the current fd position.
+// If the fd is non-blocking, 'writable' gets called to wait whenever
+// the write would block (rather than failing with EAGAIN).
+inline Try<Nothing> write(
+    int fd,
+    const char* data,
+    size_t size,
+    const Writable& writable = internal::writable)
 {
   size_t offset = 0;
 
-  while (offset < message.length()) {
-    ssize_t length =
-      ::write(fd, message.data() + offset, message.length() - offset);
+  while (offset < size) {
+    ssize_t length = ::write(fd, data + offset, size - offset);
 
     if (length < 0) {
-      // TODO(benh): Handle a non-blocking fd? (EAGAIN, EWOULDBLOCK)
       if (errno == EINTR) {
         continue;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        Try<Nothing> wait = writable(fd);
+        if (wait.isError()) {
+          return Error(wait.error());
+        }
+        continue;
       }
       return ErrnoError();
     }
@@ -247,9 +306,93 @@ inline Try<Nothing> write(int fd, const std::string& message)
 }
 
 
+// Write out the string to the file at the current fd position.
+inline Try<Nothing> write(int fd, const std::string& message)
+{
+  return write(fd, message.data(), message.length());
+}
+
+
+// Writes out all of the buffers, in order, with as few system calls
+// as possible (rather than copying them into one buffer or writing
+// them one at a time). Non-blocking fds are handled as for write().
+inline Try<Nothing> writev(
+    int fd,
+    const struct iovec* iov,
+    size_t count,
+    const Writable& writable = internal::writable)
+{
+  // A copy of (up to IOV_MAX of) the remaining buffers, the first of
+  // which gets adjusted after a partial write.
+  std::vector<struct iovec> remaining;
+
+  size_t index = 0;
+
+  while (index < count) {
+    if (remaining.empty()) {
+      size_t size = std::min(count - index, static_cast<size_t>(IOV_MAX));
+      remaining.assign(iov + index, iov + index + size);
+    }
+
+    ssize_t length = ::writev(fd, &remaining[0], remaining.size());
+
+    if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        Try<Nothing> wait = writable(fd);
+        if (wait.isError()) {
+          return Error(wait.error());
+        }
+        continue;
+      }
+      return ErrnoError();
+    }
+
+    // Skip past what was written (including any empty buffers).
+    size_t written = 0;
+    while (written < remaining.size() &&
+           static_cast<size_t>(length) >= remaining[written].iov_len) {
+      length -= remaining[written].iov_len;
+      written++;
+    }
+
+    remaining.erase(remaining.begin(), remaining.begin() + written);
+    index += written;
+
+    if (length > 0) {
+      remaining[0].iov_base =
+        static_cast<char*>(remaining[0].iov_base) + length;
+      remaining[0].iov_len -= length;
+    }
+  }
+
+  return Nothing();
+}
+
+
+inline Try<Nothing> writev(
+    int fd,
+    const std::vector<std::string>& buffers,
+    const Writable& writable = internal::writable)
+{
+  std::vector<struct iovec> iov(buffers.size());
+  for (size_t i = 0; i < buffers.size(); i++) {
+    iov[i].iov_base = const_cast<char*>(buffers[i].data());
+    iov[i].iov_len = buffers[i].size();
+  }
+
+  return writev(fd, iov.empty() ? NULL : &iov[0], iov.size(), writable);
+}
+
+
 // A wrapper function that wraps the above write() with
-// open and closing the file.
-inline Try<Nothing> write(const std::string& path, const std::string& message)
+// open and closing the file. If 'sync' is true the data is also
+// flushed to disk (with fsync) before the file gets closed.
+inline Try<Nothing> write(
+    const std::string& path,
+    const std::string& message,
+    bool sync = false)
 {
   Try<int> fd = os::open(path, O_WRONLY | O_CREAT | O_TRUNC,
                          S_IRUSR | S_IWUSR | S_IRGRP | S_IRWXO);
@@ -259,6 +402,10 @@ inline Try<Nothing> write(const std::string& path, const std::string& message)
 
   Try<Nothing> result = write(fd.get(), message);
 
+  if (result.isSome() && sync && ::fsync(fd.get()) < 0) {
+    result = ErrnoError("Failed to fsync file '" + path + "'");
+  }
+
   // We ignore the return value of close(). This is because users
   // calling this function are interested in the return value of
   // write(). Also an unsuccessful close() doesn't affect the write.
@@ -268,74 +415,704 @@ inline Try<Nothing> write(const std::string& path, const std::string& message)
 }
 
 
-// Reads 'size' bytes from a file from its current offset.
-// If EOF is encountered before reading size bytes, then the offset
-// is restored and none is returned.
-inline Result<std::string> read(int fd, size_t size)
+namespace internal {
+
+// Same as os::pwrite below but returns the errno (or 0) so callers
+// that only need the error code don't depend on errno surviving the
+// construction of an ErrnoError.
+inline int pwrite(int fd, const char* data, size_t size, off_t offset)
 {
-  // Save the current offset.
-  off_t current = lseek(fd, 0, SEEK_CUR);
-  if (current == -1) {
-    return ErrnoError("Failed to lseek to SEEK_CUR");
+  size_t done = 0;
+
+  while (done < size) {
+    ssize_t length =
+      ::pwrite(fd, data + done, size - done, offset + done);
+
+    if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    } else if (length == 0) {
+      return EIO; // Don't spin if no progress can be made.
+    }
+
+    done += length;
   }
 
-  char* buffer = new char[size];
+  return 0;
+}
+
+} // namespace internal {
+
+
+// Writes out all of the data at the specified offset in the file
+// without changing its current offset.
+inline Try<Nothing> pwrite(int fd, const char* data, size_t size, off_t offset)
+{
+  const int error = internal::pwrite(fd, data, size, offset);
+  if (error != 0) {
+    errno = error;
+    return ErrnoError();
+  }
+
+  return Nothing();
+}
+
+
+// Writes (and fsyncs) files asynchronously so that a single thread can
+// keep a disk busy without blocking on each operation: operations are
+// queued, submitted to the kernel in batches and their completions get
+// collected later. This uses io_uring when the kernel supports it,
+// otherwise (or if 'synchronous' is requested) each operation gets
+// performed when it's queued and completes immediately. For example:
+//
+//   Try<os::AsyncWriter*> writer = os::AsyncWriter::create();
+//   writer.get()->write(fd, data, size, offset, 1);
+//   writer.get()->fsync(fd, 2);
+//   writer.get()->submit();
+//   ...
+//   std::vector<os::AsyncWriter::Completion> completions;
+//   writer.get()->wait(2, &completions);
+//   delete writer.get();
+//
+// The data being written must stay valid until the write completes.
+// An fsync is only started once the operations queued before it have
+// completed, so it covers the preceding writes.
+// NOTE: An AsyncWriter is not thread-safe.
+class AsyncWriter
+{
+public:
+  struct Completion
+  {
+    uint64_t tag; // As passed to write/fsync.
+    int error;    // The errno, or 0 if the operation succeeded.
+  };
+
+  // Returns an AsyncWriter which can have up to 'entries' operations
+  // in flight (queuing more waits for some of them to complete).
+  static Try<AsyncWriter*> create(
+      unsigned entries = 64,
+      bool synchronous = false)
+  {
+    AsyncWriter* writer = new AsyncWriter();
+
+#ifdef OS_IO_URING
+    if (!synchronous) {
+      Try<Nothing> setup = writer->setup(entries);
+      if (setup.isError()) {
+        delete writer;
+        return Error(setup.error());
+      }
+    }
+#else
+    (void) entries;
+    (void) synchronous;
+#endif // OS_IO_URING
+
+    return writer;
+  }
+
+  ~AsyncWriter()
+  {
+#ifdef OS_IO_URING
+    if (ring >= 0) {
+      // Wait for the operations in flight since the kernel would
+      // otherwise still be using (i.e., writing) the callers' data.
+      while (inflight > 0) {
+        if (enter(inflight).isError()) {
+          break;
+        }
+      }
+      ::munmap(sqes, sqesSize);
+      if (cqRing != sqRing) {
+        ::munmap(cqRing, cqRingSize);
+      }
+      ::munmap(sqRing, sqRingSize);
+      ::close(ring);
+    }
+#endif // OS_IO_URING
+  }
+
+  // Returns true if operations are actually performed asynchronously.
+  bool asynchronous() const
+  {
+    return ring >= 0;
+  }
+
+  // Queues a write of 'size' bytes at 'offset' in the file, which
+  // completes with the specified tag once all of the data is written.
+  Try<Nothing> write(
+      int fd,
+      const char* data,
+      size_t size,
+      off_t offset,
+      uint64_t tag)
+  {
+    if (ring < 0) {
+      complete(tag, internal::pwrite(fd, data, size, offset));
+      return Nothing();
+    }
+
+#ifdef OS_IO_URING
+    Try<unsigned> slot = allocate();
+    if (slot.isError()) {
+      return Error(slot.error());
+    }
+
+    Operation& operation = operations[slot.get()];
+    operation.fsync = false;
+    operation.fd = fd;
+    operation.iov.iov_base = const_cast<char*>(data);
+    operation.iov.iov_len = size;
+    operation.offset = offset;
+    operation.tag = tag;
+    operation.retrying = false;
+
+    queue(slot.get());
+#endif // OS_IO_URING
+
+    return Nothing();
+  }
+
+  // Queues an fsync (or fdatasync) of the file.
+  Try<Nothing> fsync(int fd, uint64_t tag, bool datasync = false)
+  {
+    if (ring < 0) {
+#ifdef __linux__
+      int result = datasync ? ::fdatasync(fd) : ::fsync(fd);
+#else
+      int result = ::fsync(fd);
+#endif // __linux__
+      complete(tag, result < 0 ? errno : 0);
+      return Nothing();
+    }
+
+#ifdef OS_IO_URING
+    Try<unsigned> slot = allocate();
+    if (slot.isError()) {
+      return Error(slot.error());
+    }
+
+    Operation& operation = operations[slot.get()];
+    operation.fsync = true;
+    operation.datasync = datasync;
+    operation.fd = fd;
+    operation.tag = tag;
+
+    queue(slot.get());
+#endif // OS_IO_URING
+
+    return Nothing();
+  }
+
+  // Submits the queued operations without waiting for them.
+  Try<Nothing> submit()
+  {
+#ifdef OS_IO_URING
+    if (ring >= 0 && queued > 0) {
+      return enter(0);
+    }
+#endif // OS_IO_URING
+
+    return Nothing();
+  }
+
+  // Submits the queued operations and waits until at least 'count'
+  // of the pending operations (see below) have completed, then
+  // appends the completions of all of the completed operations.
+  Try<Nothing> wait(size_t count, std::vector<Completion>* completions)
+  {
+    CHECK(count <= pending());
+
+#ifdef OS_IO_URING
+    if (ring >= 0) {
+      while (completed.size() < count) {
+        Try<Nothing> result = enter(count - completed.size());
+        if (result.isError()) {
+          return result;
+        }
+      }
+
+      // Collect anything else that has completed in the mean time.
+      reap();
+    }
+#endif // OS_IO_URING
+
+    completions->insert(
+        completions->end(), completed.begin(), completed.end());
+    completed.clear();
+
+    return Nothing();
+  }
+
+  // Returns the number of operations whose completions haven't been
+  // returned by 'wait' yet, i.e., wait(pending(), ...) waits for all
+  // of the queued operations.
+  size_t pending() const
+  {
+    return inflight + completed.size();
+  }
+
+private:
+  AsyncWriter() : ring(-1), inflight(0) {}
+
+  // Not copyable, not assignable.
+  AsyncWriter(const AsyncWriter&);
+  AsyncWriter& operator = (const AsyncWriter&);
+
+  void complete(uint64_t tag, int error)
+  {
+    Completion completion;
+    completion.tag = tag;
+    completion.error = error;
+    completed.push_back(completion);
+  }
+
+#ifdef OS_IO_URING
+  struct Operation
+  {
+    bool fsync;
+    bool datasync;
+    bool retrying; // A write whose rest got requeued.
+    int fd;
+    struct iovec iov;
+    off_t offset;
+    uint64_t tag;
+  };
+
+  Try<Nothing> setup(unsigned entries)
+  {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring = ::syscall(__NR_io_uring_setup, entries, &params);
+    if (ring < 0) {
+      // Not supported by the kernel (or not allowed, e.g., by a
+      // seccomp filter) so fall back to synchronous operations.
+      if (errno == ENOSYS || errno == EPERM) {
+        return Nothing();
+      }
+      return ErrnoError("Failed to set up io_uring");
+    }
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    // Newer kernels map both rings with a single mmap.
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+    }
+
+    sqRing = static_cast<char*>(map(sqRingSize, IORING_OFF_SQ_RING));
+    cqRing = (params.features & IORING_FEAT_SINGLE_MMAP)
+      ? sqRing
+      : static_cast<char*>(map(cqRingSize, IORING_OFF_CQ_RING));
+    sqes = static_cast<struct io_uring_sqe*>(map(sqesSize, IORING_OFF_SQES));
+
+    if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+      ErrnoError error("Failed to mmap io_uring");
+      if (sqes != MAP_FAILED) {
+        ::munmap(sqes, sqesSize);
+      }
+      if (cqRing != MAP_FAILED && cqRing != sqRing) {
+        ::munmap(cqRing, cqRingSize);
+      }
+      if (sqRing != MAP_FAILED) {
+        ::munmap(sqRing, sqRingSize);
+      }
+      ::close(ring);
+      ring = -1;
+      return error;
+    }
+
+    sqHead = reinterpret_cast<unsigned*>(sqRing + params.sq_off.head);
+    sqTail = reinterpret_cast<unsigned*>(sqRing + params.sq_off.tail);
+    sqMask = *reinterpret_cast<unsigned*>(sqRing + params.sq_off.ring_mask);
+    sqArray = reinterpret_cast<unsigned*>(sqRing + params.sq_off.array);
+
+    cqHead = reinterpret_cast<unsigned*>(cqRing + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned*>(cqRing + params.cq_off.tail);
+    cqMask = *reinterpret_cast<unsigned*>(cqRing + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<struct io_uring_cqe*>(
+        cqRing + params.cq_off.cqes);
+
+    // Limiting the operations in flight to the size of the submission
+    // queue means neither queue can overflow (the completion queue is
+    // at least as big).
+    operations.resize(params.sq_entries);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+      slots.push_back(params.sq_entries - 1 - i);
+    }
+
+    queued = 0;
+    retrying = 0;
+
+    return Nothing();
+  }
+
+  void* map(size_t size, off_t offset)
+  {
+    return ::mmap(
+        NULL,
+        size,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        ring,
+        offset);
+  }
+
+  // Returns a free operation slot, waiting for an operation to
+  // complete if they're all in flight.
+  Try<unsigned> allocate()
+  {
+    while (slots.empty()) {
+      Try<Nothing> result = enter(1);
+      if (result.isError()) {
+        return Error(result.error());
+      }
+    }
+
+    unsigned slot = slots.back();
+    slots.pop_back();
+    inflight++;
+    return slot;
+  }
+
+  // Adds a submission queue entry for the operation in the slot.
+  void queue(unsigned slot)
+  {
+    const Operation& operation = operations[slot];
+
+    // NOTE: We're the only producer so we can read our own tail, but
+    // the kernel must see the entry before it sees the new tail.
+    const unsigned tail = *sqTail;
+    const unsigned index = tail & sqMask;
+
+    struct io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = operation.fd;
+    sqe->user_data = slot;
+
+    if (operation.fsync) {
+      sqe->opcode = IORING_OP_FSYNC;
+      sqe->flags = IOSQE_IO_DRAIN;
+      sqe->fsync_flags = operation.datasync ? IORING_FSYNC_DATASYNC : 0;
+    } else {
+      sqe->opcode = IORING_OP_WRITEV;
+      sqe->addr = reinterpret_cast<uintptr_t>(&operation.iov);
+      sqe->len = 1;
+      sqe->off = operation.offset;
+    }
+
+    sqArray[index] = index;
+
+    __sync_synchronize();
+    *const_cast<volatile unsigned*>(sqTail) = tail + 1;
+
+    queued++;
+  }
+
+  // Submits the queued entries, waits for at least 'count' operations
+  // to complete and then collects the completions.
+  Try<Nothing> enter(size_t count)
+  {
+    while (true) {
+      const unsigned flags = count > 0 ? IORING_ENTER_GETEVENTS : 0;
+      long result = ::syscall(
+          __NR_io_uring_enter, ring, queued, count, flags, NULL, _NSIG / 8);
+
+      if (result < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return ErrnoError("Failed to enter io_uring");
+      }
+
+      queued -= result;
+      break;
+    }
+
+    reap();
+
+    return Nothing();
+  }
+
+  // Collects the entries from the completion queue. Partial writes
+  // get requeued to write the rest. Since the rest is queued behind
+  // any fsync that was already queued after the write, such an fsync
+  // that completes while a write is being retried gets requeued too
+  // (an fsync "drains" everything before it and nothing after it
+  // starts until it completes, so it's requeued behind the rest).
+  void reap()
+  {
+    unsigned head = *cqHead;
+    const unsigned tail = *const_cast<volatile unsigned*>(cqTail);
+    __sync_synchronize();
+
+    while (head != tail) {
+      const struct io_uring_cqe& cqe = cqes[head & cqMask];
+      const unsigned slot = cqe.user_data;
+      Operation& operation = operations[slot];
+
+      int error = cqe.res < 0 ? -cqe.res : 0;
+
+      if (operation.fsync) {
+        if (error == 0 && retrying > 0) {
+          queue(slot);
+          head++;
+          continue;
+        }
+      } else if (cqe.res == 0 && operation.iov.iov_len > 0) {
+        error = EIO; // No progress, don't retry forever.
+      } else if (cqe.res > 0 &&
+                 static_cast<size_t>(cqe.res) < operation.iov.iov_len) {
+        operation.iov.iov_base =
+          static_cast<char*>(operation.iov.iov_base) + cqe.res;
+        operation.iov.iov_len -= cqe.res;
+        operation.offset += cqe.res;
+        if (!operation.retrying) {
+          operation.retrying = true;
+          retrying++;
+        }
+        queue(slot);
+        head++;
+        continue;
+      }
+
+      if (!operation.fsync && operation.retrying) {
+        retrying--;
+      }
+
+      complete(operation.tag, error);
+      slots.push_back(slot);
+      inflight--;
+
+      head++;
+    }
+
+    __sync_synchronize();
+    *const_cast<volatile unsigned*>(cqHead) = head;
+  }
+
+  char* sqRing;
+  char* cqRing;
+  size_t sqRingSize;
+  size_t cqRingSize;
+  size_t sqesSize;
+
+  unsigned* sqHead;
+  unsigned* sqTail;
+  unsigned sqMask;
+  unsigned* sqArray;
+  struct io_uring_sqe* sqes;
+
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned cqMask;
+  struct io_uring_cqe* cqes;
+
+  std::vector<Operation> operations;
+  std::vector<unsigned> slots; // Free operation slots.
+  unsigned queued; // Entries not yet submitted.
+  size_t retrying; // Writes whose rest got requeued.
+#endif // OS_IO_URING
+
+  int ring; // The io_uring fd, or -1 if operations are synchronous.
+  size_t inflight;
+  std::vector<Completion> completed;
+};
+
+
+// Reads up to 'size' bytes from a file from its current offset into
+// 'data', retrying interrupted and short reads. Returns the number of
+// bytes read, which is only less than 'size' if EOF was encountered.
+inline Try<size_t> read(int fd, void* data, size_t size)
+{
   size_t offset = 0;
 
   while (offset < size) {
-    ssize_t length = ::read(fd, buffer + offset, size - offset);
+    ssize_t length =
+      ::read(fd, static_cast<char*>(data) + offset, size - offset);
 
     if (length < 0) {
       // TODO(bmahler): Handle a non-blocking fd? (EAGAIN, EWOULDBLOCK)
       if (errno == EINTR) {
         continue;
       }
-      // Attempt to restore the original offset.
-      lseek(fd, current, SEEK_SET);
       return ErrnoError();
     } else if (length == 0) {
-      // Reached EOF before expected! Restore the offset.
-      lseek(fd, current, SEEK_SET);
-      return None();
+      break; // Reached EOF.
     }
 
     offset += length;
   }
 
-  return std::string(buffer, size);
+  return offset;
 }
 
 
-// Returns the contents of the file starting from its current offset.
-// If an error occurs, this will attempt to recover the file offset.
-inline Try<std::string> read(int fd)
+// Like read() above but reads from the specified offset in the file
+// rather than its current offset, which is left unchanged (so it can
+// be used concurrently by multiple threads).
+inline Try<size_t> pread(int fd, void* data, size_t size, off_t offset)
+{
+  size_t done = 0;
+
+  while (done < size) {
+    ssize_t length = ::pread(
+        fd, static_cast<char*>(data) + done, size - done, offset + done);
+
+    if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return ErrnoError();
+    } else if (length == 0) {
+      break; // Reached EOF.
+    }
+
+    done += length;
+  }
+
+  return done;
+}
+
+
+// Reads 'size' bytes from a file from its current offset.
+// If EOF is encountered before reading size bytes, then the offset
+// is restored and none is returned.
+inline Result<std::string> read(int fd, size_t size)
+{
+  // NOTE: We read straight into the string rather than a temporary
+  // buffer, and restore the offset relative to where we got to so
+  // that the common case doesn't need to lseek at all.
+  std::string result(size, '\0');
+
+  Try<size_t> length = read(fd, size > 0 ? &result[0] : NULL, size);
+
+  if (length.isError()) {
+    return Error(length.error());
+  } else if (length.get() < size) {
+    // Reached EOF before expected! Restore the offset.
+    lseek(fd, -static_cast<off_t>(length.get()), SEEK_CUR);
+    return None();
+  }
+
+  return result;
+}
+
+
+// Reads 'size' bytes from the specified offset in a file without
+// changing its current offset. Returns none if EOF is encountered
+// before reading size bytes.
+inline Result<std::string> pread(int fd, size_t size, off_t offset)
+{
+  std::string result(size, '\0');
+
+  Try<size_t> length = pread(fd, size > 0 ? &result[0] : NULL, size, offset);
+
+  if (length.isError()) {
+    return Error(length.error());
+  } else if (length.get() < size) {
+    return None();
+  }
+
+  return result;
+}
+
+
+// Reads the contents of the file starting from its current offset
+// into 'contents', replacing whatever was there (but reusing its
+// memory). The file is sized with fstat so that (regular) files are
+// read without any copying or reallocating, but we always read until
+// EOF since files in /proc, pipes, etc. don't have a size and the file
+// might be growing. If an error occurs, this will attempt to recover
+// the file offset.
+inline Try<Nothing> read(int fd, std::string* contents)
 {
-  // Save the current offset.
-  off_t current = lseek(fd, 0, SEEK_CUR);
-  if (current == -1) {
-    return ErrnoError("Failed to lseek to SEEK_CUR");
+  struct stat s;
+  if (::fstat(fd, &s) < 0) {
+    return ErrnoError("Failed to fstat");
   }
 
-  // Get the size of the file from the offset.
-  off_t size = lseek(fd, current, SEEK_END);
-  if (size == -1) {
-    return ErrnoError("Failed to lseek to SEEK_END");
+  size_t size = 0; // Expected bytes left, if known.
+  if (S_ISREG(s.st_mode) && s.st_size > 0) {
+    off_t current = lseek(fd, 0, SEEK_CUR);
+    if (current != -1 && current < s.st_size) {
+      size = s.st_size - current;
+    }
   }
 
-  // Restore the offset.
-  if (lseek(fd, current, SEEK_SET) == -1) {
-    return ErrnoError("Failed to lseek with SEEK_SET");
+  // Leave room for one more byte so that reading at EOF (rather than
+  // growing the string) is what tells us we're done.
+  contents->resize(std::max(size + 1, static_cast<size_t>(4096)));
+
+  size_t offset = 0;
+
+  while (true) {
+    if (offset == contents->size()) {
+      contents->resize(offset * 2);
+    }
+
+    Try<size_t> length =
+      read(fd, &(*contents)[offset], contents->size() - offset);
+
+    if (length.isError()) {
+      // Attempt to restore the original offset.
+      lseek(fd, -static_cast<off_t>(offset), SEEK_CUR);
+      contents->clear();
+      return Error(length.error());
+    }
+
+    offset += length.get();
+
+    if (offset < contents->size()) {
+      break; // Reached EOF.
+    }
   }
 
-  Result<std::string> result = read(fd, size);
-  if (result.isNone()) {
-    // Hit EOF before reading size bytes.
-    return Error("The file size was modified while reading");
-  } else if (result.isError()) {
+  contents->resize(offset);
+
+  return Nothing();
+}
+
+
+// Returns the contents of the file starting from its current offset.
+// If an error occurs, this will attempt to recover the file offset.
+inline Try<std::string> read(int fd)
+{
+  std::string contents;
+
+  Try<Nothing> result = read(fd, &contents);
+  if (result.isError()) {
     return Error(result.error());
   }
 
-  return result.get();
+  return contents;
+}
+
+
+// A wrapper function that wraps the above read() with opening and
+// closing the file, reusing the memory of 'contents'.
+inline Try<Nothing> read(const std::string& path, std::string* contents)
+{
+  Try<int> fd = os::open(path, O_RDONLY);
+
+  if (fd.isError()) {
+    return Error("Failed to open file '" + path + "'");
+  }
+
+  Try<Nothing> result = read(fd.get(), contents);
+
+  // NOTE: We ignore the return value of close(). This is because users calling
+  // this function are interested in the return value of read(). Also an
+  // unsuccessful close() doesn't affect the read.
+  os::close(fd.get());
+
+  return result;
 }
 
 
@@ -343,22 +1120,169 @@ inline Try<std::string> read(int fd)
 // open and closing the file.
 inline Try<std::string> read(const std::string& path)
 {
-  Try<int> fd =
-    os::open(path, O_RDONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IRWXO);
+  std::string contents;
+
+  Try<Nothing> result = read(path, &contents);
+  if (result.isError()) {
+    return Error(result.error());
+  }
+
+  return contents;
+}
+
+
+// A read-only memory mapping of a file, for processing (large) files
+// in place rather than reading them into the heap: pages are read in
+// lazily as they get accessed and are shared with the page cache (and
+// hence other processes mapping the file). For example:
+//
+//   Try<os::MappedFile*> file = os::MappedFile::create(path);
+//   file.get()->advise(os::MappedFile::SEQUENTIAL);
+//   const char* newline = file.get()->find('\n');
+//   ...
+//   delete file.get();
+//
+// NOTE: The file must not be truncated while it's mapped (accessing
+// the mapped memory beyond the end of the file raises SIGBUS).
+class MappedFile
+{
+public:
+  // Hints for how the mapping is going to be accessed (see madvise).
+  enum Advice
+  {
+    NORMAL,
+    SEQUENTIAL, // Read ahead aggressively, drop pages once read.
+    RANDOM,     // Don't read ahead.
+    WILLNEED,   // Start reading in the pages now.
+    DONTNEED,   // Drop the pages (they're read in again if accessed).
+    HUGEPAGE    // Back the mapping with huge pages (if supported).
+  };
+
+  static Try<MappedFile*> create(const std::string& path)
+  {
+    Try<int> fd = os::open(path, O_RDONLY);
+    if (fd.isError()) {
+      return Error("Failed to open file '" + path + "': " + fd.error());
+    }
+
+    struct stat s;
+    if (::fstat(fd.get(), &s) < 0) {
+      ErrnoError error("Failed to stat file '" + path + "'");
+      os::close(fd.get());
+      return error;
+    }
+
+    const size_t size = s.st_size;
+
+    // Mapping an empty file fails, but then there's nothing to map.
+    void* data = NULL;
+    if (size > 0) {
+      data = ::mmap(NULL, size, PROT_READ, MAP_SHARED, fd.get(), 0);
+      if (data == MAP_FAILED) {
+        ErrnoError error("Failed to mmap file '" + path + "'");
+        os::close(fd.get());
+        return error;
+      }
+    }
+
+    // The mapping stays valid after the file is closed.
+    os::close(fd.get());
+
+    return new MappedFile(static_cast<const char*>(data), size);
+  }
+
+  ~MappedFile()
+  {
+    if (address != NULL) {
+      ::munmap(const_cast<char*>(address), length);
+    }
+  }
+
+  const char* data() const { return address; }
+  size_t size() const { return length; }
+  bool empty() const { return length == 0; }
+
+  const char* begin() const { return address; }
+  const char* end() const { return address + length; }
+
+  char operator [] (size_t index) const
+  {
+    CHECK(index < length);
+    return address[index];
+  }
+
+  // Returns a pointer to the first occurrence of 'c' at or after
+  // 'offset', or NULL if there isn't one.
+  const char* find(char c, size_t offset = 0) const
+  {
+    if (offset >= length) {
+      return NULL;
+    }
+    return static_cast<const char*>(
+        ::memchr(address + offset, c, length - offset));
+  }
+
+  // Returns a copy of (at most) 'size' bytes starting at 'offset'.
+  std::string substr(
+      size_t offset = 0,
+      size_t size = std::string::npos) const
+  {
+    CHECK(offset <= length);
+    return std::string(address + offset, std::min(size, length - offset));
+  }
+
+  // Advises the kernel how (part of) the mapping will be accessed.
+  // The range gets extended to the pages it touches.
+  Try<Nothing> advise(
+      Advice advice,
+      size_t offset = 0,
+      size_t size = std::string::npos)
+  {
+    if (offset >= length) {
+      return Nothing(); // Nothing mapped.
+    }
+
+    int flag;
+    switch (advice) {
+      case NORMAL:     flag = MADV_NORMAL;     break;
+      case SEQUENTIAL: flag = MADV_SEQUENTIAL; break;
+      case RANDOM:     flag = MADV_RANDOM;     break;
+      case WILLNEED:   flag = MADV_WILLNEED;   break;
+      case DONTNEED:   flag = MADV_DONTNEED;   break;
+      case HUGEPAGE:
+#ifdef MADV_HUGEPAGE
+        flag = MADV_HUGEPAGE;
+        break;
+#else
+        return Error("Huge pages are not supported");
+#endif // MADV_HUGEPAGE
+      default:
+        return Error("Unknown advice");
+    }
+
+    // madvise wants a page aligned address.
+    static const size_t pagesize = ::getpagesize();
+    const size_t start = offset - offset % pagesize;
+    const size_t stop = offset + std::min(size, length - offset);
+
+    if (::madvise(const_cast<char*>(address) + start, stop - start, flag) < 0) {
+      return ErrnoError("Failed to madvise");
+    }
 
-  if (fd.isError()) {
-    return Error("Failed to open file '" + path + "'");
+    return Nothing();
   }
 
-  Try<std::string> result = read(fd.get());
+private:
+  MappedFile(const char* _address, size_t _length)
+    : address(_address), length(_length) {}
 
-  // NOTE: We ignore the return value of close(). This is because users calling
-  // this function are interested in the return value of read(). Also an
-  // unsuccessful close() doesn't affect the read.
-  os::close(fd.get());
+  // Not copyable, not assignable.
+  MappedFile(const MappedFile&);
+  MappedFile& operator = (const MappedFile&);
 
-  return result;
-}
+  const char* address;
+  const size_t length;
+};
 
 
 inline Try<Nothing> rm(const std::string& path)
@@ -411,6 +1335,233 @@ inline Try<std::string> realpath(const std::string& path)
 }
 
 
+namespace internal {
+
+// Syncs a directory, i.e., makes the (creation, renaming or removal
+// of the) entries in it durable.
+inline Try<Nothing> fsyncdir(const std::string& directory)
+{
+  Try<int> fd = os::open(directory, O_RDONLY | O_DIRECTORY);
+  if (fd.isError()) {
+    return Error(
+        "Failed to open directory '" + directory + "': " + fd.error());
+  }
+
+  Try<Nothing> result = Nothing();
+  if (::fsync(fd.get()) < 0) {
+    result = ErrnoError("Failed to fsync directory '" + directory + "'");
+  }
+
+  os::close(fd.get());
+
+  return result;
+}
+
+} // namespace internal {
+
+
+// Replaces files atomically and durably: readers see either the old
+// or the new contents of a file (never a partially written file) and
+// after 'commit' the new contents survive a crash. Each file is
+// written to a temporary file in the same directory, synced and then
+// renamed over the original. Writing several files with the same
+// AtomicWriter means each directory only gets synced once (rather
+// than once per file) and the files get flushed to disk concurrently:
+//
+//   os::AtomicWriter writer;
+//   writer.write(directory + "/config", config);
+//   writer.write(directory + "/state", state);
+//   writer.commit();
+//
+// NOTE: Only each file is replaced atomically, not the batch; if
+// 'commit' fails some of the files might have been replaced.
+// Temporary files of uncommitted writes get removed on destruction.
+class AtomicWriter
+{
+public:
+  AtomicWriter() {}
+
+  ~AtomicWriter()
+  {
+    abort();
+  }
+
+  // Writes the contents for the file at 'path' to a temporary file.
+  // The file is replaced by 'commit'.
+  Try<Nothing> write(const std::string& path, const std::string& message)
+  {
+    static unsigned int counter = 0;
+
+    Staged staged;
+    staged.path = path;
+
+    // NOTE: We don't use mkstemp since it ignores the umask (new files
+    // get 0644 less the umask) and the pid plus a counter is unique
+    // enough for O_EXCL to only rarely fail.
+    int fd = -1;
+    while (fd < 0) {
+      staged.temp = path + ".tmp." + stringify(::getpid()) + "." +
+        stringify(__sync_fetch_and_add(&counter, 1));
+
+      fd = ::open(
+          staged.temp.c_str(),
+          O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+          S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+      if (fd < 0 && errno != EEXIST) {
+        return ErrnoError("Failed to create temporary file for '" + path + "'");
+      }
+    }
+
+    staged.fd = fd;
+
+    // A replaced file keeps its permissions and (if we're allowed to
+    // change it) its ownership.
+    struct stat s;
+    if (::stat(path.c_str(), &s) == 0) {
+      if (::fchmod(fd, s.st_mode & 07777) < 0) {
+        ErrnoError error("Failed to set the mode of '" + staged.temp + "'");
+        ::close(fd);
+        ::unlink(staged.temp.c_str());
+        return error;
+      }
+      if (::fchown(fd, s.st_uid, s.st_gid) < 0 && errno != EPERM) {
+        ErrnoError error("Failed to set the owner of '" + staged.temp + "'");
+        ::close(fd);
+        ::unlink(staged.temp.c_str());
+        return error;
+      }
+    }
+
+    Try<Nothing> result = os::write(fd, message);
+    if (result.isError()) {
+      ::close(fd);
+      ::unlink(staged.temp.c_str());
+      return Error("Failed to write '" + staged.temp + "': " + result.error());
+    }
+
+#ifdef __linux__
+    // Start writing the data out now so that it gets flushed while
+    // we're preparing the other files ('commit' waits for it).
+    ::sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif // __linux__
+
+    files.push_back(staged);
+
+    return Nothing();
+  }
+
+  // Syncs the written files, renames them over the originals and then
+  // syncs each of their directories.
+  Try<Nothing> commit()
+  {
+    // Flush all of the data before renaming anything, otherwise after
+    // a crash a renamed file could be empty (or partially written).
+    foreach (Staged& staged, files) {
+#ifdef __linux__
+      int result = ::fdatasync(staged.fd);
+#else
+      int result = ::fsync(staged.fd);
+#endif // __linux__
+      if (result < 0) {
+        ErrnoError error("Failed to sync '" + staged.temp + "'");
+        abort();
+        return error;
+      }
+    }
+
+    // The directories of the files renamed so far, which get synced
+    // even if a later rename fails.
+    std::set<std::string> directories;
+
+    while (!files.empty()) {
+      Staged& staged = files.front();
+
+      Try<std::string> directory = os::dirname(staged.path);
+      if (directory.isError()) {
+        abort();
+        fsyncdirs(directories);
+        return Error("Failed to get directory of '" + staged.path + "': " +
+                     directory.error());
+      }
+
+      ::close(staged.fd);
+      staged.fd = -1;
+
+      if (::rename(staged.temp.c_str(), staged.path.c_str()) < 0) {
+        ErrnoError error(
+            "Failed to rename '" + staged.temp + "' to '" + staged.path + "'");
+        abort();
+        fsyncdirs(directories);
+        return error;
+      }
+
+      directories.insert(directory.get());
+
+      files.pop_front();
+    }
+
+    return fsyncdirs(directories);
+  }
+
+  // Discards the (uncommitted) written files.
+  void abort()
+  {
+    foreach (const Staged& staged, files) {
+      if (staged.fd >= 0) {
+        ::close(staged.fd);
+      }
+      ::unlink(staged.temp.c_str());
+    }
+    files.clear();
+  }
+
+private:
+  // Not copyable, not assignable.
+  AtomicWriter(const AtomicWriter&);
+  AtomicWriter& operator = (const AtomicWriter&);
+
+  struct Staged
+  {
+    std::string path;
+    std::string temp;
+    int fd;
+  };
+
+  // Syncs each of the directories, returning the first error.
+  static Try<Nothing> fsyncdirs(const std::set<std::string>& directories)
+  {
+    Try<Nothing> result = Nothing();
+    foreach (const std::string& directory, directories) {
+      Try<Nothing> synced = internal::fsyncdir(directory);
+      if (synced.isError() && result.isSome()) {
+        result = synced;
+      }
+    }
+    return result;
+  }
+
+  std::list<Staged> files;
+};
+
+
+// Replaces the file at 'path' atomically and durably, see
+// AtomicWriter above.
+inline Try<Nothing> writeAtomic(
+    const std::string& path,
+    const std::string& message)
+{
+  AtomicWriter writer;
+
+  Try<Nothing> result = writer.write(path, message);
+  if (result.isError()) {
+    return result;
+  }
+
+  return writer.commit();
+}
+
+
 inline bool isdir(const std::string& path)
 {
   struct stat s;
@@ -671,98 +1822,748 @@ inline std::string getcwd()
 }
 
 
-// TODO(bmahler): Wrap with a Try.
-inline std::list<std::string> ls(const std::string& directory)
+namespace internal {
+
+#ifdef __linux__
+// The entries returned by getdents64 (which glibc doesn't declare).
+struct Dirent64
+{
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[1];
+};
+#endif // __linux__
+
+
+inline bool dots(const char* name)
+{
+  return name[0] == '.' &&
+    (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+} // namespace internal {
+
+
+// Reads the entries of a directory (other than "." and "..") without
+// any allocations per entry: entries get read in chunks into a buffer
+// (with getdents64 on Linux) and are returned straight out of it. For
+// example:
+//
+//   Try<os::DirectoryReader*> reader = os::DirectoryReader::create(path);
+//   os::DirectoryReader::Entry entry;
+//   while (reader.get()->next(&entry)) {
+//     ... entry.name ...
+//   }
+//   if (reader.get()->error().isSome()) {
+//     ...
+//   }
+//   delete reader.get();
+class DirectoryReader
+{
+public:
+  // An entry, which (including its name) is only valid until the
+  // next call to 'next'.
+  struct Entry
+  {
+    const char* name;
+    unsigned char type; // DT_REG, DT_DIR, etc. or DT_UNKNOWN.
+    ino_t inode;
+  };
+
+  static Try<DirectoryReader*> create(
+      const std::string& path,
+      size_t size = 32 * 1024)
+  {
+    int fd = ::open(
+        path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+      return ErrnoError("Failed to open directory '" + path + "'");
+    }
+
+#ifdef __linux__
+    return new DirectoryReader(fd, size);
+#else
+    DIR* dir = ::fdopendir(fd);
+    if (dir == NULL) {
+      ErrnoError error("Failed to open directory '" + path + "'");
+      ::close(fd);
+      return error;
+    }
+    return new DirectoryReader(dir);
+#endif // __linux__
+  }
+
+  ~DirectoryReader()
+  {
+#ifdef __linux__
+    delete[] buffer;
+    ::close(fd);
+#else
+    ::closedir(dir);
+#endif // __linux__
+  }
+
+  // Reads the next entry, returning false at the end of the directory
+  // or if an error occurred (see 'error' below).
+  bool next(Entry* entry)
+  {
+#ifdef __linux__
+    while (true) {
+      while (offset < length) {
+        const internal::Dirent64* dirent =
+          reinterpret_cast<const internal::Dirent64*>(buffer + offset);
+        offset += dirent->d_reclen;
+
+        if (!internal::dots(dirent->d_name)) {
+          entry->name = dirent->d_name;
+          entry->type = dirent->d_type;
+          entry->inode = dirent->d_ino;
+          return true;
+        }
+      }
+
+      if (done) {
+        return false;
+      }
+
+      long result = ::syscall(SYS_getdents64, fd, buffer, size);
+      if (result < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        message = ErrnoError("Failed to read directory").message;
+        result = 0;
+      }
+
+      offset = 0;
+      length = result;
+      done = length == 0;
+    }
+#else
+    while (true) {
+      errno = 0;
+      struct dirent* dirent = ::readdir(dir);
+      if (dirent == NULL) {
+        if (errno != 0) {
+          message = ErrnoError("Failed to read directory").message;
+        }
+        return false;
+      }
+
+      if (!internal::dots(dirent->d_name)) {
+        entry->name = dirent->d_name;
+        entry->type = dirent->d_type;
+        entry->inode = dirent->d_ino;
+        return true;
+      }
+    }
+#endif // __linux__
+  }
+
+  // Returns the error that stopped 'next', if any.
+  const Option<std::string>& error() const
+  {
+    return message;
+  }
+
+private:
+#ifdef __linux__
+  DirectoryReader(int _fd, size_t _size)
+    : fd(_fd),
+      buffer(new char[_size]),
+      size(_size),
+      offset(0),
+      length(0),
+      done(false) {}
+#else
+  explicit DirectoryReader(DIR* _dir) : dir(_dir) {}
+#endif // __linux__
+
+  // Not copyable, not assignable.
+  DirectoryReader(const DirectoryReader&);
+  DirectoryReader& operator = (const DirectoryReader&);
+
+#ifdef __linux__
+  const int fd;
+  char* buffer;
+  const size_t size;
+  size_t offset; // Of the next entry in the buffer.
+  size_t length; // Of the entries in the buffer.
+  bool done;
+#else
+  DIR* dir;
+#endif // __linux__
+
+  Option<std::string> message;
+};
+
+
+// Returns the names of the entries of the directory (other than "."
+// and "..").
+inline Try<std::list<std::string> > ls(const std::string& directory)
 {
+  Try<DirectoryReader*> reader = DirectoryReader::create(directory);
+  if (reader.isError()) {
+    return Error(reader.error());
+  }
+
   std::list<std::string> result;
 
-  DIR* dir = opendir(directory.c_str());
+  DirectoryReader::Entry entry;
+  while (reader.get()->next(&entry)) {
+    result.push_back(entry.name);
+  }
+
+  const Option<std::string> error = reader.get()->error();
+  delete reader.get();
+
+  if (error.isSome()) {
+    return Error(error.get());
+  }
+
+  return result;
+}
+
+
+// Number of bytes used to read directory entries (per thread).
+#define DIRECTORY_BUFFER_SIZE (64 * 1024)
+
+
+// Called by walk (see below) for each entry under the directory being
+// walked with the path of the entry (i.e., the directory joined with
+// the names leading to the entry) and its type (DT_REG, DT_DIR,
+// DT_LNK, etc., see readdir). If it returns false for a directory
+// then walk doesn't descend into the directory.
+typedef std::tr1::function<bool(const std::string&, unsigned char)> Visitor;
+
+
+namespace internal {
+
+// Walks a tree of directories: each directory is opened relative to
+// its (already open) parent, so paths don't get resolved again and
+// again, and read in big chunks (with getdents64 on Linux) using the
+// type in each entry rather than stat'ing it. Directories that are
+// found become work items which get processed depth first by the
+// thread that found them, while idle threads steal the items nearest
+// the root (i.e., the biggest subtrees) from the other threads.
+class Walker
+{
+public:
+  Walker(const Visitor& _visitor, size_t threads)
+    : visitor(_visitor), outstanding(0), waiting(0), failed(false)
+  {
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&available, NULL);
+    for (size_t i = 0; i < std::max(threads, static_cast<size_t>(1)); i++) {
+      queues.push_back(new Queue());
+    }
+  }
 
-  if (dir == NULL) {
-    return std::list<std::string>();
+  ~Walker()
+  {
+    // Release what's left after a failure.
+    foreach (Queue* queue, queues) {
+      foreach (const Work& work, queue->work) {
+        release(work.parent);
+      }
+      delete queue;
+    }
+    pthread_cond_destroy(&available);
+    pthread_mutex_destroy(&mutex);
   }
 
-  // Calculate the size for a "directory entry".
-  long name_max = fpathconf(dirfd(dir), _PC_NAME_MAX);
+  Try<Nothing> walk(const std::string& directory)
+  {
+    // The directory itself may be a symbolic link (unlike anything
+    // under it, see 'process').
+    int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+      return ErrnoError("Failed to open directory '" + directory + "'");
+    }
+
+    // Don't end up with "//" in paths (including for "/" itself, since
+    // paths get joined with a '/').
+    std::string path = directory;
+    while (!path.empty() && path[path.size() - 1] == '/') {
+      path.resize(path.size() - 1);
+    }
+
+    // Read the root in this thread, which queues its subdirectories
+    // for the first thread.
+    Handle* root = new Handle();
+    root->fd = fd;
+    root->references = 1;
+
+    std::vector<char> buffer(DIRECTORY_BUFFER_SIZE);
+    Try<Nothing> result = read(root, path, &buffer, queues[0]);
+    release(root);
+
+    if (result.isError()) {
+      return result;
+    }
+
+    if (queues.size() == 1) {
+      run(0);
+    } else {
+      // If we can't create as many threads as requested we make do
+      // with fewer (only a thread itself adds to its queue so the
+      // queues of the threads that don't exist stay empty).
+      std::vector<pthread_t> threads(queues.size() - 1);
+      std::vector<std::pair<Walker*, size_t> > arguments(threads.size());
+      size_t created = 0;
+      for (; created < threads.size(); created++) {
+        arguments[created] = std::make_pair(this, created + 1);
+        if (pthread_create(
+                &threads[created], NULL, _run, &arguments[created]) != 0) {
+          break;
+        }
+      }
+
+      run(0);
+
+      for (size_t i = 0; i < created; i++) {
+        pthread_join(threads[i], NULL);
+      }
+    }
+
+    if (failed) {
+      return Error(error);
+    }
+
+    return Nothing();
+  }
+
+private:
+  // Not copyable, not assignable.
+  Walker(const Walker&);
+  Walker& operator = (const Walker&);
+
+  // An open directory, shared by the work items for its children.
+  struct Handle
+  {
+    int fd;
+    int references;
+  };
+
+  // A directory to be walked.
+  struct Work
+  {
+    Handle* parent;
+    std::string path;
+    size_t name; // Offset of the name (relative to 'parent') in 'path'.
+  };
+
+  struct Queue
+  {
+    Queue() { pthread_mutex_init(&mutex, NULL); }
+    ~Queue() { pthread_mutex_destroy(&mutex); }
+
+    pthread_mutex_t mutex;
+    std::deque<Work> work;
+  };
+
+  static void* _run(void* arg)
+  {
+    std::pair<Walker*, size_t>* argument =
+      static_cast<std::pair<Walker*, size_t>*>(arg);
+    argument->first->run(argument->second);
+    return NULL;
+  }
+
+  static void release(Handle* handle)
+  {
+    if (__sync_sub_and_fetch(&handle->references, 1) == 0) {
+      if (handle->fd != AT_FDCWD) {
+        ::close(handle->fd);
+      }
+      delete handle;
+    }
+  }
 
-  // If we don't get a valid size, check NAME_MAX, but fall back on
-  // 255 in the worst case ... Danger, Will Robinson!
-  if (name_max == -1) {
-    name_max = (NAME_MAX > 255) ? NAME_MAX : 255;
+  void run(size_t index)
+  {
+    std::vector<char> buffer(DIRECTORY_BUFFER_SIZE);
+
+    while (!failed) {
+      Work work;
+      if (pop(index, &work) || steal(index, &work)) {
+        process(index, work, &buffer);
+        if (__sync_sub_and_fetch(&outstanding, 1) == 0) {
+          // All done, wake up the idle threads so they can exit.
+          pthread_mutex_lock(&mutex);
+          pthread_cond_broadcast(&available);
+          pthread_mutex_unlock(&mutex);
+        }
+      } else if (!idle()) {
+        break;
+      }
+    }
   }
 
-  size_t name_end =
-    (size_t) offsetof(dirent, d_name) + name_max + 1;
+  // Waits until some thread has queued work (returning true) or all
+  // of the work is done or the walk failed (returning false).
+  bool idle()
+  {
+    pthread_mutex_lock(&mutex);
+
+    // NOTE: Threads that queue work only signal 'available' when they
+    // see a waiting thread, so we need to count ourselves as waiting
+    // before looking at the queues.
+    __sync_fetch_and_add(&waiting, 1);
+
+    bool more = false;
+    while (!failed && __sync_fetch_and_add(&outstanding, 0) > 0) {
+      if (queued()) {
+        more = true;
+        break;
+      }
+      pthread_cond_wait(&available, &mutex);
+    }
+
+    __sync_fetch_and_sub(&waiting, 1);
 
-  size_t size = (name_end > sizeof(dirent)
-    ? name_end
-    : sizeof(dirent));
+    pthread_mutex_unlock(&mutex);
+
+    return more;
+  }
 
-  dirent* temp = (dirent*) malloc(size);
+  // Returns true if any of the queues has work.
+  bool queued()
+  {
+    foreach (Queue* queue, queues) {
+      pthread_mutex_lock(&queue->mutex);
+      bool empty = queue->work.empty();
+      pthread_mutex_unlock(&queue->mutex);
+      if (!empty) {
+        return true;
+      }
+    }
+    return false;
+  }
 
-  if (temp == NULL) {
-    free(temp);
-    closedir(dir);
-    return std::list<std::string>();
+  bool pop(size_t index, Work* work)
+  {
+    Queue* queue = queues[index];
+    pthread_mutex_lock(&queue->mutex);
+    bool popped = !queue->work.empty();
+    if (popped) {
+      *work = queue->work.back();
+      queue->work.pop_back();
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return popped;
+  }
+
+  bool steal(size_t index, Work* work)
+  {
+    for (size_t i = 1; i < queues.size(); i++) {
+      Queue* queue = queues[(index + i) % queues.size()];
+      pthread_mutex_lock(&queue->mutex);
+      bool stolen = !queue->work.empty();
+      if (stolen) {
+        *work = queue->work.front();
+        queue->work.pop_front();
+      }
+      pthread_mutex_unlock(&queue->mutex);
+      if (stolen) {
+        return true;
+      }
+    }
+    return false;
   }
 
-  struct dirent* entry;
+  void fail(const std::string& message)
+  {
+    pthread_mutex_lock(&mutex);
+    if (!failed) {
+      error = message;
+      failed = true;
+    }
+    pthread_cond_broadcast(&available);
+    pthread_mutex_unlock(&mutex);
+  }
+
+  void process(size_t index, const Work& work, std::vector<char>* buffer)
+  {
+    int fd = ::openat(
+        work.parent->fd,
+        work.path.c_str() + work.name,
+        O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+    release(work.parent);
+
+    if (fd < 0) {
+      // The directory might have been removed (or replaced) since we
+      // found it, or we might not be allowed to read it, in which
+      // case we skip it.
+      if (errno != ENOENT && errno != ENOTDIR &&
+          errno != EACCES && errno != ELOOP) {
+        fail(ErrnoError("Failed to open directory '" + work.path + "'")
+               .message);
+      }
+      return;
+    }
 
-  int error;
+    Handle* handle = new Handle();
+    handle->fd = fd;
+    handle->references = 1;
 
-  while ((error = readdir_r(dir, temp, &entry)) == 0 && entry != NULL) {
-    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-      continue;
+    Try<Nothing> result = read(handle, work.path, buffer, queues[index]);
+    if (result.isError()) {
+      fail(result.error());
     }
-    result.push_back(entry->d_name);
+
+    release(handle);
   }
 
-  free(temp);
-  closedir(dir);
+  // Reads the entries of the directory, calling the visitor for each
+  // and queuing any subdirectories.
+  Try<Nothing> read(
+      Handle* handle,
+      const std::string& path,
+      std::vector<char>* buffer,
+      Queue* queue)
+  {
+    const int fd = handle->fd;
 
-  if (error != 0) {
-    return std::list<std::string>();
+#ifdef __linux__
+    while (true) {
+      long size = ::syscall(SYS_getdents64, fd, &(*buffer)[0], buffer->size());
+      if (size < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return ErrnoError("Failed to read directory '" + path + "'");
+      } else if (size == 0) {
+        return Nothing();
+      }
+
+      for (long offset = 0; offset < size;) {
+        const Dirent64* entry =
+          reinterpret_cast<const Dirent64*>(&(*buffer)[offset]);
+        offset += entry->d_reclen;
+        visit(fd, path, entry->d_name, entry->d_type, handle, queue);
+      }
+    }
+#else
+    // The DIR takes ownership of the fd, which we still need.
+    int copy = ::dup(fd);
+    if (copy < 0) {
+      return ErrnoError("Failed to dup");
+    }
+
+    DIR* dir = ::fdopendir(copy);
+    if (dir == NULL) {
+      ::close(copy);
+      return ErrnoError("Failed to open directory '" + path + "'");
+    }
+
+    struct dirent* entry;
+    while ((entry = ::readdir(dir)) != NULL) {
+      visit(fd, path, entry->d_name, entry->d_type, handle, queue);
+    }
+
+    ::closedir(dir);
+    return Nothing();
+#endif // __linux__
+  }
+
+  void visit(
+      int fd,
+      const std::string& directory,
+      const char* name,
+      unsigned char type,
+      Handle* handle,
+      Queue* queue)
+  {
+    if (dots(name)) {
+      return;
+    }
+
+    // Not every filesystem fills in the type.
+    if (type == DT_UNKNOWN) {
+      struct stat s;
+      if (::fstatat(fd, name, &s, AT_SYMLINK_NOFOLLOW) < 0) {
+        return; // Removed in the mean time.
+      }
+      type = S_ISDIR(s.st_mode) ? DT_DIR
+        : S_ISREG(s.st_mode) ? DT_REG
+        : S_ISLNK(s.st_mode) ? DT_LNK
+        : S_ISFIFO(s.st_mode) ? DT_FIFO
+        : S_ISSOCK(s.st_mode) ? DT_SOCK
+        : S_ISCHR(s.st_mode) ? DT_CHR
+        : S_ISBLK(s.st_mode) ? DT_BLK
+        : DT_UNKNOWN;
+    }
+
+    std::string path;
+    path.reserve(directory.size() + 1 + strlen(name));
+    path.append(directory);
+    path.append(1, '/');
+    path.append(name);
+
+    if (!visitor(path, type) || type != DT_DIR) {
+      return;
+    }
+
+    Work work;
+    work.parent = handle;
+    work.name = directory.size() + 1;
+    work.path.swap(path);
+
+    __sync_fetch_and_add(&handle->references, 1);
+    __sync_fetch_and_add(&outstanding, 1);
+
+    pthread_mutex_lock(&queue->mutex);
+    queue->work.push_back(work);
+    pthread_mutex_unlock(&queue->mutex);
+
+    // Let an idle thread know there's something to steal (reading
+    // 'waiting' atomically orders it after the push, see 'idle').
+    if (__sync_fetch_and_add(&waiting, 0) > 0) {
+      pthread_mutex_lock(&mutex);
+      pthread_cond_signal(&available);
+      pthread_mutex_unlock(&mutex);
+    }
   }
 
-  return result;
+  const Visitor visitor;
+  std::vector<Queue*> queues;
+
+  // Number of directories queued or being processed.
+  volatile size_t outstanding;
+
+  // Number of threads waiting for work.
+  volatile size_t waiting;
+
+  pthread_mutex_t mutex; // Protects 'error', used with 'available'.
+  pthread_cond_t available; // Signaled when work gets queued.
+  volatile bool failed;
+  std::string error;
+};
+
+} // namespace internal {
+
+
+// Walks the tree of directories under 'directory' (which may be a
+// symbolic link, but links under it aren't followed), calling the
+// visitor for each entry. Using more than one thread walks different
+// subtrees in parallel, in which case the visitor gets called
+// concurrently (from the calling thread as well). Subdirectories that
+// disappear or can't be read are skipped.
+inline Try<Nothing> walk(
+    const std::string& directory,
+    const Visitor& visitor,
+    size_t threads = 1)
+{
+  internal::Walker walker(visitor, threads);
+  return walker.walk(directory);
 }
 
 
+// How 'find' matches file names with its pattern.
+enum Match
+{
+  SUBSTRING, // The name contains the pattern.
+  WILDCARD,  // The name matches the shell wildcard pattern (fnmatch).
+  REGEX      // The name matches the extended regular expression.
+};
+
+
+namespace internal {
+
+struct Finder
+{
+  bool operator () (const std::string& path, unsigned char type)
+  {
+    if (type == DT_DIR) {
+      return true;
+    }
+
+    const char* name = path.c_str() + path.rfind('/') + 1;
+
+    bool matched = false;
+    switch (match) {
+      case SUBSTRING:
+        matched = strstr(name, pattern.c_str()) != NULL;
+        break;
+      case WILDCARD:
+        matched = ::fnmatch(pattern.c_str(), name, 0) == 0;
+        break;
+      case REGEX:
+        matched = ::regexec(regex, name, 0, NULL, 0) == 0;
+        break;
+    }
+
+    if (matched) {
+      pthread_mutex_lock(mutex);
+      results->push_back(path);
+      pthread_mutex_unlock(mutex);
+    }
+
+    return true;
+  }
+
+  Match match;
+  std::string pattern;
+  const regex_t* regex;
+  pthread_mutex_t* mutex;
+  std::list<std::string>* results;
+};
+
+} // namespace internal {
+
+
 // Return the list of file paths that match the given pattern by recursively
-// searching the given directory. A match is successful if the pattern is a
-// substring of the file name.
-// NOTE: Directory path should not end with '/'.
+// searching the given directory. By default a match is successful if the
+// pattern is a substring of the file name, see Match above. Directories are
+// searched but not matched.
 // NOTE: Symbolic links are not followed.
-// TODO(vinod): Support regular expressions for pattern.
-// TODO(vinod): Consider using ftw or a non-recursive approach.
 inline Try<std::list<std::string> > find(
     const std::string& directory,
-    const std::string& pattern)
+    const std::string& pattern,
+    Match match = SUBSTRING,
+    size_t threads = 1)
 {
-  std::list<std::string> results;
-
   if (!isdir(directory)) {
     return Error("'" + directory + "' is not a directory");
   }
 
-  foreach (const std::string& entry, ls(directory)) {
-    std::string path = path::join(directory, entry);
-    // If it's a directory, recurse.
-    if (isdir(path) && !islink(path)) {
-      Try<std::list<std::string> > matches = find(path, pattern);
-      if (matches.isError()) {
-        return matches;
-      }
-      foreach (const std::string& match, matches.get()) {
-        results.push_back(match);
-      }
-    } else {
-      if (entry.find(pattern) != std::string::npos) {
-        results.push_back(path); // Matched the file pattern!
-      }
+  regex_t regex;
+  if (match == REGEX) {
+    int error = ::regcomp(&regex, pattern.c_str(), REG_EXTENDED | REG_NOSUB);
+    if (error != 0) {
+      char message[256];
+      ::regerror(error, &regex, message, sizeof(message));
+      return Error("Invalid regular expression '" + pattern + "': " + message);
     }
   }
 
+  pthread_mutex_t mutex;
+  pthread_mutex_init(&mutex, NULL);
+
+  std::list<std::string> results;
+
+  internal::Finder finder;
+  finder.match = match;
+  finder.pattern = pattern;
+  finder.regex = &regex;
+  finder.mutex = &mutex;
+  finder.results = &results;
+
+  Try<Nothing> result = walk(directory, finder, threads);
+
+  pthread_mutex_destroy(&mutex);
+  if (match == REGEX) {
+    ::regfree(&regex);
+  }
+
+  if (result.isError()) {
+    return Error(result.error());
+  }
+
   return results;
 }
 
@@ -25,12 +25,19 @@
 #endif
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdio.h>
+#include <string.h>
 
 #include <sys/types.h> // For pid_t.
 
+#include <algorithm>
 #include <fstream>
+#include <limits>
 #include <list>
+#include <map>
 #include <queue>
 #include <set>
 #include <string>
@@ -42,6 +49,7 @@
 #include "numify.hpp"
 #include "option.hpp"
 #include "os.hpp"
+#include "result.hpp"
 #include "strings.hpp"
 #include "try.hpp"
 
@@ -162,79 +170,121 @@ struct ProcessStatus
 };
 
 
-// Returns the process statistics from /proc/[pid]/stat.
-inline Try<ProcessStatus> status(pid_t pid)
+namespace internal {
+
+// Parses the next (space separated) integer field, advancing 'p'.
+template <typename T>
+inline bool field(const char** p, const char* end, T* value)
 {
-  std::string path = "/proc/" + stringify(pid) + "/stat";
+  const char* c = *p;
+  while (c < end && *c == ' ') {
+    c++;
+  }
 
-  std::ifstream file(path.c_str());
+  const bool negative = c < end && *c == '-';
+  if (negative) {
+    c++;
+  }
 
-  if (!file.is_open()) {
-    return Error("Failed to open '" + path + "'");
+  const char* digits = c;
+  unsigned long long result = 0;
+  for (; c < end && *c >= '0' && *c <= '9'; c++) {
+    result = result * 10 + (*c - '0');
+  }
+
+  if (c == digits) {
+    return false;
+  }
+
+  *value = negative
+    ? static_cast<T>(-static_cast<long long>(result))
+    : static_cast<T>(result);
+  *p = c;
+  return true;
+}
+
+
+// Parses the contents of /proc/[pid]/stat by hand (this is the bulk of
+// the work when looking at every process in the system). The command
+// name is in parentheses and may contain spaces and parentheses itself
+// so it extends to the last ')'.
+inline Option<ProcessStatus> parse(const char* data, size_t size)
+{
+  const char* end = data + size;
+  const char* p = data;
+
+  pid_t pid;
+  if (!field(&p, end, &pid)) {
+    return None();
   }
 
-  std::string comm;
-  char state;
-  pid_t ppid;
-  pid_t pgrp;
-  pid_t session;
+  const char* open = static_cast<const char*>(memchr(p, '(', end - p));
+  const char* close = end;
+  while (close > p && *(close - 1) != ')') {
+    close--;
+  }
+  if (open == NULL || close <= open + 1) {
+    return None();
+  }
+
+  // NOTE: The name keeps its parentheses, as it always has.
+  const std::string comm(open, close - open);
+  p = close;
+
+  if (end - p < 2 || p[0] != ' ') {
+    return None();
+  }
+  const char state = p[1];
+  p += 2;
+
+  pid_t ppid, pgrp, session, tpgid;
   int tty_nr;
-  pid_t tpgid;
   unsigned int flags;
-  unsigned long minflt;
-  unsigned long cminflt;
-  unsigned long majflt;
-  unsigned long cmajflt;
-  unsigned long utime;
-  unsigned long stime;
-  long cutime;
-  long cstime;
-  long priority;
-  long nice;
-  long num_threads;
-  long itrealvalue;
+  unsigned long minflt, cminflt, majflt, cmajflt, utime, stime;
+  long cutime, cstime, priority, nice, num_threads, itrealvalue;
   unsigned long long starttime;
   unsigned long vsize;
   long rss;
-  unsigned long rsslim;
-  unsigned long startcode;
-  unsigned long endcode;
-  unsigned long startstack;
-  unsigned long kstkeip;
-  unsigned long signal;
-  unsigned long blocked;
-  unsigned long sigcatch;
-  unsigned long wchan;
-  unsigned long nswap;
-  unsigned long cnswap;
-
-  // NOTE: The following are unused for now.
-  // int exit_signal;
-  // int processor;
-  // unsigned int rt_priority;
-  // unsigned int policy;
-  // unsigned long long delayacct_blkio_ticks;
-  // unsigned long guest_time;
-  // unsigned int cguest_time;
-
-  std::string _; // For ignoring fields.
-
-  // Parse all fields from stat.
-  file >> _ >> comm >> state >> ppid >> pgrp >> session >> tty_nr
-       >> tpgid >> flags >> minflt >> cminflt >> majflt >> cmajflt
-       >> utime >> stime >> cutime >> cstime >> priority >> nice
-       >> num_threads >> itrealvalue >> starttime >> vsize >> rss
-       >> rsslim >> startcode >> endcode >> startstack >> kstkeip
-       >> signal >> blocked >> sigcatch >> wchan >> nswap >> cnswap;
-
-  // Check for any read/parse errors.
-  if (file.fail() && !file.eof()) {
-    file.close();
-    return Error("Failed to read/parse '" + path + "'");
+  unsigned long rsslim, startcode, endcode, startstack, kstkesp, kstkeip;
+  unsigned long signal, blocked, sigignore, sigcatch, wchan, nswap, cnswap;
+
+  if (!(field(&p, end, &ppid) &&
+        field(&p, end, &pgrp) &&
+        field(&p, end, &session) &&
+        field(&p, end, &tty_nr) &&
+        field(&p, end, &tpgid) &&
+        field(&p, end, &flags) &&
+        field(&p, end, &minflt) &&
+        field(&p, end, &cminflt) &&
+        field(&p, end, &majflt) &&
+        field(&p, end, &cmajflt) &&
+        field(&p, end, &utime) &&
+        field(&p, end, &stime) &&
+        field(&p, end, &cutime) &&
+        field(&p, end, &cstime) &&
+        field(&p, end, &priority) &&
+        field(&p, end, &nice) &&
+        field(&p, end, &num_threads) &&
+        field(&p, end, &itrealvalue) &&
+        field(&p, end, &starttime) &&
+        field(&p, end, &vsize) &&
+        field(&p, end, &rss) &&
+        field(&p, end, &rsslim) &&
+        field(&p, end, &startcode) &&
+        field(&p, end, &endcode) &&
+        field(&p, end, &startstack) &&
+        field(&p, end, &kstkesp) &&
+        field(&p, end, &kstkeip) &&
+        field(&p, end, &signal) &&
+        field(&p, end, &blocked) &&
+        field(&p, end, &sigignore) &&
+        field(&p, end, &sigcatch) &&
+        field(&p, end, &wchan) &&
+        field(&p, end, &nswap) &&
+        field(&p, end, &cnswap))) {
+    return None();
   }
 
-  file.close();
-
   return ProcessStatus(pid, comm, state, ppid, pgrp, session, tty_nr,
                        tpgid, flags, minflt, cminflt, majflt, cmajflt,
                        utime, stime, cutime, cstime, priority, nice,
@@ -244,18 +294,117 @@ inline Try<ProcessStatus> status(pid_t pid)
 }
 
 
+// Reads and parses the stat file at 'path' (relative to the directory
+// 'fd') with a single read into a buffer on the stack. Returns none if
+// the file doesn't exist (i.e., the process has gone away).
+inline Result<ProcessStatus> status(int fd, const char* path)
+{
+  int file = ::openat(fd, path, O_RDONLY | O_CLOEXEC);
+  if (file < 0) {
+    if (errno == ENOENT || errno == ESRCH) {
+      return None();
+    }
+    return ErrnoError("Failed to open '" + std::string(path) + "'");
+  }
+
+  char buffer[4096];
+  size_t length = 0;
+  while (length < sizeof(buffer)) {
+    ssize_t size = ::read(file, buffer + length, sizeof(buffer) - length);
+    if (size < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      // Save the errno before anything (i.e., close) can change it.
+      const int error = errno;
+      ::close(file);
+
+      if (error == ESRCH) {
+        return None();
+      }
+      errno = error;
+      return ErrnoError("Failed to read '" + std::string(path) + "'");
+    } else if (size == 0) {
+      break;
+    }
+    length += size;
+  }
+
+  ::close(file);
+
+  Option<ProcessStatus> status = parse(buffer, length);
+  if (status.isNone()) {
+    return Error("Failed to parse '" + std::string(path) + "'");
+  }
+
+  return status.get();
+}
+
+
+// Returns true if the name is a pid (i.e., all digits).
+inline bool pid(const char* name, pid_t* pid)
+{
+  pid_t result = 0;
+  const char* c = name;
+  for (; *c >= '0' && *c <= '9'; c++) {
+    result = result * 10 + (*c - '0');
+  }
+
+  if (*c != '\0' || c == name) {
+    return false;
+  }
+
+  *pid = result;
+  return true;
+}
+
+} // namespace internal {
+
+
+// Returns the process statistics from /proc/[pid]/stat.
+inline Try<ProcessStatus> status(pid_t pid)
+{
+  const std::string path = "/proc/" + stringify(pid) + "/stat";
+
+  Result<ProcessStatus> status = internal::status(AT_FDCWD, path.c_str());
+  if (status.isNone()) {
+    return Error("Failed to open '" + path + "'");
+  } else if (status.isError()) {
+    return Error(status.error());
+  }
+
+  return status.get();
+}
+
+
 // Reads from /proc and returns a list of all running processes.
 inline Try<std::set<pid_t> > pids()
 {
+  Try<os::DirectoryReader*> reader = os::DirectoryReader::create("/proc");
+  if (reader.isError()) {
+    return Error("Failed to determine pids from /proc: " + reader.error());
+  }
+
   std::set<pid_t> pids;
 
-  foreach (const std::string& file, os::ls("/proc")) {
-    Try<pid_t> pid = numify<pid_t>(file);
-    if (pid.isSome()) {
-      pids.insert(pid.get()); // Ignore files that can't be numified.
+  os::DirectoryReader::Entry entry;
+  while (reader.get()->next(&entry)) {
+    // Ignore files that aren't pids, parsing the rest by hand since
+    // that's a big part of the cost here.
+    pid_t pid;
+    if (internal::pid(entry.name, &pid)) {
+      pids.insert(pids.end(), pid); // Entries are (mostly) sorted.
     }
   }
 
+  const Option<std::string> error = reader.get()->error();
+  delete reader.get();
+
+  if (error.isSome()) {
+    return Error("Failed to determine pids from /proc: " + error.get());
+  }
+
   if (!pids.empty()) {
     return pids;
   }
@@ -264,43 +413,222 @@ inline Try<std::set<pid_t> > pids()
 }
 
 
-// Returns all child processes of the pid, including all descendants
-// if recursive.
-inline Try<std::set<pid_t> > children(pid_t pid, bool recursive = true)
+// A snapshot of the process table, i.e., the status of every process
+// in the system, indexed by pid and by parent. Taking one reads every
+// /proc/[pid]/stat (relative to an open /proc, with a single read and
+// a hand written parser) and can be spread over a number of threads.
+// Processes whose status can't be read (e.g., because /proc is mounted
+// with 'hidepid') are left out, see 'skipped'. For example:
+//
+//   Try<proc::Snapshot*> snapshot = proc::Snapshot::create();
+//   std::set<pid_t> descendants = snapshot.get()->children(pid);
+//   delete snapshot.get();
+class Snapshot
 {
-  const Try<std::set<pid_t> >& pids = proc::pids();
-  if (pids.isError()) {
-    return Error(pids.error());
-  }
+public:
+  static Try<Snapshot*> create(size_t threads = 1)
+  {
+    // Collect the pids first so they can be split between threads.
+    Try<os::DirectoryReader*> reader = os::DirectoryReader::create("/proc");
+    if (reader.isError()) {
+      return Error("Failed to read /proc: " + reader.error());
+    }
+
+    std::vector<pid_t> pids;
+    os::DirectoryReader::Entry entry;
+    while (reader.get()->next(&entry)) {
+      pid_t pid;
+      if (internal::pid(entry.name, &pid)) {
+        pids.push_back(pid);
+      }
+    }
+
+    const Option<std::string> error = reader.get()->error();
+    delete reader.get();
+
+    if (error.isSome()) {
+      return Error("Failed to read /proc: " + error.get());
+    }
+
+    int fd = ::open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+      return ErrnoError("Failed to open /proc");
+    }
+
+    threads = std::min(threads, pids.size());
+    threads = std::max(threads, static_cast<size_t>(1));
+
+    std::vector<Reader> readers(threads);
+    for (size_t i = 0; i < threads; i++) {
+      readers[i].fd = fd;
+      readers[i].pids = &pids;
+      readers[i].begin = pids.size() * i / threads;
+      readers[i].end = pids.size() * (i + 1) / threads;
+    }
+
+    // Any pids that we can't create a thread for get read by this
+    // thread instead.
+    std::vector<pthread_t> pthreads(threads - 1);
+    size_t created = 0;
+    for (; created < pthreads.size(); created++) {
+      if (pthread_create(
+              &pthreads[created], NULL, read, &readers[created + 1]) != 0) {
+        break;
+      }
+    }
+
+    read(&readers[0]);
+
+    for (size_t i = created + 1; i < threads; i++) {
+      read(&readers[i]);
+    }
+
+    for (size_t i = 0; i < created; i++) {
+      pthread_join(pthreads[i], NULL);
+    }
+
+    ::close(fd);
+
+    Snapshot* snapshot = new Snapshot();
 
-  // Stat all the processes.
-  std::list<ProcessStatus> processes;
-  foreach (pid_t _pid, pids.get()) {
-    const Try<ProcessStatus>& process = status(_pid);
-    if (process.isSome()) {
-      processes.push_back(process.get());
+    foreach (const Reader& reader, readers) {
+      snapshot->failures += reader.failures;
+
+      foreach (const ProcessStatus& process, reader.processes) {
+        snapshot->processes.insert(std::make_pair(process.pid, process));
+        snapshot->parents.push_back(std::make_pair(process.ppid, process.pid));
+      }
     }
+
+    std::sort(snapshot->parents.begin(), snapshot->parents.end());
+
+    return snapshot;
   }
 
-  // Perform a breadth first search for descendants.
-  std::set<pid_t> descendants;
-  std::queue<pid_t> parents;
-  parents.push(pid);
+  // Returns the pids of all of the processes.
+  std::set<pid_t> pids() const
+  {
+    std::set<pid_t> pids;
+    foreachkey (pid_t pid, processes) {
+      pids.insert(pids.end(), pid);
+    }
+    return pids;
+  }
 
-  do {
-    pid_t parent = parents.front();
-    parents.pop();
+  // Returns the status of the process, if it was running.
+  Option<ProcessStatus> status(pid_t pid) const
+  {
+    std::map<pid_t, ProcessStatus>::const_iterator iterator =
+      processes.find(pid);
+    if (iterator == processes.end()) {
+      return None();
+    }
+    return iterator->second;
+  }
 
-    // Search for children of parent.
-    foreach (const ProcessStatus& process, processes) {
-      if (process.ppid == parent) {
+  // Returns the child processes of the pid, including all descendants
+  // if recursive.
+  std::set<pid_t> children(pid_t pid, bool recursive = true) const
+  {
+    std::set<pid_t> descendants;
+    std::queue<pid_t> queue;
+    queue.push(pid);
+
+    do {
+      pid_t parent = queue.front();
+      queue.pop();
+
+      // The children of the parent are adjacent in the index.
+      std::vector<std::pair<pid_t, pid_t> >::const_iterator iterator =
+        std::lower_bound(
+            parents.begin(),
+            parents.end(),
+            std::make_pair(parent, std::numeric_limits<pid_t>::min()));
+
+      for (; iterator != parents.end() && iterator->first == parent;
+           ++iterator) {
         // Have we seen this child yet?
-        if (descendants.insert(process.pid).second) {
-          parents.push(process.pid);
+        if (descendants.insert(iterator->second).second) {
+          queue.push(iterator->second);
         }
       }
+    } while (recursive && !queue.empty());
+
+    return descendants;
+  }
+
+  size_t size() const
+  {
+    return processes.size();
+  }
+
+  // Returns the number of processes left out of the snapshot because
+  // their status couldn't be read or parsed.
+  size_t skipped() const
+  {
+    return failures;
+  }
+
+private:
+  Snapshot() : failures(0) {}
+
+  // Not copyable, not assignable.
+  Snapshot(const Snapshot&);
+  Snapshot& operator = (const Snapshot&);
+
+  // Reads the status of a range of pids.
+  struct Reader
+  {
+    int fd;
+    const std::vector<pid_t>* pids;
+    size_t begin;
+    size_t end;
+    std::list<ProcessStatus> processes;
+    size_t failures;
+  };
+
+  static void* read(void* arg)
+  {
+    Reader* reader = static_cast<Reader*>(arg);
+    reader->failures = 0;
+
+    for (size_t i = reader->begin; i < reader->end; i++) {
+      char path[32];
+      snprintf(path, sizeof(path), "%d/stat", (*reader->pids)[i]);
+
+      Result<ProcessStatus> status = internal::status(reader->fd, path);
+      if (status.isSome()) {
+        reader->processes.push_back(status.get());
+      } else if (status.isError()) {
+        // Like a process that has gone away, one we can't read (e.g.,
+        // EACCES with 'hidepid') shouldn't fail the whole snapshot.
+        reader->failures++;
+      }
     }
-  } while (recursive && !parents.empty());
+
+    return NULL;
+  }
+
+  std::map<pid_t, ProcessStatus> processes;
+
+  // Pairs of (ppid, pid), sorted.
+  std::vector<std::pair<pid_t, pid_t> > parents;
+
+  size_t failures;
+};
+
+
+// Returns all child processes of the pid, including all descendants
+// if recursive.
+inline Try<std::set<pid_t> > children(pid_t pid, bool recursive = true)
+{
+  Try<Snapshot*> snapshot = Snapshot::create();
+  if (snapshot.isError()) {
+    return Error(snapshot.error());
+  }
+
+  std::set<pid_t> descendants = snapshot.get()->children(pid, recursive);
+  delete snapshot.get();
 
   return descendants;
 }
@@ -2,23 +2,39 @@
 #define __STOUT_PROTOBUF_HPP__
 
 #include <errno.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <glog/logging.h>
 
+#include <google/protobuf/descriptor.h>
 #include <google/protobuf/message.h>
 
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 
+#include <algorithm>
+#include <limits>
+#include <map>
 #include <string>
+#include <vector>
 
 #include <boost/lexical_cast.hpp>
 
+#include <tr1/unordered_map>
+
+#include "crc32c.hpp"
 #include "error.hpp"
+#include "foreach.hpp"
+#include "duration.hpp"
+#include "json.hpp"
 #include "none.hpp"
+#include "option.hpp"
 #include "os.hpp"
 #include "result.hpp"
 #include "try.hpp"
@@ -88,21 +104,19 @@ inline Result<T> read(int fd)
   }
 
   uint32_t size;
-  Result<std::string> result = os::read(fd, sizeof(size));
+  Try<size_t> length = os::read(fd, &size, sizeof(size));
 
-  if (result.isNone()) {
+  if (length.isError()) {
+    return Error("Failed to read size: " + length.error());
+  } else if (length.get() < sizeof(size)) {
+    lseek(fd, offset, SEEK_SET);
     return None(); // No more protobufs to read.
-  } else if (result.isError()) {
-    return Error("Failed to read size: " + result.error());
   }
 
-  // Parse the size from the bytes.
-  memcpy((void*) &size, (void*) result.get().data(), sizeof(size));
-
   // NOTE: Instead of specifically checking for corruption in 'size', we simply
   // try to read 'size' bytes. If we hit EOF early, it is an indication of
   // corruption.
-  result = os::read(fd, size);
+  Result<std::string> result = os::read(fd, size);
 
   if (result.isNone()) {
     // Hit EOF unexpectedly. Restore the offset to before the size read.
@@ -117,9 +131,11 @@ inline Result<T> read(int fd)
   }
 
   // Parse the protobuf from the string.
+  // NOTE: Result::get returns a copy, so keep it around while the
+  // stream refers to it.
+  const std::string data = result.get();
   T message;
-  google::protobuf::io::ArrayInputStream stream(
-      result.get().data(), result.get().size());
+  google::protobuf::io::ArrayInputStream stream(data.data(), data.size());
 
   if (!message.ParseFromZeroCopyStream(&stream)) {
     // Restore the offset to before the size read.
@@ -154,6 +170,1485 @@ inline Result<T> read(const std::string& path)
 }
 
 
+// Default size of the buffer used by a Reader (it grows as necessary
+// to hold the largest message).
+#define PROTOBUF_READER_BUFFER_SIZE (256 * 1024)
+
+
+namespace internal {
+
+// A buffer over a file for reading it in large blocks (see Reader and
+// LogReader below). Keeps track of the offset in the file of the data
+// that has been consumed so far so the file can be restored to that
+// offset if something goes wrong.
+class Input
+{
+public:
+  Input(int _fd, size_t size)
+    : fd(_fd), buffer(size), begin(0), end(0), eof(false)
+  {
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (offset != -1) {
+      position = offset;
+    }
+  }
+
+  // Returns the unconsumed data that is buffered.
+  const char* data() const
+  {
+    return &buffer[begin];
+  }
+
+  size_t size() const
+  {
+    return end - begin;
+  }
+
+  void consume(size_t size)
+  {
+    begin += size;
+  }
+
+  // Returns the offset in the file of the unconsumed data, or None if
+  // the file isn't seekable.
+  Option<off_t> offset() const
+  {
+    if (position.isNone()) {
+      return None();
+    }
+    return position.get() + static_cast<off_t>(begin);
+  }
+
+  // Reads until at least 'size' bytes are buffered, growing the
+  // buffer if necessary. Returns None if EOF was reached first.
+  Result<Nothing> fill(size_t size)
+  {
+    if (end - begin >= size) {
+      return Nothing();
+    }
+
+    // Move what's left to the front of the buffer to make room.
+    if (begin > 0) {
+      memmove(&buffer[0], &buffer[begin], end - begin);
+      end -= begin;
+      if (position.isSome()) {
+        position = position.get() + static_cast<off_t>(begin);
+      }
+      begin = 0;
+    }
+
+    if (buffer.size() < size) {
+      buffer.resize(size);
+    }
+
+    while (end < size && !eof) {
+      ssize_t length = ::read(fd, &buffer[end], buffer.size() - end);
+      if (length < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return ErrnoError();
+      } else if (length == 0) {
+        eof = true;
+      }
+      end += length;
+    }
+
+    if (end < size) {
+      return None();
+    }
+
+    return Nothing();
+  }
+
+  // Returns whether it's impossible to buffer 'size' more bytes since
+  // the file (if it's a regular file) isn't big enough. Used to avoid
+  // growing the buffer for a corrupted size.
+  bool exceeds(size_t size) const
+  {
+    if (size <= end - begin || position.isNone()) {
+      return false;
+    }
+
+    struct stat s;
+    return fstat(fd, &s) == 0 &&
+      S_ISREG(s.st_mode) &&
+      offset().get() + static_cast<off_t>(size) > s.st_size;
+  }
+
+  // Seeks the file back to the start of the unconsumed data and
+  // discards everything buffered. If the file isn't seekable the
+  // buffer is kept instead so that nothing gets lost. Either way a
+  // subsequent fill tries again (e.g., in case the file has grown).
+  void restore()
+  {
+    if (position.isSome()) {
+      off_t offset = position.get() + static_cast<off_t>(begin);
+      if (lseek(fd, offset, SEEK_SET) != -1) {
+        position = offset;
+        begin = 0;
+        end = 0;
+      }
+    }
+    eof = false;
+  }
+
+private:
+  const int fd;
+
+  std::vector<char> buffer;
+  size_t begin; // Start of the unconsumed data in the buffer.
+  size_t end; // End of the data in the buffer.
+  bool eof;
+
+  // The offset in the file of the start of the buffer.
+  Option<off_t> position;
+};
+
+} // namespace internal {
+
+
+// Reads a sequence of protobufs of type T from the file (as written
+// by 'write' above) through a buffer. Rather than a few syscalls (and
+// a couple of allocations) per message, as with 'read' above, data
+// is read in large blocks and each message is parsed in place. For
+// example:
+//
+//   protobuf::Reader<T> reader(fd);
+//   while (true) {
+//     Result<T> message = reader.read();
+//     if (message.isNone()) {
+//       break; // No more messages.
+//     } else if (message.isError()) {
+//       ...
+//     }
+//     ...
+//   }
+//
+// Since it reads ahead, the file offset is generally beyond the last
+// message returned. When 'read' returns None or an error however the
+// offset is restored to the start of the message that couldn't be
+// read (as with 'read' above), e.g., so that a partially written
+// message at the end of a log can be truncated.
+// NOTE: The offset can only be restored if the file is seekable.
+template <typename T>
+class Reader
+{
+public:
+  explicit Reader(int fd, size_t size = PROTOBUF_READER_BUFFER_SIZE)
+    : input(fd, size) {}
+
+  Result<T> read()
+  {
+    uint32_t size;
+
+    Result<Nothing> filled = input.fill(sizeof(size));
+    if (filled.isNone()) {
+      input.restore();
+      return None(); // No more protobufs to read.
+    } else if (filled.isError()) {
+      input.restore();
+      return Error("Failed to read size: " + filled.error());
+    }
+
+    memcpy(&size, input.data(), sizeof(size));
+
+    // NOTE: As with 'read' above we don't check for corruption in
+    // 'size' but simply try to read 'size' bytes (although we don't
+    // grow the buffer if it's obvious we'll hit EOF).
+    const size_t length = sizeof(size) + size;
+
+    if (input.exceeds(length)) {
+      filled = None();
+    } else {
+      filled = input.fill(length);
+    }
+
+    if (filled.isNone()) {
+      input.restore();
+      return Error(
+          "Failed to read message of size " + stringify(size) + " bytes: "
+          "hit EOF unexpectedly, possible corruption");
+    } else if (filled.isError()) {
+      input.restore();
+      return Error("Failed to read message: " + filled.error());
+    }
+
+    // Parse the protobuf directly out of the buffer.
+    T message;
+    google::protobuf::io::ArrayInputStream stream(
+        input.data() + sizeof(size), size);
+
+    if (!message.ParseFromZeroCopyStream(&stream)) {
+      input.restore();
+      return Error("Failed to deserialize message");
+    }
+
+    input.consume(length);
+
+    return message;
+  }
+
+  // Returns the offset in the file of the next message to be read, or
+  // None if the file isn't seekable.
+  Option<off_t> offset() const
+  {
+    return input.offset();
+  }
+
+private:
+  // Not copyable, not assignable.
+  Reader(const Reader&);
+  Reader& operator = (const Reader&);
+
+  internal::Input input;
+};
+
+
+// Provides random access to the messages of type T in a file (as
+// written by 'write' above) by mapping the file into memory. The
+// offset of each message gets indexed up front (in a single pass
+// over the sizes) and messages are then parsed directly out of the
+// mapped memory, without any copies. For example:
+//
+//   Try<protobuf::Records<T>*> records = protobuf::Records<T>::create(path);
+//   for (size_t i = 0; i < records.get()->size(); i++) {
+//     Try<T> message = records.get()->get(i);
+//     ...
+//   }
+//   delete records.get();
+//
+// Since 'get' doesn't change any state it can be called concurrently
+// from multiple threads, e.g., to replay a log in parallel.
+//
+// If the file ends with a partially written (or corrupted) message
+// then only the messages before it are indexed, see 'end' below.
+// NOTE: The file must not be truncated while it's mapped (accessing
+// the mapped memory beyond the end of the file raises SIGBUS).
+template <typename T>
+class Records
+{
+public:
+  static Try<Records<T>*> create(const std::string& path)
+  {
+    Try<os::MappedFile*> file = os::MappedFile::create(path);
+    if (file.isError()) {
+      return Error(file.error());
+    }
+
+    return new Records<T>(file.get());
+  }
+
+  ~Records()
+  {
+    delete file;
+  }
+
+  // Returns the number of (complete) messages.
+  size_t size() const
+  {
+    return offsets.size();
+  }
+
+  // Returns the offset just past the last complete message. This is
+  // the size of the file unless the file ends with a partially
+  // written (or corrupted) message.
+  size_t end() const
+  {
+    return valid;
+  }
+
+  // Parses the message at the index (which must be less than 'size').
+  Try<Nothing> get(size_t index, T* message) const
+  {
+    CHECK(index < offsets.size());
+
+    uint32_t size;
+    memcpy(&size, data + offsets[index], sizeof(size));
+
+    google::protobuf::io::ArrayInputStream stream(
+        data + offsets[index] + sizeof(size), size);
+
+    if (!message->ParseFromZeroCopyStream(&stream)) {
+      return Error(
+          "Failed to deserialize message " + stringify(index) +
+          " at offset " + stringify(offsets[index]));
+    }
+
+    return Nothing();
+  }
+
+  Try<T> get(size_t index) const
+  {
+    T message;
+    Try<Nothing> result = get(index, &message);
+    if (result.isError()) {
+      return Error(result.error());
+    }
+    return message;
+  }
+
+private:
+  explicit Records(os::MappedFile* _file)
+    : file(_file), data(_file->data()), length(_file->size()), valid(0)
+  {
+    // Index the messages, stopping at the first one that is cut off
+    // by the end of the file.
+    size_t offset = 0;
+    while (length - offset >= sizeof(uint32_t)) {
+      uint32_t size;
+      memcpy(&size, data + offset, sizeof(size));
+      if (length - offset - sizeof(size) < size) {
+        break;
+      }
+      offsets.push_back(offset);
+      offset += sizeof(size) + size;
+    }
+    valid = offset;
+  }
+
+  // Not copyable, not assignable.
+  Records(const Records&);
+  Records& operator = (const Records&);
+
+  os::MappedFile* file;
+  const char* data;
+  const size_t length;
+  size_t valid;
+  std::vector<size_t> offsets;
+};
+
+
+// Number of bytes a LogWriter buffers before writing them out (even
+// if nobody has asked for them to be flushed or synced).
+#define PROTOBUF_LOG_BUFFER_SIZE (256 * 1024)
+
+
+// Each record of a log (see LogWriter below) is framed as:
+//
+//   magic    1 byte, PROTOBUF_LOG_MAGIC
+//   version  1 byte, PROTOBUF_LOG_VERSION
+//   size     1 to 5 bytes, the size of the message as a varint
+//   crc      4 bytes, the (masked) CRC-32C of the message
+//   check    4 bytes, the (masked) CRC-32C of the above fields
+//   message  'size' bytes
+//
+// The header has its own checksum so that a corrupted size can't be
+// mistaken for a record torn by the end of the file (or make us try
+// to read a huge message). The magic lets a reader find the next
+// record after a corrupted region (see LogReader::skip). Checksums
+// are "masked" (as in LevelDB) since computing the CRC of data which
+// includes CRCs (e.g., a log stored in a log) weakens the CRC.
+// Integers are stored little-endian.
+#define PROTOBUF_LOG_MAGIC '\xC7'
+#define PROTOBUF_LOG_VERSION '\x01'
+
+// The smallest and largest possible headers.
+#define PROTOBUF_LOG_HEADER_MIN (2 + 1 + 4 + 4)
+#define PROTOBUF_LOG_HEADER_MAX (2 + 5 + 4 + 4)
+
+
+namespace internal {
+
+struct Header
+{
+  uint32_t size; // Of the message.
+  uint32_t crc; // Of the message, masked.
+  size_t length; // Of the header.
+};
+
+
+inline uint32_t mask(uint32_t crc)
+{
+  return ((crc >> 15) | (crc << 17)) + 0xA282EAD8;
+}
+
+
+inline void store(char* data, uint32_t value)
+{
+  for (int i = 0; i < 4; i++) {
+    data[i] = static_cast<char>(value >> (8 * i));
+  }
+}
+
+
+inline uint32_t load(const char* data)
+{
+  uint32_t value = 0;
+  for (int i = 0; i < 4; i++) {
+    value |= static_cast<uint32_t>(static_cast<unsigned char>(data[i])) <<
+      (8 * i);
+  }
+  return value;
+}
+
+
+// Returns the length of the header for a message of the given size.
+inline size_t length(uint32_t size)
+{
+  size_t length = PROTOBUF_LOG_HEADER_MIN;
+  while (size >= 0x80) {
+    size >>= 7;
+    length++;
+  }
+  return length;
+}
+
+
+// Writes the header for the message (of 'size' bytes at 'data') to
+// 'header', which must have room for 'length(size)' bytes.
+inline void encode(char* header, uint32_t size, const char* data)
+{
+  size_t offset = 0;
+  header[offset++] = PROTOBUF_LOG_MAGIC;
+  header[offset++] = PROTOBUF_LOG_VERSION;
+
+  uint32_t value = size;
+  while (value >= 0x80) {
+    header[offset++] = static_cast<char>((value & 0x7F) | 0x80);
+    value >>= 7;
+  }
+  header[offset++] = static_cast<char>(value);
+
+  store(header + offset, mask(crc32c::value(data, size)));
+  offset += 4;
+
+  store(header + offset, mask(crc32c::value(header, offset)));
+}
+
+
+// Decodes the header at the start of the 'available' bytes of 'data'.
+// Returns None if more bytes are needed and an error if the bytes are
+// not a valid header.
+inline Result<Header> decode(const char* data, size_t available)
+{
+  if (available < 2) {
+    return None();
+  } else if (data[0] != PROTOBUF_LOG_MAGIC) {
+    return Error("Invalid magic");
+  } else if (data[1] != PROTOBUF_LOG_VERSION) {
+    return Error("Unsupported version " +
+                 stringify(static_cast<int>(data[1])));
+  }
+
+  Header header;
+  header.size = 0;
+
+  size_t offset = 2;
+  for (int shift = 0; ; shift += 7) {
+    if (offset >= available) {
+      return None();
+    } else if (shift > 28) {
+      return Error("Invalid size");
+    }
+    unsigned char c = data[offset++];
+    if (shift == 28 && c > 0x0F) {
+      return Error("Invalid size");
+    }
+    header.size |= static_cast<uint32_t>(c & 0x7F) << shift;
+    if ((c & 0x80) == 0) {
+      break;
+    }
+  }
+
+  if (available < offset + 8) {
+    return None();
+  }
+
+  header.crc = load(data + offset);
+  header.length = offset + 8;
+
+  if (load(data + offset + 4) != mask(crc32c::value(data, offset + 4))) {
+    return Error("Header checksum mismatch");
+  }
+
+  return header;
+}
+
+} // namespace internal {
+
+
+// Appends protobufs to a log file (see LogReader below for reading
+// them back). Unlike 'write' above, messages are serialized into a
+// (reused) buffer and written out in batches, and each one gets a
+// checksum so that a torn (partially written) or corrupted record
+// can be detected.
+//
+// Appending a message with 'sync' returns only once the message (and
+// every message appended before it) is durable. Syncs are "group
+// committed": while one thread is writing and syncing, messages
+// appended by other threads accumulate and the next sync covers all
+// of them, so the number of fsyncs is (at most) one per batch rather
+// than one per message. Optionally, a thread that is about to sync
+// first waits for a 'window' to let more messages join the batch.
+//
+// A LogWriter is thread-safe. Once a write or sync fails every
+// subsequent call returns the error since it's unknown which records
+// made it to the file.
+class LogWriter
+{
+public:
+  // Appends to the file descriptor (which the writer doesn't close).
+  explicit LogWriter(int _fd, const Duration& _window = Duration())
+    : fd(_fd), window(_window), appended(0), written(0), synced(0),
+      busy(false)
+  {
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&committed, NULL);
+  }
+
+  // NOTE: Anything not yet flushed is written out (but not synced).
+  ~LogWriter()
+  {
+    flush();
+    pthread_cond_destroy(&committed);
+    pthread_mutex_destroy(&mutex);
+  }
+
+  Try<Nothing> append(
+      const google::protobuf::Message& message,
+      bool sync = false)
+  {
+    if (!message.IsInitialized()) {
+      return Error("Uninitialized protocol buffer");
+    }
+
+    // The record header stores the size in 32 bits.
+    const size_t bytes = message.ByteSizeLong();
+    if (bytes > std::numeric_limits<uint32_t>::max()) {
+      return Error(
+          "Message of size " + stringify(bytes) + " bytes is too large");
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    if (error.isSome()) {
+      pthread_mutex_unlock(&mutex);
+      return Error(error.get());
+    }
+
+    // Serialize the message directly into the buffer (after the
+    // header which needs its checksum).
+    const uint32_t size = static_cast<uint32_t>(bytes);
+    const size_t length = internal::length(size);
+
+    const size_t offset = pending.size();
+    pending.resize(offset + length + size);
+
+    char* data = &pending[offset + length];
+    message.SerializeWithCachedSizesToArray(
+        reinterpret_cast<google::protobuf::uint8*>(data));
+
+    internal::encode(&pending[offset], size, data);
+
+    const uint64_t sequence = ++appended;
+
+    Try<Nothing> result = Nothing();
+    if (sync) {
+      result = commit(sequence, true);
+    } else if (pending.size() >= PROTOBUF_LOG_BUFFER_SIZE) {
+      result = commit(sequence, false);
+    }
+
+    pthread_mutex_unlock(&mutex);
+    return result;
+  }
+
+  // Writes out everything appended so far (without syncing).
+  Try<Nothing> flush()
+  {
+    pthread_mutex_lock(&mutex);
+    Try<Nothing> result = commit(appended, false);
+    pthread_mutex_unlock(&mutex);
+    return result;
+  }
+
+  // Writes out and syncs everything appended so far.
+  Try<Nothing> sync()
+  {
+    pthread_mutex_lock(&mutex);
+    Try<Nothing> result = commit(appended, true);
+    pthread_mutex_unlock(&mutex);
+    return result;
+  }
+
+private:
+  // Not copyable, not assignable.
+  LogWriter(const LogWriter&);
+  LogWriter& operator = (const LogWriter&);
+
+  // Returns once the first 'sequence' messages have been written (and
+  // synced if 'durable'), either by this thread or another one. Must
+  // hold the mutex (which gets released while writing or waiting).
+  Try<Nothing> commit(uint64_t sequence, bool durable)
+  {
+    while (true) {
+      if (error.isSome()) {
+        return Error(error.get());
+      } else if ((durable ? synced : written) >= sequence) {
+        return Nothing();
+      } else if (busy) {
+        // Someone else is writing, they (or whoever goes next) will
+        // pick up our messages.
+        pthread_cond_wait(&committed, &mutex);
+        continue;
+      }
+
+      busy = true;
+
+      if (durable && window > Duration()) {
+        pthread_mutex_unlock(&mutex);
+        os::sleep(window);
+        pthread_mutex_lock(&mutex);
+      }
+
+      // Take the current batch, other threads can keep appending to
+      // the (now empty) pending buffer while we write.
+      std::swap(pending, writing);
+      const uint64_t batch = appended;
+
+      pthread_mutex_unlock(&mutex);
+
+      Try<Nothing> result = os::write(fd, writing);
+
+      if (result.isSome() && durable) {
+#ifdef __linux__
+        if (fdatasync(fd) != 0) {
+#else
+        if (fsync(fd) != 0) {
+#endif
+          result = ErrnoError("Failed to sync");
+        }
+      }
+
+      pthread_mutex_lock(&mutex);
+
+      writing.clear(); // Keeps the capacity for the next batch.
+
+      if (result.isError()) {
+        error = result.error();
+      } else {
+        written = batch;
+        if (durable) {
+          synced = batch;
+        }
+      }
+
+      busy = false;
+      pthread_cond_broadcast(&committed);
+    }
+  }
+
+  const int fd;
+  const Duration window;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t committed;
+
+  std::string pending; // Appended but not yet being written.
+  std::string writing; // Being written (by whoever is busy).
+
+  // Number of messages appended, written and synced so far.
+  uint64_t appended;
+  uint64_t written;
+  uint64_t synced;
+
+  bool busy; // Whether a thread is writing (and syncing).
+  Option<std::string> error;
+};
+
+
+// Reads back the protobufs of type T written by a LogWriter (see
+// Reader above for how the file is buffered and the file offset is
+// handled). Every checksum is verified. A record that is cut short by
+// the end of the file is treated like the end of the log (i.e.,
+// 'read' returns None) since that's what a crash in the middle of an
+// append leaves behind, while a corrupted record is an error. After
+// an error, 'skip' can be used to carry on from the next valid record:
+//
+//   protobuf::LogReader<T> reader(fd);
+//   while (true) {
+//     Result<T> message = reader.read();
+//     if (message.isNone()) {
+//       break;
+//     } else if (message.isError()) {
+//       LOG(WARNING) << message.error();
+//       reader.skip();
+//       continue;
+//     }
+//     ...
+//   }
+template <typename T>
+class LogReader
+{
+public:
+  explicit LogReader(int fd, size_t size = PROTOBUF_READER_BUFFER_SIZE)
+    : input(fd, size) {}
+
+  Result<T> read()
+  {
+    // NOTE: This only returns None at the end of the file, in which
+    // case we decode whatever is left.
+    Result<Nothing> filled = input.fill(PROTOBUF_LOG_HEADER_MAX);
+    if (filled.isError()) {
+      input.restore();
+      return Error("Failed to read header: " + filled.error());
+    }
+
+    Result<internal::Header> header =
+      internal::decode(input.data(), input.size());
+
+    if (header.isNone()) {
+      input.restore();
+      return None(); // Reached the end, perhaps mid header.
+    } else if (header.isError()) {
+      return corrupted(header.error());
+    }
+
+    const size_t length = header.get().length + header.get().size;
+
+    filled = input.fill(length);
+    if (filled.isNone()) {
+      input.restore();
+      return None(); // Reached the end mid message.
+    } else if (filled.isError()) {
+      input.restore();
+      return Error("Failed to read message: " + filled.error());
+    }
+
+    const char* data = input.data() + header.get().length;
+
+    if (internal::mask(crc32c::value(data, header.get().size)) !=
+        header.get().crc) {
+      return corrupted("Message checksum mismatch");
+    }
+
+    T message;
+    google::protobuf::io::ArrayInputStream stream(data, header.get().size);
+
+    if (!message.ParseFromZeroCopyStream(&stream)) {
+      return corrupted("Failed to deserialize message");
+    }
+
+    input.consume(length);
+
+    return message;
+  }
+
+  // Skips (at least one byte) to the start of the next record with a
+  // valid header, or the end of the file, and returns the number of
+  // bytes skipped. Used to resynchronize after 'read' has returned
+  // an error for a corrupted record.
+  Try<size_t> skip()
+  {
+    size_t skipped = 0;
+
+    while (true) {
+      Result<Nothing> filled = input.fill(PROTOBUF_LOG_HEADER_MAX);
+      if (filled.isError()) {
+        input.restore();
+        return Error("Failed to read: " + filled.error());
+      } else if (input.size() == 0) {
+        return skipped;
+      }
+
+      if (skipped > 0) {
+        Result<internal::Header> header =
+          internal::decode(input.data(), input.size());
+        if (!header.isError()) {
+          // Either a valid header or a partial one at the end.
+          return skipped;
+        }
+      }
+
+      // Scan for the next magic (after the current byte).
+      const void* magic = memchr(
+          input.data() + 1,
+          PROTOBUF_LOG_MAGIC,
+          input.size() - 1);
+
+      const size_t size = magic != NULL
+        ? static_cast<const char*>(magic) - input.data()
+        : input.size();
+
+      input.consume(size);
+      skipped += size;
+    }
+  }
+
+  // Returns the offset in the file of the next record to be read, or
+  // None if the file isn't seekable.
+  Option<off_t> offset() const
+  {
+    return input.offset();
+  }
+
+private:
+  // Not copyable, not assignable.
+  LogReader(const LogReader&);
+  LogReader& operator = (const LogReader&);
+
+  Error corrupted(const std::string& message)
+  {
+    Option<off_t> offset = input.offset();
+    input.restore();
+    return Error(
+        "Corrupted record" +
+        (offset.isSome() ? " at offset " + stringify(offset.get()) : "") +
+        ": " + message);
+  }
+
+  internal::Input input;
+};
+
+
+// Conversion between protobuf messages and JSON, using reflection.
+// Each field of a message becomes a member of a JSON object named
+// after the field (only set fields and non-empty repeated fields are
+// included). Repeated fields become arrays, nested messages become
+// objects, enums become the name of their value and bytes fields get
+// base64 encoded. Everything else maps to a JSON number, string or
+// boolean.
+//
+// NOTE: 64-bit integers are converted to (and from) doubles so values
+// beyond 2^53 lose precision.
+
+namespace internal {
+
+// The fields of a message type, computed once per descriptor (see
+// 'fields' below) so that repeated conversions don't need to walk
+// (or search) the descriptor.
+struct Fields
+{
+  // Sorted by name, which is the order JSON::Object renders them.
+  std::vector<const google::protobuf::FieldDescriptor*> sorted;
+
+  std::tr1::unordered_map<
+    std::string,
+    const google::protobuf::FieldDescriptor*> names;
+};
+
+
+inline bool compare(
+    const google::protobuf::FieldDescriptor* left,
+    const google::protobuf::FieldDescriptor* right)
+{
+  return left->name() < right->name();
+}
+
+
+// Returns the (cached) fields of the message type.
+// NOTE: The cache assumes descriptors outlive the process, which is
+// true for generated messages (descriptors from a DescriptorPool that
+// gets deleted must not be used).
+inline const Fields& fields(const google::protobuf::Descriptor* descriptor)
+{
+  typedef std::tr1::unordered_map<
+    const google::protobuf::Descriptor*,
+    Fields*> Cache;
+
+  static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+  static Cache* cache = new Cache();
+
+  pthread_rwlock_rdlock(&lock);
+  Cache::const_iterator iterator = cache->find(descriptor);
+  if (iterator != cache->end()) {
+    const Fields& result = *iterator->second;
+    pthread_rwlock_unlock(&lock);
+    return result;
+  }
+  pthread_rwlock_unlock(&lock);
+
+  Fields* fields = new Fields();
+  for (int i = 0; i < descriptor->field_count(); i++) {
+    const google::protobuf::FieldDescriptor* field = descriptor->field(i);
+    fields->sorted.push_back(field);
+    fields->names[field->name()] = field;
+  }
+  std::sort(fields->sorted.begin(), fields->sorted.end(), &compare);
+
+  pthread_rwlock_wrlock(&lock);
+  std::pair<Cache::iterator, bool> inserted =
+    cache->insert(std::make_pair(descriptor, fields));
+  if (!inserted.second) {
+    delete fields; // Lost a race with another thread.
+  }
+  const Fields& result = *inserted.first->second;
+  pthread_rwlock_unlock(&lock);
+
+  return result;
+}
+
+
+inline std::string base64(const std::string& s)
+{
+  static const char chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  std::string result;
+  result.reserve((s.size() + 2) / 3 * 4);
+
+  size_t i = 0;
+  for (; i + 2 < s.size(); i += 3) {
+    uint32_t bits = (static_cast<unsigned char>(s[i]) << 16) |
+      (static_cast<unsigned char>(s[i + 1]) << 8) |
+      static_cast<unsigned char>(s[i + 2]);
+    result += chars[(bits >> 18) & 0x3F];
+    result += chars[(bits >> 12) & 0x3F];
+    result += chars[(bits >> 6) & 0x3F];
+    result += chars[bits & 0x3F];
+  }
+
+  if (i < s.size()) {
+    uint32_t bits = static_cast<unsigned char>(s[i]) << 16;
+    if (i + 1 < s.size()) {
+      bits |= static_cast<unsigned char>(s[i + 1]) << 8;
+    }
+    result += chars[(bits >> 18) & 0x3F];
+    result += chars[(bits >> 12) & 0x3F];
+    result += i + 1 < s.size() ? chars[(bits >> 6) & 0x3F] : '=';
+    result += '=';
+  }
+
+  return result;
+}
+
+
+inline Try<std::string> unbase64(const std::string& s)
+{
+  std::string result;
+  result.reserve(s.size() / 4 * 3);
+
+  uint32_t bits = 0;
+  int count = 0;
+  size_t i = 0;
+  for (; i < s.size() && s[i] != '='; i++) {
+    char c = s[i];
+    uint32_t value;
+    if (c >= 'A' && c <= 'Z') {
+      value = c - 'A';
+    } else if (c >= 'a' && c <= 'z') {
+      value = c - 'a' + 26;
+    } else if (c >= '0' && c <= '9') {
+      value = c - '0' + 52;
+    } else if (c == '+') {
+      value = 62;
+    } else if (c == '/') {
+      value = 63;
+    } else {
+      return Error("Invalid base64 character");
+    }
+
+    bits = (bits << 6) | value;
+    if (++count == 4) {
+      result += static_cast<char>(bits >> 16);
+      result += static_cast<char>(bits >> 8);
+      result += static_cast<char>(bits);
+      bits = 0;
+      count = 0;
+    }
+  }
+
+  // Any padding must complete the last group of 4 characters.
+  const size_t padding = s.size() - i;
+  if (count == 1 ||
+      (padding > 0 && count + padding != 4) ||
+      s.find_first_not_of('=', i) != std::string::npos) {
+    return Error("Invalid base64 padding");
+  }
+
+  if (count == 2) {
+    result += static_cast<char>(bits >> 4);
+  } else if (count == 3) {
+    result += static_cast<char>(bits >> 10);
+    result += static_cast<char>(bits >> 2);
+  }
+
+  return result;
+}
+
+
+// Returns the value of the field (or the element at 'index' if the
+// field is repeated) as JSON.
+inline JSON::Value value(
+    const google::protobuf::Message& message,
+    const google::protobuf::FieldDescriptor* field,
+    int index);
+
+
+// Adds the fields of the message to the JSON object.
+inline void object(
+    const google::protobuf::Message& message,
+    JSON::Object* object)
+{
+  const google::protobuf::Reflection* reflection = message.GetReflection();
+
+  foreach (const google::protobuf::FieldDescriptor* field,
+           fields(message.GetDescriptor()).sorted) {
+    if (field->is_repeated()) {
+      int size = reflection->FieldSize(message, field);
+      if (size > 0) {
+        JSON::Array array;
+        for (int i = 0; i < size; i++) {
+          array.values.push_back(value(message, field, i));
+        }
+        object->values[field->name()] = array;
+      }
+    } else if (reflection->HasField(message, field)) {
+      object->values[field->name()] = value(message, field, -1);
+    }
+  }
+}
+
+
+inline JSON::Value value(
+    const google::protobuf::Message& message,
+    const google::protobuf::FieldDescriptor* field,
+    int index)
+{
+  const google::protobuf::Reflection* reflection = message.GetReflection();
+  const bool repeated = index >= 0;
+
+// Gets a scalar field (of the specified type) whether or not the field
+// is repeated.
+#define PROTOBUF_GET(type)                                           \
+  (repeated                                                          \
+   ? reflection->GetRepeated ## type(message, field, index)          \
+   : reflection->Get ## type(message, field))
+
+  switch (field->cpp_type()) {
+    case google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE:
+      return JSON::Number(PROTOBUF_GET(Double));
+    case google::protobuf::FieldDescriptor::CPPTYPE_FLOAT:
+      return JSON::Number(PROTOBUF_GET(Float));
+    case google::protobuf::FieldDescriptor::CPPTYPE_INT32:
+      return JSON::Number(PROTOBUF_GET(Int32));
+    case google::protobuf::FieldDescriptor::CPPTYPE_INT64:
+      return JSON::Number(PROTOBUF_GET(Int64));
+    case google::protobuf::FieldDescriptor::CPPTYPE_UINT32:
+      return JSON::Number(PROTOBUF_GET(UInt32));
+    case google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
+      return JSON::Number(PROTOBUF_GET(UInt64));
+    case google::protobuf::FieldDescriptor::CPPTYPE_BOOL:
+      if (PROTOBUF_GET(Bool)) {
+        return JSON::True();
+      }
+      return JSON::False();
+    case google::protobuf::FieldDescriptor::CPPTYPE_STRING:
+      if (field->type() == google::protobuf::FieldDescriptor::TYPE_BYTES) {
+        return JSON::String(base64(PROTOBUF_GET(String)));
+      }
+      return JSON::String(PROTOBUF_GET(String));
+    case google::protobuf::FieldDescriptor::CPPTYPE_ENUM:
+      return JSON::String(PROTOBUF_GET(Enum)->name());
+    case google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE:
+      {
+        JSON::Object result;
+        object(PROTOBUF_GET(Message), &result);
+        return result;
+      }
+  }
+
+#undef PROTOBUF_GET
+
+  return JSON::Null(); // Unreachable.
+}
+
+
+// Writes the message as a JSON object (see 'object' above).
+inline Try<Nothing> write(
+    JSON::Writer* writer,
+    const google::protobuf::Message& message);
+
+
+// Writes the value of the field (or the element at 'index' if the
+// field is repeated), see 'value' above.
+inline Try<Nothing> write(
+    JSON::Writer* writer,
+    const google::protobuf::Message& message,
+    const google::protobuf::FieldDescriptor* field,
+    int index)
+{
+  const google::protobuf::Reflection* reflection = message.GetReflection();
+  const bool repeated = index >= 0;
+
+#define PROTOBUF_GET(type)                                           \
+  (repeated                                                          \
+   ? reflection->GetRepeated ## type(message, field, index)          \
+   : reflection->Get ## type(message, field))
+
+  switch (field->cpp_type()) {
+    case google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE:
+      return writer->value(PROTOBUF_GET(Double));
+    case google::protobuf::FieldDescriptor::CPPTYPE_FLOAT:
+      return writer->value(static_cast<double>(PROTOBUF_GET(Float)));
+    case google::protobuf::FieldDescriptor::CPPTYPE_INT32:
+      return writer->value(static_cast<double>(PROTOBUF_GET(Int32)));
+    case google::protobuf::FieldDescriptor::CPPTYPE_INT64:
+      return writer->value(static_cast<double>(PROTOBUF_GET(Int64)));
+    case google::protobuf::FieldDescriptor::CPPTYPE_UINT32:
+      return writer->value(static_cast<double>(PROTOBUF_GET(UInt32)));
+    case google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
+      return writer->value(static_cast<double>(PROTOBUF_GET(UInt64)));
+    case google::protobuf::FieldDescriptor::CPPTYPE_BOOL:
+      return writer->value(static_cast<bool>(PROTOBUF_GET(Bool)));
+    case google::protobuf::FieldDescriptor::CPPTYPE_STRING:
+      if (field->type() == google::protobuf::FieldDescriptor::TYPE_BYTES) {
+        return writer->value(base64(PROTOBUF_GET(String)));
+      } else if (repeated) {
+        std::string scratch;
+        return writer->value(
+            reflection->GetRepeatedStringReference(
+                message, field, index, &scratch));
+      } else {
+        std::string scratch;
+        return writer->value(
+            reflection->GetStringReference(message, field, &scratch));
+      }
+    case google::protobuf::FieldDescriptor::CPPTYPE_ENUM:
+      return writer->value(PROTOBUF_GET(Enum)->name());
+    case google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE:
+      return write(writer, PROTOBUF_GET(Message));
+  }
+
+#undef PROTOBUF_GET
+
+  return Error("Unknown type of field '" + field->name() + "'");
+}
+
+
+inline Try<Nothing> write(
+    JSON::Writer* writer,
+    const google::protobuf::Message& message)
+{
+  const google::protobuf::Reflection* reflection = message.GetReflection();
+
+  Try<Nothing> result = writer->beginObject();
+  if (result.isError()) {
+    return result;
+  }
+
+  foreach (const google::protobuf::FieldDescriptor* field,
+           fields(message.GetDescriptor()).sorted) {
+    if (field->is_repeated()) {
+      int size = reflection->FieldSize(message, field);
+      if (size == 0) {
+        continue;
+      }
+
+      result = writer->key(field->name());
+      if (result.isSome()) {
+        result = writer->beginArray();
+      }
+      for (int i = 0; result.isSome() && i < size; i++) {
+        result = write(writer, message, field, i);
+      }
+      if (result.isSome()) {
+        result = writer->endArray();
+      }
+    } else if (reflection->HasField(message, field)) {
+      result = writer->key(field->name());
+      if (result.isSome()) {
+        result = write(writer, message, field, -1);
+      }
+    }
+
+    if (result.isError()) {
+      return result;
+    }
+  }
+
+  return writer->endObject();
+}
+
+
+inline Try<Nothing> parse(
+    const JSON::Object& object,
+    google::protobuf::Message* message);
+
+
+// Checks that the JSON number is an integer within the range of T.
+template <typename T>
+Try<T> integer(
+    const JSON::Value& value,
+    const google::protobuf::FieldDescriptor* field)
+{
+  const JSON::Number* number = boost::get<JSON::Number>(&value);
+  if (number == NULL) {
+    return Error("Expecting a number for field '" + field->name() + "'");
+  }
+
+  // The maximum of a 64-bit type isn't representable as a double
+  // (it rounds up to 2^63 or 2^64) so compare against the exclusive
+  // upper bound 2^digits instead. The minimum is 0 or -2^digits.
+  const double d = number->value;
+  if (d != floor(d) ||
+      d < static_cast<double>(std::numeric_limits<T>::min()) ||
+      d >= ldexp(1.0, std::numeric_limits<T>::digits)) {
+    return Error("Expecting an integer within range for field '" +
+                 field->name() + "'");
+  }
+
+  return static_cast<T>(d);
+}
+
+
+// Sets the field (or adds an element to the field if it is repeated)
+// from the JSON value.
+inline Try<Nothing> parse(
+    const JSON::Value& value,
+    const google::protobuf::FieldDescriptor* field,
+    google::protobuf::Message* message)
+{
+  const google::protobuf::Reflection* reflection = message->GetReflection();
+  const bool repeated = field->is_repeated();
+
+// Sets (or adds) a scalar field of the specified type.
+#define PROTOBUF_SET(type, value)                                    \
+  if (repeated) {                                                    \
+    reflection->Add ## type(message, field, value);                  \
+  } else {                                                           \
+    reflection->Set ## type(message, field, value);                  \
+  }
+
+  switch (field->cpp_type()) {
+    case google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE:
+    case google::protobuf::FieldDescriptor::CPPTYPE_FLOAT: {
+      const JSON::Number* number = boost::get<JSON::Number>(&value);
+      if (number == NULL) {
+        return Error("Expecting a number for field '" + field->name() + "'");
+      }
+      if (field->cpp_type() ==
+          google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE) {
+        PROTOBUF_SET(Double, number->value);
+      } else {
+        PROTOBUF_SET(Float, static_cast<float>(number->value));
+      }
+      break;
+    }
+    case google::protobuf::FieldDescriptor::CPPTYPE_INT32: {
+      Try<int32_t> i = integer<int32_t>(value, field);
+      if (i.isError()) {
+        return Error(i.error());
+      }
+      PROTOBUF_SET(Int32, i.get());
+      break;
+    }
+    case google::protobuf::FieldDescriptor::CPPTYPE_INT64: {
+      Try<int64_t> i = integer<int64_t>(value, field);
+      if (i.isError()) {
+        return Error(i.error());
+      }
+      PROTOBUF_SET(Int64, i.get());
+      break;
+    }
+    case google::protobuf::FieldDescriptor::CPPTYPE_UINT32: {
+      Try<uint32_t> i = integer<uint32_t>(value, field);
+      if (i.isError()) {
+        return Error(i.error());
+      }
+      PROTOBUF_SET(UInt32, i.get());
+      break;
+    }
+    case google::protobuf::FieldDescriptor::CPPTYPE_UINT64: {
+      Try<uint64_t> i = integer<uint64_t>(value, field);
+      if (i.isError()) {
+        return Error(i.error());
+      }
+      PROTOBUF_SET(UInt64, i.get());
+      break;
+    }
+    case google::protobuf::FieldDescriptor::CPPTYPE_BOOL:
+      if (boost::get<JSON::True>(&value) != NULL) {
+        PROTOBUF_SET(Bool, true);
+      } else if (boost::get<JSON::False>(&value) != NULL) {
+        PROTOBUF_SET(Bool, false);
+      } else {
+        return Error("Expecting a boolean for field '" + field->name() + "'");
+      }
+      break;
+    case google::protobuf::FieldDescriptor::CPPTYPE_STRING: {
+      const JSON::String* string = boost::get<JSON::String>(&value);
+      if (string == NULL) {
+        return Error("Expecting a string for field '" + field->name() + "'");
+      }
+      if (field->type() == google::protobuf::FieldDescriptor::TYPE_BYTES) {
+        Try<std::string> bytes = unbase64(string->value);
+        if (bytes.isError()) {
+          return Error(bytes.error() + " for field '" + field->name() + "'");
+        }
+        PROTOBUF_SET(String, bytes.get());
+      } else {
+        PROTOBUF_SET(String, string->value);
+      }
+      break;
+    }
+    case google::protobuf::FieldDescriptor::CPPTYPE_ENUM: {
+      const JSON::String* string = boost::get<JSON::String>(&value);
+      if (string == NULL) {
+        return Error("Expecting a string for field '" + field->name() + "'");
+      }
+      const google::protobuf::EnumValueDescriptor* descriptor =
+        field->enum_type()->FindValueByName(string->value);
+      if (descriptor == NULL) {
+        return Error("Unknown value '" + string->value +
+                     "' for field '" + field->name() + "'");
+      }
+      PROTOBUF_SET(Enum, descriptor);
+      break;
+    }
+    case google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE: {
+      const JSON::Object* object = boost::get<JSON::Object>(&value);
+      if (object == NULL) {
+        return Error("Expecting an object for field '" + field->name() + "'");
+      }
+      Try<Nothing> result = parse(
+          *object,
+          repeated
+            ? reflection->AddMessage(message, field)
+            : reflection->MutableMessage(message, field));
+      if (result.isError()) {
+        return result;
+      }
+      break;
+    }
+  }
+
+#undef PROTOBUF_SET
+
+  return Nothing();
+}
+
+
+inline Try<Nothing> parse(
+    const JSON::Object& object,
+    google::protobuf::Message* message)
+{
+  const Fields& fields = internal::fields(message->GetDescriptor());
+
+  std::map<std::string, JSON::Value>::const_iterator iterator;
+  for (iterator = object.values.begin();
+       iterator != object.values.end();
+       ++iterator) {
+    // Members which aren't fields of the message are ignored.
+    std::tr1::unordered_map<
+      std::string,
+      const google::protobuf::FieldDescriptor*>::const_iterator field =
+      fields.names.find(iterator->first);
+    if (field == fields.names.end()) {
+      continue;
+    }
+
+    if (field->second->is_repeated()) {
+      const JSON::Array* array = boost::get<JSON::Array>(&iterator->second);
+      if (array == NULL) {
+        return Error("Expecting an array for field '" +
+                     iterator->first + "'");
+      }
+      foreach (const JSON::Value& value, array->values) {
+        Try<Nothing> result = parse(value, field->second, message);
+        if (result.isError()) {
+          return result;
+        }
+      }
+    } else {
+      Try<Nothing> result = parse(iterator->second, field->second, message);
+      if (result.isError()) {
+        return result;
+      }
+    }
+  }
+
+  return Nothing();
+}
+
+} // namespace internal {
+
+
+// Parses the JSON object into the message (see above). Members of
+// the object which are not fields of the message are ignored, and it
+// is an error if any required fields are missing.
+inline Try<Nothing> parse(
+    const JSON::Object& object,
+    google::protobuf::Message* message)
+{
+  Try<Nothing> result = internal::parse(object, message);
+  if (result.isError()) {
+    return result;
+  }
+
+  if (!message->IsInitialized()) {
+    return Error("Missing required fields: " +
+                 message->InitializationErrorString());
+  }
+
+  return Nothing();
+}
+
+
+inline Try<Nothing> parse(
+    const JSON::Value& value,
+    google::protobuf::Message* message)
+{
+  const JSON::Object* object = boost::get<JSON::Object>(&value);
+  if (object == NULL) {
+    return Error("Expecting a JSON object");
+  }
+  return parse(*object, message);
+}
+
+
+template <typename T>
+Try<T> parse(const JSON::Object& object)
+{
+  T message;
+  Try<Nothing> result = parse(object, &message);
+  if (result.isError()) {
+    return Error(result.error());
+  }
+  return message;
+}
+
+
+template <typename T>
+Try<T> parse(const JSON::Value& value)
+{
+  T message;
+  Try<Nothing> result = parse(value, &message);
+  if (result.isError()) {
+    return Error(result.error());
+  }
+  return message;
+}
+
 } // namespace protobuf {
 
+
+namespace JSON {
+
+// Converts a protobuf message into a JSON object (see above). For
+// example:
+//
+//   JSON::Object object = JSON::Protobuf(message);
+struct Protobuf : Object
+{
+  explicit Protobuf(const google::protobuf::Message& message)
+  {
+    protobuf::internal::object(message, this);
+  }
+};
+
+
+// Writes the protobuf message as a JSON object without building a
+// JSON::Object first. The output is the same as rendering a
+// JSON::Protobuf.
+inline Try<Nothing> write(
+    Writer* writer,
+    const google::protobuf::Message& message)
+{
+  return protobuf::internal::write(writer, message);
+}
+
+} // namespace JSON {
+
 #endif // __STOUT_PROTOBUF_HPP__
@@ -0,0 +1,324 @@
+#ifndef __STOUT_SHARDED_CACHE_HPP__
+#define __STOUT_SHARDED_CACHE_HPP__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <tr1/functional>
+#include <tr1/unordered_map>
+
+#include "cache.hpp"
+#include "duration.hpp"
+#include "none.hpp"
+#include "option.hpp"
+#include "stopwatch.hpp"
+#include "try.hpp"
+
+
+// Provides a thread-safe cache (see stout/cache.hpp) by hashing keys
+// to a number of independently locked caches ("shards") each with an
+// equal part of the total capacity. Threads using keys that fall in
+// different shards never contend with one another.
+//
+// Using Eviction::LRU means that every use reorders a shard so every
+// "read" needs exclusive access to the shard. Using Eviction::CLOCK
+// only sets a reference bit on a "read" so "reads" of a shard can
+// proceed concurrently (only "writes" need exclusive access) which
+// lets cache hits scale with the number of cores.
+//
+// NOTE: Since each shard evicts on its own, the cache as a whole
+// only approximates the eviction policy.
+template <typename Key, typename Value>
+class sharded_cache
+{
+public:
+  typedef typename cache<Key, Value>::Weigher Weigher;
+  typedef typename cache<Key, Value>::Loader Loader;
+
+  // Creates a cache with (at least) the specified total capacity
+  // split across the specified number of shards (rounded up to a
+  // power of two). See cache for the policy and weigher.
+  explicit sharded_cache(
+      size_t capacity,
+      size_t _shards = 16,
+      Eviction::Policy _policy = Eviction::LRU,
+      const Weigher& weigher = Weigher())
+    : policy(_policy)
+  {
+    size_t count = 1;
+    bits = 0;
+    while (count < _shards) {
+      count <<= 1;
+      bits++;
+    }
+
+    shards = new Shard[count];
+    for (size_t i = 0; i < count; i++) {
+      // Spread the capacity evenly, shards get at least one entry.
+      size_t share = capacity / count + (i < capacity % count ? 1 : 0);
+      if (share == 0 && capacity > 0) {
+        share = 1;
+      }
+      pthread_rwlock_init(&shards[i].lock, NULL);
+      pthread_mutex_init(&shards[i].mutex, NULL);
+      pthread_cond_init(&shards[i].loaded, NULL);
+      shards[i].entries = new cache<Key, Value>(share, policy, weigher);
+      shards[i].hits = 0;
+      shards[i].misses = 0;
+      shards[i].loads = 0;
+      shards[i].failures = 0;
+      shards[i].loading = 0;
+    }
+  }
+
+  ~sharded_cache()
+  {
+    for (size_t i = 0; i < (1u << bits); i++) {
+      delete shards[i].entries;
+      pthread_cond_destroy(&shards[i].loaded);
+      pthread_mutex_destroy(&shards[i].mutex);
+      pthread_rwlock_destroy(&shards[i].lock);
+    }
+    delete[] shards;
+  }
+
+  void put(const Key& key, const Value& value)
+  {
+    size_t hash = hasher(key);
+    Shard& shard = shards[index(hash)];
+    pthread_rwlock_wrlock(&shard.lock);
+    shard.entries->put(key, value, hash);
+    pthread_rwlock_unlock(&shard.lock);
+  }
+
+  Option<Value> get(const Key& key)
+  {
+    size_t hash = hasher(key);
+    Shard& shard = shards[index(hash)];
+
+    Option<Value> result = lookup(shard, key, hash);
+
+    __sync_fetch_and_add(result.isSome() ? &shard.hits : &shard.misses, 1);
+
+    return result;
+  }
+
+  // Returns the value for the key, using the loader to compute (and
+  // then cache) the value if it isn't in the cache. Concurrent misses
+  // on the same key are coalesced: only one thread invokes the loader
+  // while the others wait for (and share) its result. Errors returned
+  // by the loader are not cached.
+  //
+  // NOTE: The loader is invoked without holding any locks so it may
+  // use the cache, but it must not load the same key.
+  Try<Value> getOrLoad(const Key& key, const Loader& loader)
+  {
+    size_t hash = hasher(key);
+    Shard& shard = shards[index(hash)];
+
+    Option<Value> value = lookup(shard, key, hash);
+    if (value.isSome()) {
+      __sync_fetch_and_add(&shard.hits, 1);
+      return value.get();
+    }
+
+    __sync_fetch_and_add(&shard.misses, 1);
+
+    pthread_mutex_lock(&shard.mutex);
+
+    typename Loads::iterator iterator = shard.pending.find(key);
+    if (iterator != shard.pending.end()) {
+      // Someone else is already loading this key, wait for them.
+      Load* load = iterator->second;
+      load->references++;
+      while (load->result.isNone()) {
+        pthread_cond_wait(&shard.loaded, &shard.mutex);
+      }
+      Try<Value> result = load->result.get();
+      release(load);
+      pthread_mutex_unlock(&shard.mutex);
+      return result;
+    }
+
+    // Check again in case a load finished after our first lookup.
+    value = lookup(shard, key, hash);
+    if (value.isSome()) {
+      pthread_mutex_unlock(&shard.mutex);
+      return value.get();
+    }
+
+    Load* load = new Load();
+    shard.pending[key] = load;
+
+    pthread_mutex_unlock(&shard.mutex);
+
+    // Hands the result to any waiters however we leave this function.
+    Loading loading(shard, key, load);
+
+    Stopwatch stopwatch;
+    stopwatch.start();
+
+    Try<Value> result = loader(key);
+
+    stopwatch.stop();
+
+    __sync_fetch_and_add(
+        &shard.loading,
+        static_cast<uint64_t>(stopwatch.elapsed().ns()));
+
+    if (result.isSome()) {
+      __sync_fetch_and_add(&shard.loads, 1);
+      put(key, result.get());
+    } else {
+      __sync_fetch_and_add(&shard.failures, 1);
+    }
+
+    loading.result = result;
+
+    return result;
+  }
+
+  // Returns the number of entries in the cache.
+  size_t size() const
+  {
+    size_t result = 0;
+    for (size_t i = 0; i < (1u << bits); i++) {
+      pthread_rwlock_rdlock(&shards[i].lock);
+      result += shards[i].entries->size();
+      pthread_rwlock_unlock(&shards[i].lock);
+    }
+    return result;
+  }
+
+  // Returns the statistics summed across all the shards.
+  CacheStats stats() const
+  {
+    CacheStats result;
+    uint64_t loading = 0;
+    for (size_t i = 0; i < (1u << bits); i++) {
+      Shard& shard = shards[i];
+      pthread_rwlock_rdlock(&shard.lock);
+      result.evictions += shard.entries->stats().evictions;
+      pthread_rwlock_unlock(&shard.lock);
+      result.hits += __sync_fetch_and_add(&shard.hits, 0);
+      result.misses += __sync_fetch_and_add(&shard.misses, 0);
+      result.loads += __sync_fetch_and_add(&shard.loads, 0);
+      result.failures += __sync_fetch_and_add(&shard.failures, 0);
+      loading += __sync_fetch_and_add(&shard.loading, 0);
+    }
+    result.loading = Nanoseconds(loading);
+    return result;
+  }
+
+private:
+  // Not copyable, not assignable.
+  sharded_cache(const sharded_cache&);
+  sharded_cache& operator = (const sharded_cache&);
+
+  // An invocation of a loader that is in progress, shared by all the
+  // threads waiting on it and deleted by whichever finishes last.
+  struct Load
+  {
+    Load() : references(1) {}
+
+    Option<Try<Value> > result;
+    int references;
+  };
+
+  typedef std::tr1::unordered_map<Key, Load*> Loads;
+
+  struct Shard
+  {
+    pthread_rwlock_t lock;
+    cache<Key, Value>* entries;
+
+    // Counted here rather than by the cache since lookups might be
+    // done concurrently (see Eviction::CLOCK).
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t loads;
+    uint64_t failures;
+    uint64_t loading; // In nanoseconds.
+
+    // Protects 'pending' (always acquired before 'lock').
+    pthread_mutex_t mutex;
+    pthread_cond_t loaded;
+    Loads pending;
+
+    // Keep each shard on its own cache line so that threads using
+    // different shards don't bounce the line between cores.
+    char padding[64];
+  };
+
+  Option<Value> lookup(Shard& shard, const Key& key, size_t hash)
+  {
+    if (policy == Eviction::CLOCK) {
+      pthread_rwlock_rdlock(&shard.lock);
+    } else {
+      pthread_rwlock_wrlock(&shard.lock);
+    }
+
+    Option<Value> result = shard.entries->get(key, hash);
+
+    pthread_rwlock_unlock(&shard.lock);
+    return result;
+  }
+
+  // Drops a reference to the load, must hold the shard's mutex.
+  static void release(Load* load)
+  {
+    if (--load->references == 0) {
+      delete load;
+    }
+  }
+
+  // Finishes a load when it goes out of scope: removes it from the
+  // shard and wakes up the waiters. If no result was set (i.e., the
+  // loader threw) the waiters get an error instead of blocking forever.
+  struct Loading
+  {
+    Loading(Shard& _shard, const Key& _key, Load* _load)
+      : shard(_shard), key(_key), load(_load) {}
+
+    ~Loading()
+    {
+      pthread_mutex_lock(&shard.mutex);
+      shard.pending.erase(key);
+      if (result.isSome()) {
+        load->result = result.get();
+      } else {
+        load->result = Try<Value>::error("Loader threw an exception");
+      }
+      release(load);
+      pthread_cond_broadcast(&shard.loaded);
+      pthread_mutex_unlock(&shard.mutex);
+    }
+
+    Shard& shard;
+    const Key& key;
+    Load* load;
+    Option<Try<Value> > result;
+  };
+
+  // Maps a hash to a shard using the high bits of a multiplicative
+  // hash since each shard uses the low bits to pick a bucket.
+  size_t index(size_t hash) const
+  {
+    if (bits == 0) {
+      return 0;
+    }
+    return static_cast<size_t>(
+        (static_cast<uint64_t>(hash) * 0x9E3779B97F4A7C15ULL) >> (64 - bits));
+  }
+
+  const Eviction::Policy policy;
+
+  std::tr1::hash<Key> hasher;
+
+  // There are 2^bits shards.
+  size_t bits;
+  Shard* shards;
+};
+
+#endif // __STOUT_SHARDED_CACHE_HPP__
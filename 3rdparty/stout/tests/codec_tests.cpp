@@ -0,0 +1,193 @@
+#include <gtest/gtest.h>
+
+#include <gmock/gmock.h>
+
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <stout/codec.hpp>
+#include <stout/foreach.hpp>
+#include <stout/gtest.hpp>
+#include <stout/stopwatch.hpp>
+#include <stout/stringify.hpp>
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+
+TEST(CodecTest, Get)
+{
+  EXPECT_ERROR(codec::get("bogus"));
+
+  foreach (const string& name, codec::names()) {
+    Try<codec::Codec*> codec = codec::get(name);
+    ASSERT_SOME(codec);
+    EXPECT_EQ(name, codec.get()->name());
+  }
+
+#ifndef HAVE_LIBLZ4
+  EXPECT_ERROR(codec::get("lz4"));
+#endif
+
+#ifndef HAVE_LIBZSTD
+  EXPECT_ERROR(codec::get("zstd"));
+#endif
+}
+
+
+#ifdef HAVE_LIBZSTD
+TEST(CodecTest, ZstdForgedSize)
+{
+  // A frame header claiming 1TB of content followed by an empty
+  // last block: this must be an error, not an attempt to allocate.
+  const char frame[] = {
+    '\x28', '\xB5', '\x2F', '\xFD', // Magic number.
+    '\xE0', // Single segment, 8 byte content size.
+    '\x00', '\x00', '\x00', '\x00', '\x00', '\x01', '\x00', '\x00',
+    '\x01', '\x00', '\x00' // Last raw block of 0 bytes.
+  };
+
+  Try<codec::Codec*> zstd = codec::get("zstd");
+  ASSERT_SOME(zstd);
+
+  string output;
+  EXPECT_ERROR(zstd.get()->decompress(string(frame, sizeof(frame)), &output));
+  EXPECT_TRUE(output.empty());
+}
+#endif // HAVE_LIBZSTD
+
+
+#ifdef HAVE_LIBZ
+// Returns some (roughly) representative data: JSON-ish records with
+// repeated field names and varying values.
+static string records(size_t length)
+{
+  string s;
+  for (int i = 0; s.length() < length; i++) {
+    s += "{\"id\": " + stringify(i * 7919 % 100003) +
+      ", \"name\": \"task-" + stringify(rand() % 1000) +
+      "\", \"state\": \"" + (rand() % 4 == 0 ? "FINISHED" : "RUNNING") +
+      "\", \"cpus\": " + stringify(rand() % 16) + "}\n";
+  }
+  s.resize(length);
+  return s;
+}
+
+
+TEST(CodecTest, CompressDecompress)
+{
+  size_t sizes[] = { 0, 1, 1000, 100 * 1000, 1000 * 1000 };
+
+  foreach (const string& name, codec::names()) {
+    codec::Codec* codec = codec::get(name).get();
+
+    string compressed;
+    string decompressed;
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+      string s = records(sizes[i]);
+      ASSERT_SOME(codec->compress(s, &compressed)) << name;
+      ASSERT_SOME(codec->decompress(compressed, &decompressed)) << name;
+      ASSERT_EQ(s, decompressed) << name;
+    }
+
+    EXPECT_ERROR(codec->decompress("not compressed", &decompressed)) << name;
+    EXPECT_ERROR(codec->decompress(
+        compressed.substr(0, compressed.size() / 2), &decompressed)) << name;
+  }
+}
+
+
+TEST(CodecTest, Streaming)
+{
+  string s = records(1000 * 1000);
+
+  foreach (const string& name, codec::names()) {
+    codec::Codec* codec = codec::get(name).get();
+
+    // Compress in odd sized chunks.
+    string compressed;
+    Owned<codec::Stream> compressor =
+      codec->compressor(gzip::appender(&compressed));
+    for (size_t i = 0; i < s.length(); i += 9999) {
+      ASSERT_SOME(compressor->write(s.substr(i, 9999))) << name;
+    }
+    ASSERT_SOME(compressor->finish()) << name;
+
+    // The one-shot and streaming formats are the same.
+    string decompressed;
+    ASSERT_SOME(codec->decompress(compressed, &decompressed)) << name;
+    EXPECT_EQ(s, decompressed) << name;
+
+    ASSERT_SOME(codec->compress(s, &compressed)) << name;
+
+    decompressed.clear();
+    Owned<codec::Stream> decompressor =
+      codec->decompressor(gzip::appender(&decompressed));
+    for (size_t i = 0; i < compressed.length(); i += 333) {
+      ASSERT_SOME(decompressor->write(compressed.substr(i, 333))) << name;
+    }
+    ASSERT_SOME(decompressor->finish()) << name;
+    EXPECT_EQ(s, decompressed) << name;
+
+    // A truncated stream is an error.
+    Owned<codec::Stream> truncated =
+      codec->decompressor(gzip::appender(&decompressed));
+    ASSERT_SOME(truncated->write(compressed.substr(0, 100))) << name;
+    EXPECT_ERROR(truncated->finish()) << name;
+  }
+}
+
+
+TEST(CodecTest, DISABLED_BENCHMARK_Codecs)
+{
+  vector<string> inputs;
+  vector<string> descriptions;
+
+  inputs.push_back(records(16 * 1024 * 1024));
+  descriptions.push_back("records");
+
+  string random;
+  while (random.length() < 4 * 1024 * 1024) {
+    random.append(1, static_cast<char>(rand()));
+  }
+  inputs.push_back(random);
+  descriptions.push_back("random");
+
+  foreach (const string& name, codec::names()) {
+    codec::Codec* codec = codec::get(name).get();
+
+    for (size_t i = 0; i < inputs.size(); i++) {
+      const string& input = inputs[i];
+      const double megabytes = input.size() / (1024.0 * 1024.0);
+
+      string compressed;
+      string decompressed;
+
+      Stopwatch stopwatch;
+      stopwatch.start();
+      ASSERT_SOME(codec->compress(input, &compressed));
+      stopwatch.stop();
+      Duration compressing = stopwatch.elapsed();
+
+      stopwatch.start();
+      ASSERT_SOME(codec->decompress(compressed, &decompressed));
+      stopwatch.stop();
+      Duration decompressing = stopwatch.elapsed();
+
+      ASSERT_EQ(input, decompressed);
+
+      cout << std::setw(5) << name << " " << std::setw(8) << descriptions[i]
+           << ": ratio " << std::setprecision(3)
+           << static_cast<double>(input.size()) / compressed.size()
+           << ", compress " << megabytes / compressing.secs() << " MB/s"
+           << ", decompress " << megabytes / decompressing.secs() << " MB/s"
+           << endl;
+    }
+  }
+}
+#endif // HAVE_LIBZ
@@ -0,0 +1,95 @@
+#include <gtest/gtest.h>
+
+#include <gmock/gmock.h>
+
+#include <stdlib.h>
+
+#include <iostream>
+#include <string>
+
+#include <stout/crc32c.hpp>
+#include <stout/stopwatch.hpp>
+
+using std::cout;
+using std::endl;
+using std::string;
+
+
+TEST(Crc32cTest, Value)
+{
+  // Test vectors from RFC 3720 (iSCSI), section B.4.
+  EXPECT_EQ(0u, crc32c::value(""));
+  EXPECT_EQ(0xE3069283u, crc32c::value("123456789"));
+  EXPECT_EQ(0x8A9136AAu, crc32c::value(string(32, '\x00')));
+  EXPECT_EQ(0x62A8AB43u, crc32c::value(string(32, '\xFF')));
+
+  string ascending;
+  for (int i = 0; i < 32; i++) {
+    ascending += static_cast<char>(i);
+  }
+  EXPECT_EQ(0x46DD794Eu, crc32c::value(ascending));
+}
+
+
+TEST(Crc32cTest, Extend)
+{
+  string s;
+  for (int i = 0; i < 1000; i++) {
+    s += static_cast<char>(rand());
+  }
+
+  const uint32_t expected = crc32c::value(s);
+
+  // Any split of the data (including at unaligned offsets) gives the
+  // same checksum.
+  for (size_t i = 0; i <= s.size(); i += 7) {
+    uint32_t crc = crc32c::value(s.data(), i);
+    EXPECT_EQ(expected, crc32c::extend(crc, s.data() + i, s.size() - i));
+  }
+
+  // A single flipped bit is detected.
+  s[500] ^= 0x10;
+  EXPECT_NE(expected, crc32c::value(s));
+}
+
+
+TEST(Crc32cTest, Implementations)
+{
+  string s;
+  for (int i = 0; i < 1000; i++) {
+    s += static_cast<char>(rand());
+  }
+
+  // Whichever implementation gets used agrees with the portable one
+  // for every length and alignment.
+  for (size_t i = 0; i < 64; i++) {
+    for (size_t length = 0; length < s.size() - i; length += 13) {
+      ASSERT_EQ(crc32c::internal::software(0, s.data() + i, length),
+                crc32c::value(s.data() + i, length));
+    }
+  }
+}
+
+
+TEST(Crc32cTest, DISABLED_BENCHMARK_Value)
+{
+  string s(64 * 1024 * 1024, 'x');
+
+  Stopwatch stopwatch;
+  stopwatch.start();
+  uint32_t crc = crc32c::value(s);
+  stopwatch.stop();
+
+  cout << "Checksummed " << s.size() / (1024 * 1024) << "MB (" << crc
+       << ") at " << s.size() / (1024 * 1024) / stopwatch.elapsed().secs()
+       << " MB/s" << endl;
+
+  stopwatch.start();
+  crc = crc32c::internal::software(0, s.data(), s.size());
+  stopwatch.stop();
+
+  cout << "Checksummed " << s.size() / (1024 * 1024) << "MB (" << crc
+       << ") in software at "
+       << s.size() / (1024 * 1024) / stopwatch.elapsed().secs()
+       << " MB/s" << endl;
+}
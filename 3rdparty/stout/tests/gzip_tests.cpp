@@ -2,11 +2,20 @@
 
 #include <gmock/gmock.h>
 
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <algorithm>
+#include <iostream>
 #include <string>
 
 #include <stout/gtest.hpp>
 #include <stout/gzip.hpp>
+#include <stout/os.hpp>
+#include <stout/stopwatch.hpp>
 
+using std::cout;
+using std::endl;
 using std::string;
 
 
@@ -50,4 +59,307 @@ TEST(GzipTest, CompressDecompressString)
   ASSERT_SOME(decompressed);
   ASSERT_EQ(s, decompressed.get());
 }
+
+
+TEST(GzipTest, ReuseBuffers)
+{
+  string s;
+  while (s.length() < (256 * 1024)) {
+    s.append(1, 'a' + (rand() % 4));
+  }
+
+  string compressed;
+  string decompressed;
+
+  // Alternate levels to make sure the per-thread stream gets changed.
+  for (int level = -1; level <= 9; level++) {
+    ASSERT_SOME(gzip::compress(s, &compressed, level));
+    ASSERT_SOME(gzip::decompress(compressed, &decompressed));
+    ASSERT_EQ(s, decompressed);
+  }
+
+  // The trailer's size hint means the result is allocated just once.
+  string exact;
+  ASSERT_SOME(gzip::decompress(compressed, &exact));
+  EXPECT_EQ(s, exact);
+  EXPECT_GT(2 * s.length(), exact.capacity());
+
+  // Reusing the buffers doesn't need to reallocate.
+  const char* data = decompressed.data();
+  ASSERT_SOME(gzip::compress(s.substr(0, 1000), &compressed));
+  ASSERT_SOME(gzip::decompress(compressed, &decompressed));
+  EXPECT_EQ(s.substr(0, 1000), decompressed);
+  EXPECT_EQ(data, decompressed.data());
+
+  // Concatenated gzip members.
+  Try<string> first = gzip::compress("hello ");
+  Try<string> second = gzip::compress("world");
+  ASSERT_SOME(first);
+  ASSERT_SOME(second);
+  EXPECT_SOME_EQ("hello world", gzip::decompress(first.get() + second.get()));
+
+  // Truncated and corrupt streams are errors.
+  EXPECT_ERROR(gzip::decompress(compressed.substr(0, compressed.size() - 9)));
+  EXPECT_ERROR(gzip::decompress(""));
+  EXPECT_ERROR(gzip::decompress(string(100, 'x')));
+}
+
+
+static void* roundtrips(void* arg)
+{
+  const string& s = *static_cast<string*>(arg);
+
+  string compressed;
+  string decompressed;
+  for (int i = 0; i < 100; i++) {
+    if (gzip::compress(s, &compressed, i % 10).isError() ||
+        gzip::decompress(compressed, &decompressed).isError() ||
+        decompressed != s) {
+      return (void*) 1;
+    }
+  }
+  return NULL;
+}
+
+
+TEST(GzipTest, ReuseBuffersConcurrently)
+{
+  string s;
+  while (s.length() < (16 * 1024)) {
+    s.append(1, ' ' + (rand() % ('~' - ' ')));
+  }
+
+  pthread_t threads[4];
+  for (int i = 0; i < 4; i++) {
+    ASSERT_EQ(0, pthread_create(&threads[i], NULL, roundtrips, &s));
+  }
+
+  for (int i = 0; i < 4; i++) {
+    void* result;
+    ASSERT_EQ(0, pthread_join(threads[i], &result));
+    EXPECT_TRUE(result == NULL);
+  }
+}
+
+
+static Try<Nothing> fail(const char* /*data*/, size_t /*size*/)
+{
+  return Error("Sink failed");
+}
+
+
+// Returns a somewhat compressible (text-like) string.
+static string words(size_t length)
+{
+  const char* words[] = {
+    "lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipisicing",
+    "elit", "sed", "do", "eiusmod", "tempor", "incididunt", "ut", "labore"
+  };
+
+  string s;
+  s.reserve(length + 16);
+  while (s.length() < length) {
+    s.append(words[rand() % 15]);
+    s.append(1, rand() % 8 == 0 ? '\n' : ' ');
+  }
+  s.resize(length);
+  return s;
+}
+
+
+TEST(GzipTest, ParallelCompress)
+{
+  string compressed;
+  string decompressed;
+
+  ASSERT_ERROR(gzip::compress("", &compressed, -2, 4));
+  ASSERT_ERROR(gzip::compress("", &compressed, -1, 4, 0));
+
+  // Include sizes that are (and aren't) a multiple of the block size.
+  const size_t block = 64 * 1024;
+  size_t sizes[] = { 0, 1, 1000, block, block + 1, 3 * block, 1000 * 1000 };
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    string s = words(sizes[i]);
+    ASSERT_SOME(gzip::compress(s, &compressed, -1, 4, block));
+    ASSERT_SOME(gzip::decompress(compressed, &decompressed));
+    ASSERT_EQ(s, decompressed);
+  }
+
+  // Priming each block with the previous one keeps the size close to
+  // that of compressing on a single thread.
+  string s = words(4 * 1024 * 1024);
+  string serial;
+  ASSERT_SOME(gzip::compress(s, &serial));
+  ASSERT_SOME(gzip::compress(s, &compressed, -1, 8, block));
+  EXPECT_GT(serial.size() * 102 / 100, compressed.size());
+
+  // The streaming decompressor verifies the combined CRC too.
+  decompressed.clear();
+  gzip::Decompressor decompressor(gzip::appender(&decompressed));
+  ASSERT_SOME(decompressor.write(compressed));
+  ASSERT_SOME(decompressor.finish());
+  EXPECT_EQ(s, decompressed);
+
+  // A corrupted CRC is detected.
+  compressed[compressed.size() - 8] ^= 1;
+  EXPECT_ERROR(gzip::decompress(compressed));
+}
+
+TEST(GzipTest, Streaming)
+{
+  ASSERT_ERROR(gzip::Compressor(gzip::appender(NULL), -2).finish());
+
+  string s;
+  while (s.length() < (1024 * 1024)) {
+    s.append(1, 'a' + (rand() % 4));
+  }
+
+  // Compress in many (odd sized) chunks.
+  string compressed;
+  gzip::Compressor compressor(gzip::appender(&compressed));
+  for (size_t i = 0; i < s.length(); i += 1001) {
+    size_t size = std::min<size_t>(1001, s.length() - i);
+    ASSERT_SOME(compressor.write(s.data() + i, size));
+  }
+  ASSERT_SOME(compressor.finish());
+  ASSERT_ERROR(compressor.write("more"));
+
+  EXPECT_SOME_EQ(s, gzip::decompress(compressed));
+
+  // Decompress a byte at a time.
+  string decompressed;
+  gzip::Decompressor decompressor(gzip::appender(&decompressed));
+  for (size_t i = 0; i < compressed.length(); i++) {
+    ASSERT_SOME(decompressor.write(compressed.data() + i, 1));
+  }
+  ASSERT_SOME(decompressor.finish());
+  EXPECT_EQ(s, decompressed);
+
+  // A truncated stream is an error.
+  gzip::Decompressor truncated(gzip::appender(&decompressed));
+  ASSERT_SOME(truncated.write(compressed.substr(0, compressed.size() / 2)));
+  EXPECT_ERROR(truncated.finish());
+
+  // Corrupt data is an error.
+  gzip::Decompressor corrupt(gzip::appender(&decompressed));
+  EXPECT_ERROR(corrupt.write("not gzip at all"));
+  EXPECT_ERROR(corrupt.finish());
+
+  // Errors from the sink are propagated.
+  gzip::Compressor failing(&fail);
+  EXPECT_ERROR(failing.write(s));
+  EXPECT_ERROR(failing.finish());
+}
+
+
+TEST(GzipTest, StreamingConcatenated)
+{
+  Try<string> first = gzip::compress("hello ");
+  Try<string> second = gzip::compress("world");
+  ASSERT_SOME(first);
+  ASSERT_SOME(second);
+
+  string decompressed;
+  gzip::Decompressor decompressor(gzip::appender(&decompressed));
+  ASSERT_SOME(decompressor.write(first.get() + second.get()));
+  ASSERT_SOME(decompressor.finish());
+  EXPECT_EQ("hello world", decompressed);
+}
+
+
+TEST(GzipTest, StreamingFiles)
+{
+  Try<string> mkdtemp = os::mkdtemp();
+  ASSERT_SOME(mkdtemp);
+  const string& directory = mkdtemp.get();
+
+  string s;
+  while (s.length() < (4 * 1024 * 1024)) {
+    s.append(1, ' ' + (rand() % ('~' - ' ')));
+  }
+  ASSERT_SOME(os::write(directory + "/file", s));
+
+  Try<int> in = os::open(directory + "/file", O_RDONLY);
+  Try<int> out = os::open(
+      directory + "/file.gz", O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  ASSERT_SOME(in);
+  ASSERT_SOME(out);
+  ASSERT_SOME(gzip::compress(in.get(), out.get()));
+  os::close(in.get());
+  os::close(out.get());
+
+  in = os::open(directory + "/file.gz", O_RDONLY);
+  out = os::open(
+      directory + "/file.out", O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  ASSERT_SOME(in);
+  ASSERT_SOME(out);
+  ASSERT_SOME(gzip::decompress(in.get(), out.get()));
+  os::close(in.get());
+  os::close(out.get());
+
+  EXPECT_SOME_EQ(s, os::read(directory + "/file.out"));
+
+  ASSERT_SOME(os::rmdir(directory));
+}
+
+
+TEST(GzipTest, DISABLED_BENCHMARK_SmallCompressions)
+{
+  string s =
+    "{\"id\": 12345, \"name\": \"task-12345\", \"state\": \"RUNNING\", "
+    "\"resources\": {\"cpus\": 1.5, \"mem\": 1024}}";
+
+  const int iterations = 20000;
+
+  // A new stream (and output buffer) for every compression.
+  Stopwatch stopwatch;
+  stopwatch.start();
+  for (int i = 0; i < iterations; i++) {
+    string compressed;
+    gzip::Compressor compressor(gzip::appender(&compressed));
+    compressor.write(s);
+    compressor.finish();
+  }
+  stopwatch.stop();
+  Duration fresh = stopwatch.elapsed();
+
+  // Reusing the per-thread stream and the output buffer.
+  string compressed;
+  stopwatch.start();
+  for (int i = 0; i < iterations; i++) {
+    gzip::compress(s, &compressed);
+  }
+  stopwatch.stop();
+  Duration reused = stopwatch.elapsed();
+
+  cout << "Compressing " << s.length() << " bytes " << iterations
+       << " times took " << fresh << " with new streams and "
+       << reused << " reusing them" << endl;
+}
+
+
+TEST(GzipTest, DISABLED_BENCHMARK_ParallelCompress)
+{
+  string s = words(32 * 1024 * 1024);
+  string compressed;
+
+  Try<long> cpus = os::cpus();
+  ASSERT_SOME(cpus);
+
+  cout << "Using " << cpus.get() << " cpus" << endl;
+
+  for (size_t threads = 1; threads <= 8; threads *= 2) {
+    Stopwatch stopwatch;
+    stopwatch.start();
+    ASSERT_SOME(gzip::compress(s, &compressed, -1, threads));
+    stopwatch.stop();
+
+    cout << "Compressing " << s.size() / (1024 * 1024) << "MB on "
+         << threads << " threads: "
+         << s.size() / (1024 * 1024) / stopwatch.elapsed().secs() << " MB/s"
+         << ", ratio " << static_cast<double>(s.size()) / compressed.size()
+         << endl;
+  }
+}
 #endif // HAVE_LIBZ
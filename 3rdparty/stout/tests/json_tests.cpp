@@ -2,12 +2,25 @@
 
 #include <gmock/gmock.h>
 
+#include <math.h>
+#include <stdlib.h>
+
+#include <iostream>
 #include <string>
+#include <vector>
+
+#include <tr1/functional>
 
+#include <stout/gtest.hpp>
 #include <stout/json.hpp>
+#include <stout/os.hpp>
+#include <stout/stopwatch.hpp>
 #include <stout/stringify.hpp>
 
+using std::cout;
+using std::endl;
 using std::string;
+using std::vector;
 
 
 TEST(JsonTest, BinaryData)
@@ -17,3 +30,747 @@ TEST(JsonTest, BinaryData)
   EXPECT_EQ("\"\\\"\\\\\\/\\b\\f\\n\\r\\t\\u0000\\u0019 !#[]\\u007F\\u00FF\"",
             stringify(s));
 }
+
+// Records the parser's events as a string.
+class Recorder : public JSON::Handler
+{
+public:
+  virtual void null() { events += "null "; }
+  virtual void boolean(bool b) { events += b ? "true " : "false "; }
+  virtual void number(double d) { events += stringify(d) + " "; }
+
+  virtual void string(const char* data, size_t size)
+  {
+    events += "'" + std::string(data, size) + "' ";
+  }
+
+  virtual void beginObject() { events += "{ "; }
+  virtual void key(const char* data, size_t size)
+  {
+    events += std::string(data, size) + ": ";
+  }
+  virtual void endObject() { events += "} "; }
+
+  virtual void beginArray() { events += "[ "; }
+  virtual void endArray() { events += "] "; }
+
+  std::string events;
+};
+
+
+TEST(JsonTest, ParseEvents)
+{
+  Recorder recorder;
+  ASSERT_SOME(JSON::parse(
+      " {\"a\": [1, -2.5, true, false, null], \"b\" : {\"c\":\"d\"}, "
+      "\"e\": [], \"f\": {}}\n",
+      &recorder));
+
+  EXPECT_EQ("{ a: [ 1 -2.5 true false null ] b: { c: 'd' } "
+            "e: [ ] f: { } } ",
+            recorder.events);
+}
+
+
+TEST(JsonTest, Parse)
+{
+  Try<JSON::Value> value = JSON::parse(
+      "{\"name\": \"stout\", \"values\": [1, 2, {\"x\": null}], "
+      "\"ok\": true}");
+  ASSERT_SOME(value);
+
+  // Keys are rendered in sorted order.
+  EXPECT_EQ("{\"name\":\"stout\",\"ok\":true,"
+            "\"values\":[1,2,{\"x\":null}]}",
+            stringify(value.get()));
+
+  // Top level scalars are allowed.
+  EXPECT_EQ("\"x\"", stringify(JSON::parse("\"x\"").get()));
+  EXPECT_EQ("false", stringify(JSON::parse(" false ").get()));
+
+  // Duplicate keys, the last one wins.
+  EXPECT_EQ("{\"a\":2}", stringify(JSON::parse("{\"a\":1,\"a\":2}").get()));
+}
+
+
+static Try<double> number(const string& s)
+{
+  Try<JSON::Value> value = JSON::parse(s);
+  if (value.isError()) {
+    return Error(value.error());
+  }
+  return boost::get<JSON::Number>(value.get()).value;
+}
+
+
+TEST(JsonTest, ParseNumbers)
+{
+  EXPECT_SOME_EQ(0.0, number("0"));
+  EXPECT_SOME_EQ(-0.0, number("-0"));
+  EXPECT_SOME_EQ(123456789.0, number("123456789"));
+  EXPECT_SOME_EQ(-42.0, number("-42"));
+  EXPECT_SOME_EQ(0.5, number("0.5"));
+  EXPECT_SOME_EQ(1e10, number("1E10"));
+  EXPECT_SOME_EQ(1.5e-7, number("1.5e-7"));
+  EXPECT_SOME_EQ(2.5e+3, number("2.5e+3"));
+  EXPECT_SOME_EQ(9007199254740993.0, number("9007199254740993"));
+  EXPECT_SOME_EQ(1e300, number("1e300"));
+  EXPECT_SOME_EQ(4.9e-324, number("4.9e-324"));
+  EXPECT_SOME_EQ(0.1, number("0.1"));
+  EXPECT_SOME_EQ(
+      12345678901234567890123.0, number("12345678901234567890123"));
+
+  // Every number must be the correctly rounded double (like strtod).
+  for (int i = 0; i < 10000; i++) {
+    string s = stringify(rand()) + "." + stringify(rand() % 100000) +
+      "e" + stringify(rand() % 40 - 20);
+    ASSERT_SOME_EQ(strtod(s.c_str(), NULL), number(s)) << s;
+  }
+
+  EXPECT_ERROR(number("01"));
+  EXPECT_ERROR(number("1."));
+  EXPECT_ERROR(number(".5"));
+  EXPECT_ERROR(number("+1"));
+  EXPECT_ERROR(number("1e"));
+  EXPECT_ERROR(number("-"));
+}
+
+
+static Try<string> str(const string& s)
+{
+  Try<JSON::Value> value = JSON::parse(s);
+  if (value.isError()) {
+    return Error(value.error());
+  }
+  return boost::get<JSON::String>(value.get()).value;
+}
+
+
+TEST(JsonTest, ParseStrings)
+{
+  EXPECT_SOME_EQ("", str("\"\""));
+  EXPECT_SOME_EQ("plain text", str("\"plain text\""));
+  EXPECT_SOME_EQ("\"\\/\b\f\n\r\t", str("\"\\\"\\\\\\/\\b\\f\\n\\r\\t\""));
+  EXPECT_SOME_EQ(string("a\0b", 3), str("\"a\\u0000b\""));
+  EXPECT_SOME_EQ("\xC3\xA9", str("\"\\u00e9\""));
+  EXPECT_SOME_EQ("\xE2\x82\xAC", str("\"\\u20AC\""));
+  EXPECT_SOME_EQ("\xF0\x9F\x98\x80", str("\"\\ud83d\\ude00\""));
+  EXPECT_SOME_EQ("\xC3\xA9", str("\"\xC3\xA9\""));
+
+  // Long strings (so that the vectorized scan is used) with escapes
+  // in various positions.
+  string s(100, 'x');
+  for (size_t i = 0; i < s.size(); i++) {
+    string escaped = s;
+    escaped.replace(i, 1, "\\n");
+    string expected = s;
+    expected[i] = '\n';
+    ASSERT_SOME_EQ(expected, str("\"" + escaped + "\""));
+  }
+
+  EXPECT_ERROR(str("\"unterminated"));
+  EXPECT_ERROR(str("\"unterminated\\\""));
+  EXPECT_ERROR(str("\"bad \\x escape\""));
+  EXPECT_ERROR(str("\"bad \\u12 escape\""));
+  EXPECT_ERROR(str("\"\\ud83d\""));
+  EXPECT_ERROR(str("\"\\ude00\""));
+  EXPECT_ERROR(str("\"control \n character\""));
+}
+
+
+TEST(JsonTest, ParseErrors)
+{
+  EXPECT_ERROR(JSON::parse(""));
+  EXPECT_ERROR(JSON::parse("   "));
+  EXPECT_ERROR(JSON::parse("{"));
+  EXPECT_ERROR(JSON::parse("{\"a\"}"));
+  EXPECT_ERROR(JSON::parse("{\"a\":1,}"));
+  EXPECT_ERROR(JSON::parse("{a:1}"));
+  EXPECT_ERROR(JSON::parse("[1,]"));
+  EXPECT_ERROR(JSON::parse("[1 2]"));
+  EXPECT_ERROR(JSON::parse("tru"));
+  EXPECT_ERROR(JSON::parse("nul"));
+  EXPECT_ERROR(JSON::parse("[1] [2]"));
+  EXPECT_ERROR(JSON::parse(string(2000, '[') + string(2000, ']')));
+
+  Try<JSON::Value> value = JSON::parse("[1, 2, x]");
+  ASSERT_ERROR(value);
+  EXPECT_EQ("Expecting a value at offset 7", value.error());
+}
+
+
+// Returns a large (roughly "status" like) document.
+static string document(size_t size)
+{
+  string s = "{\"tasks\": [\n";
+  for (int i = 0; s.size() < size; i++) {
+    if (i > 0) {
+      s += ",\n";
+    }
+    s += "  {\"id\": \"task-" + stringify(i) + "\", "
+      "\"name\": \"A task with a somewhat long descriptive name\", "
+      "\"state\": \"TASK_RUNNING\", \"cpus\": " + stringify(i % 16 * 0.25) +
+      ", \"mem\": " + stringify(i * 1024) + ", \"healthy\": true, "
+      "\"labels\": [\"a\", \"b\\tc\"], \"executor\": null}";
+  }
+  s += "\n]}\n";
+  return s;
+}
+
+
+class Counter : public JSON::Handler
+{
+public:
+  Counter() : count(0) {}
+
+  virtual void null() { count++; }
+  virtual void boolean(bool) { count++; }
+  virtual void number(double) { count++; }
+  virtual void string(const char*, size_t) { count++; }
+
+  size_t count;
+};
+
+
+TEST(JsonTest, DISABLED_BENCHMARK_Parse)
+{
+  string s = document(32 * 1024 * 1024);
+  double megabytes = s.size() / (1024.0 * 1024.0);
+
+  Counter counter;
+
+  Stopwatch stopwatch;
+  stopwatch.start();
+  ASSERT_SOME(JSON::parse(s, &counter));
+  stopwatch.stop();
+
+  cout << "Parsed (events) " << counter.count << " values in "
+       << megabytes << "MB at " << megabytes / stopwatch.elapsed().secs()
+       << " MB/s" << endl;
+
+  stopwatch.start();
+  Try<JSON::Value> value = JSON::parse(s);
+  stopwatch.stop();
+  ASSERT_SOME(value);
+
+  cout << "Parsed (tree) " << megabytes << "MB at "
+       << megabytes / stopwatch.elapsed().secs() << " MB/s" << endl;
+}
+
+
+TEST(JsonTest, Document)
+{
+  JSON::Document document;
+  ASSERT_SOME(document.parse(
+      "{\"name\": \"stout\", \"version\": 0.1, \"header\": true, "
+      "\"tags\": [\"json\", null, false, {\"name\": \"x\"}], "
+      "\"empty\": {}, \"none\": []}"));
+
+  const JSON::Node& root = document.root();
+  ASSERT_TRUE(root.isObject());
+  ASSERT_EQ(6u, root.size());
+
+  // Members stay in the order they were in the text.
+  EXPECT_EQ("name", root.key(0));
+  EXPECT_EQ("none", root.key(5));
+
+  ASSERT_TRUE(root.find("name") != NULL);
+  EXPECT_EQ("stout", root.find("name")->string());
+  EXPECT_EQ(0.1, root.find("version")->number());
+  EXPECT_TRUE(root.find("header")->boolean());
+  EXPECT_TRUE(root.find("missing") == NULL);
+
+  const JSON::Node& tags = *root.find("tags");
+  ASSERT_TRUE(tags.isArray());
+  ASSERT_EQ(4u, tags.size());
+  EXPECT_EQ("json", tags.at(0).string());
+  EXPECT_TRUE(tags.at(1).isNull());
+  EXPECT_FALSE(tags.at(2).boolean());
+  EXPECT_EQ("x", tags.at(3).find("name")->string());
+
+  // Keys are interned.
+  EXPECT_EQ(root.keyData(0), tags.at(3).keyData(0));
+
+  EXPECT_EQ(0u, root.find("empty")->size());
+  EXPECT_EQ(0u, root.find("none")->size());
+
+  EXPECT_EQ("{\"name\":\"stout\",\"version\":0.1,\"header\":true,"
+            "\"tags\":[\"json\",null,false,{\"name\":\"x\"}],"
+            "\"empty\":{},\"none\":[]}",
+            stringify(root));
+
+  // Scalars at the top level and many distinct keys.
+  ASSERT_SOME(document.parse("\"a\\nb\""));
+  EXPECT_EQ("a\nb", document.root().string());
+
+  string s = "{";
+  for (int i = 0; i < 1000; i++) {
+    s += (i > 0 ? ",\"" : "\"") + stringify(i) + "\":" + stringify(i);
+  }
+  s += "}";
+  ASSERT_SOME(document.parse(s));
+  ASSERT_EQ(1000u, document.root().size());
+  for (int i = 0; i < 1000; i++) {
+    ASSERT_EQ(i, document.root().find(stringify(i))->number());
+  }
+
+  // Reusing a document doesn't keep the memory of previous parses.
+  const size_t memory = document.memory();
+  for (int i = 0; i < 10; i++) {
+    ASSERT_SOME(document.parse(s));
+  }
+  EXPECT_EQ(memory, document.memory());
+
+  ASSERT_SOME(document.parse("{\"a\": 1}"));
+  EXPECT_GT(memory, document.memory());
+  EXPECT_EQ(1, document.root().find("a")->number());
+
+  EXPECT_ERROR(document.parse("[1, 2"));
+  EXPECT_TRUE(document.root().isNull());
+}
+
+
+TEST(JsonTest, DISABLED_BENCHMARK_Document)
+{
+  string s = document(32 * 1024 * 1024);
+  double megabytes = s.size() / (1024.0 * 1024.0);
+
+  Stopwatch stopwatch;
+  stopwatch.start();
+  Try<JSON::Value> value = JSON::parse(s);
+  stopwatch.stop();
+  ASSERT_SOME(value);
+
+  cout << "Building a JSON::Value from " << megabytes << "MB took "
+       << stopwatch.elapsed() << endl;
+
+  JSON::Document document;
+
+  stopwatch.start();
+  ASSERT_SOME(document.parse(s));
+  stopwatch.stop();
+
+  cout << "Building a JSON::Document from " << megabytes << "MB took "
+       << stopwatch.elapsed() << " using "
+       << document.memory() / (1024.0 * 1024.0) << "MB" << endl;
+}
+
+
+static string render(double d)
+{
+  string s;
+  JSON::render(&s, JSON::Number(d));
+  return s;
+}
+
+
+TEST(JsonTest, RenderNumbers)
+{
+  EXPECT_EQ("0", render(0));
+  EXPECT_EQ("-0", render(-0.0));
+  EXPECT_EQ("42", render(42));
+  EXPECT_EQ("-1234567890123", render(-1234567890123.0));
+  EXPECT_EQ("0.1", render(0.1));
+  EXPECT_EQ("0.3333333333333333", render(1.0 / 3));
+  EXPECT_EQ("1e+20", render(1e20));
+  EXPECT_EQ("1.5e-07", render(1.5e-7));
+  EXPECT_EQ("1.7976931348623157e+308", render(1.7976931348623157e308));
+  EXPECT_EQ("null", render(NAN));
+  EXPECT_EQ("null", render(-INFINITY));
+
+  // Every number parses back to exactly the same value.
+  for (int i = 0; i < 10000; i++) {
+    double d = (rand() - RAND_MAX / 2) * pow(10, rand() % 40 - 20) / rand();
+    ASSERT_SOME_EQ(d, number(render(d))) << render(d);
+  }
+}
+
+
+TEST(JsonTest, Render)
+{
+  JSON::Object object;
+  object.values["a/b"] = JSON::String("x\ny");
+  object.values["empty"] = JSON::Array();
+  object.values["q\"uote"] = JSON::Object();
+
+  JSON::Array array;
+  array.values.push_back(JSON::Number(1));
+  array.values.push_back(JSON::True());
+  array.values.push_back(JSON::Null());
+  object.values["values"] = array;
+
+  string compact;
+  JSON::render(&compact, object);
+  EXPECT_EQ("{\"a\\/b\":\"x\\ny\",\"empty\":[],\"q\\\"uote\":{},"
+            "\"values\":[1,true,null]}",
+            compact);
+
+  // The ostream version renders the same.
+  EXPECT_EQ(compact, stringify(JSON::Value(object)));
+
+  string pretty;
+  JSON::render(&pretty, object, true);
+  EXPECT_EQ("{\n"
+            "  \"a\\/b\": \"x\\ny\",\n"
+            "  \"empty\": [],\n"
+            "  \"q\\\"uote\": {},\n"
+            "  \"values\": [\n"
+            "    1,\n"
+            "    true,\n"
+            "    null\n"
+            "  ]\n"
+            "}",
+            pretty);
+
+  // Both parse back to the same thing.
+  JSON::Document document;
+  ASSERT_SOME(document.parse(pretty));
+  string rendered;
+  JSON::render(&rendered, document.root());
+  EXPECT_EQ(compact, rendered);
+
+  rendered.clear();
+  JSON::render(&rendered, document.root(), true);
+  EXPECT_EQ(pretty, rendered);
+}
+
+
+static string render(const string& s)
+{
+  string rendered;
+  JSON::render(&rendered, JSON::String(s));
+  return rendered;
+}
+
+
+TEST(JsonTest, RenderUnicode)
+{
+  // Valid UTF-8 is passed through as is.
+  EXPECT_EQ("\"\xC3\xA9t\xC3\xA9\"", render("\xC3\xA9t\xC3\xA9"));
+  EXPECT_EQ("\"\xE2\x82\xAC\"", render("\xE2\x82\xAC"));
+  EXPECT_EQ("\"\xED\x9F\xBF\"", render("\xED\x9F\xBF"));
+  EXPECT_EQ("\"\xF0\x9F\x98\x80\"", render("\xF0\x9F\x98\x80"));
+  EXPECT_EQ("\"\xF4\x8F\xBF\xBF\"", render("\xF4\x8F\xBF\xBF"));
+
+  // Anything else is escaped byte by byte.
+  EXPECT_EQ("\"\\u0080\"", render("\x80"));               // Continuation.
+  EXPECT_EQ("\"\\u00C0\\u0080\"", render("\xC0\x80"));     // Overlong.
+  EXPECT_EQ("\"\\u00E0\\u0080\\u0080\"", render("\xE0\x80\x80"));
+  EXPECT_EQ("\"\\u00ED\\u00A0\\u0080\"", render("\xED\xA0\x80")); // Surrogate.
+  EXPECT_EQ("\"\\u00F4\\u0090\\u0080\\u0080\"",
+            render("\xF4\x90\x80\x80"));                   // > U+10FFFF.
+  EXPECT_EQ("\"\\u00E2\\u0082\"", render("\xE2\x82"));     // Truncated.
+  EXPECT_EQ("\"\\u00E2\\u0082x\"", render("\xE2\x82x"));
+  EXPECT_EQ("\"\\u00FF\"", render("\xFF"));
+
+  // Long strings (so that the vectorized scan is used) with a
+  // multibyte character in various positions round trip.
+  string s(100, 'x');
+  for (size_t i = 0; i < s.size(); i++) {
+    string expected = s;
+    expected.replace(i, 1, "\xE2\x82\xAC");
+    ASSERT_EQ("\"" + expected + "\"", render(expected));
+    ASSERT_SOME_EQ(expected, str(render(expected)));
+  }
+}
+
+
+TEST(JsonTest, DISABLED_BENCHMARK_RenderUnicode)
+{
+  // Mostly 2 and 3 byte characters with some ASCII mixed in.
+  const char* words[] = {
+    "\xD0\x9F\xD1\x80\xD0\xB8\xD0\xB2\xD0\xB5\xD1\x82",
+    "\xE4\xBD\xA0\xE5\xA5\xBD",
+    "caf\xC3\xA9",
+    "\xE3\x81\x93\xE3\x82\x93\xE3\x81\xAB\xE3\x81\xA1\xE3\x81\xAF",
+    "hello"
+  };
+
+  JSON::Array array;
+  size_t size = 0;
+  while (size < 16 * 1024 * 1024) {
+    string s;
+    for (int i = 0; i < 8; i++) {
+      s += words[rand() % (sizeof(words) / sizeof(words[0]))];
+      s += ' ';
+    }
+    size += s.size();
+    array.values.push_back(JSON::String(s));
+  }
+
+  string rendered;
+  Stopwatch stopwatch;
+  stopwatch.start();
+  JSON::render(&rendered, array);
+  stopwatch.stop();
+
+  double megabytes = size / (1024.0 * 1024.0);
+  cout << "Rendered " << megabytes << "MB of UTF-8 strings into "
+       << rendered.size() / (1024.0 * 1024.0) << "MB at "
+       << megabytes / stopwatch.elapsed().secs() << " MB/s" << endl;
+}
+
+
+TEST(JsonTest, DISABLED_BENCHMARK_Render)
+{
+  string s = document(32 * 1024 * 1024);
+
+  Try<JSON::Value> value = JSON::parse(s);
+  ASSERT_SOME(value);
+
+  JSON::Document document;
+  ASSERT_SOME(document.parse(s));
+
+  string rendered;
+  Stopwatch stopwatch;
+
+  stopwatch.start();
+  JSON::render(&rendered, value.get());
+  stopwatch.stop();
+
+  double megabytes = rendered.size() / (1024.0 * 1024.0);
+  cout << "Rendered a JSON::Value (" << megabytes << "MB) at "
+       << megabytes / stopwatch.elapsed().secs() << " MB/s" << endl;
+
+  rendered.clear();
+  stopwatch.start();
+  JSON::render(&rendered, document.root());
+  stopwatch.stop();
+
+  cout << "Rendered a JSON::Document (" << megabytes << "MB) at "
+       << megabytes / stopwatch.elapsed().secs() << " MB/s" << endl;
+
+  rendered.clear();
+  stopwatch.start();
+  JSON::render(&rendered, document.root(), true);
+  stopwatch.stop();
+
+  megabytes = rendered.size() / (1024.0 * 1024.0);
+  cout << "Rendered a pretty JSON::Document (" << megabytes << "MB) at "
+       << megabytes / stopwatch.elapsed().secs() << " MB/s" << endl;
+}
+
+
+TEST(JsonTest, Writer)
+{
+  JSON::Object object;
+  object.values["name"] = JSON::String("stout");
+  object.values["empty"] = JSON::Object();
+
+  JSON::Array array;
+  array.values.push_back(JSON::Number(1));
+  array.values.push_back(JSON::Number(2.5));
+  array.values.push_back(JSON::True());
+  array.values.push_back(JSON::Null());
+  array.values.push_back(JSON::Array());
+  object.values["values"] = array;
+
+  JSON::Object nested;
+  nested.values["a"] = JSON::False();
+  object.values["nested"] = nested;
+
+  // Written in the same (sorted) order as rendering a JSON::Object.
+  bool pretties[] = { false, true };
+  for (size_t i = 0; i < 2; i++) {
+    bool pretty = pretties[i];
+
+    string written;
+    JSON::Writer writer(&written, pretty);
+    ASSERT_SOME(writer.beginObject());
+    ASSERT_SOME(writer.key("empty"));
+    ASSERT_SOME(writer.beginObject());
+    ASSERT_SOME(writer.endObject());
+    ASSERT_SOME(writer.key("name"));
+    ASSERT_SOME(writer.value("stout"));
+    ASSERT_SOME(writer.key("nested"));
+    ASSERT_SOME(writer.value(JSON::Value(nested)));
+    ASSERT_SOME(writer.key("values"));
+    ASSERT_SOME(writer.beginArray());
+    ASSERT_SOME(writer.value(1));
+    ASSERT_SOME(writer.value(2.5));
+    ASSERT_SOME(writer.value(true));
+    ASSERT_SOME(writer.null());
+    ASSERT_SOME(writer.beginArray());
+    ASSERT_SOME(writer.endArray());
+    ASSERT_SOME(writer.endArray());
+    ASSERT_SOME(writer.endObject());
+    ASSERT_SOME(writer.finish());
+
+    string rendered;
+    JSON::render(&rendered, object, pretty);
+    EXPECT_EQ(rendered, written);
+  }
+
+  // A document node can be written too.
+  JSON::Document document;
+  ASSERT_SOME(document.parse(stringify(JSON::Value(object))));
+
+  string written;
+  JSON::Writer writer(&written, true);
+  ASSERT_SOME(writer.beginArray());
+  ASSERT_SOME(writer.value(document.root()));
+  ASSERT_SOME(writer.endArray());
+  ASSERT_SOME(writer.finish());
+
+  JSON::Array wrapped;
+  wrapped.values.push_back(object);
+
+  string rendered;
+  JSON::render(&rendered, wrapped, true);
+  EXPECT_EQ(rendered, written);
+}
+
+
+TEST(JsonTest, WriterErrors)
+{
+  string s;
+
+  {
+    JSON::Writer writer(&s);
+    EXPECT_ERROR(writer.finish());
+  }
+
+  {
+    JSON::Writer writer(&s);
+    ASSERT_SOME(writer.value(1));
+    EXPECT_ERROR(writer.value(2));
+    // Errors are sticky.
+    EXPECT_ERROR(writer.finish());
+  }
+
+  {
+    JSON::Writer writer(&s);
+    EXPECT_ERROR(writer.key("key"));
+  }
+
+  {
+    JSON::Writer writer(&s);
+    ASSERT_SOME(writer.beginObject());
+    EXPECT_ERROR(writer.value("value"));
+  }
+
+  {
+    JSON::Writer writer(&s);
+    ASSERT_SOME(writer.beginObject());
+    ASSERT_SOME(writer.key("key"));
+    EXPECT_ERROR(writer.key("key"));
+  }
+
+  {
+    JSON::Writer writer(&s);
+    ASSERT_SOME(writer.beginObject());
+    ASSERT_SOME(writer.key("key"));
+    EXPECT_ERROR(writer.endObject());
+  }
+
+  {
+    JSON::Writer writer(&s);
+    ASSERT_SOME(writer.beginArray());
+    EXPECT_ERROR(writer.endObject());
+  }
+
+  {
+    JSON::Writer writer(&s);
+    ASSERT_SOME(writer.beginArray());
+    EXPECT_ERROR(writer.finish());
+  }
+
+  {
+    JSON::Writer writer(&s);
+    ASSERT_SOME(writer.null());
+    ASSERT_SOME(writer.finish());
+    EXPECT_ERROR(writer.finish());
+  }
+}
+
+
+// Keeps each chunk the Writer flushes separately, so that the test
+// can check how much the Writer buffered.
+static Try<Nothing> keep(
+    vector<string>* chunks,
+    const char* data,
+    size_t size)
+{
+  chunks->push_back(string(data, size));
+  return Nothing();
+}
+
+
+static Try<Nothing> fail(const char* /*data*/, size_t /*size*/)
+{
+  return Error("Sink failed");
+}
+
+
+TEST(JsonTest, WriterSink)
+{
+  vector<string> chunks;
+
+  JSON::Writer writer(
+      std::tr1::bind(
+          &keep,
+          &chunks,
+          std::tr1::placeholders::_1,
+          std::tr1::placeholders::_2),
+      false,
+      1000);
+
+  JSON::Array array;
+
+  ASSERT_SOME(writer.beginArray());
+  for (int i = 0; i < 10000; i++) {
+    ASSERT_SOME(writer.value(i));
+    array.values.push_back(JSON::Number(i));
+  }
+
+  // Nothing more than the threshold (plus the last value) is buffered.
+  ASSERT_LT(9u, chunks.size());
+  for (size_t i = 0; i < chunks.size(); i++) {
+    EXPECT_GE(1000u + 6u, chunks[i].size());
+  }
+
+  ASSERT_SOME(writer.endArray());
+  ASSERT_SOME(writer.finish());
+
+  string written;
+  for (size_t i = 0; i < chunks.size(); i++) {
+    written += chunks[i];
+  }
+  EXPECT_EQ(stringify(JSON::Value(array)), written);
+
+  // Errors from the sink are returned (and sticky).
+  JSON::Writer failing(&fail, false, 10);
+  ASSERT_SOME(failing.beginArray());
+  EXPECT_ERROR(failing.value("more than ten bytes"));
+  EXPECT_ERROR(failing.endArray());
+}
+
+
+TEST(JsonTest, WriterFd)
+{
+  Try<string> mkdtemp = os::mkdtemp();
+  ASSERT_SOME(mkdtemp);
+  const string path = mkdtemp.get() + "/file";
+
+  Try<int> fd = os::open(
+      path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  ASSERT_SOME(fd);
+
+  JSON::Array array;
+
+  JSON::Writer writer(fd.get());
+  ASSERT_SOME(writer.beginArray());
+  for (int i = 0; i < 100000; i++) {
+    string s = "value " + stringify(i);
+    ASSERT_SOME(writer.value(s));
+    array.values.push_back(JSON::String(s));
+  }
+  ASSERT_SOME(writer.endArray());
+  ASSERT_SOME(writer.finish());
+
+  os::close(fd.get());
+
+  EXPECT_SOME_EQ(stringify(JSON::Value(array)), os::read(path));
+
+  ASSERT_SOME(os::rmdir(mkdtemp.get()));
+}
@@ -2,14 +2,26 @@
 
 #include <gmock/gmock.h>
 
+#include <pthread.h>
+#include <signal.h>
+
+#include <sys/resource.h>
+
 #include <cstdlib> // For rand.
+#include <iostream>
+#include <map>
+#include <set>
 #include <string>
+#include <vector>
+
+#include <tr1/functional>
 
 #include <stout/foreach.hpp>
 #include <stout/gtest.hpp>
 #include <stout/hashset.hpp>
 #include <stout/os.hpp>
 #include <stout/stopwatch.hpp>
+#include <stout/stringify.hpp>
 #include <stout/try.hpp>
 #include <stout/uuid.hpp>
 
@@ -19,7 +31,11 @@ using std::string;
 static hashset<string> listfiles(const string& directory)
 {
   hashset<string> fileset;
-  foreach (const string& file, os::ls(directory)) {
+  Try<std::list<string> > entries = os::ls(directory);
+  if (entries.isError()) {
+    return fileset;
+  }
+  foreach (const string& file, entries.get()) {
     fileset.insert(file);
   }
   return fileset;
@@ -130,6 +146,566 @@ TEST_F(OsTest, readWriteString)
 }
 
 
+TEST_F(OsTest, read)
+{
+  const string& testfile  = tmpdir + "/" + UUID::random().toString();
+  const string& teststr = "0123456789";
+
+  ASSERT_SOME(os::write(testfile, teststr));
+
+  Try<int> fd = os::open(testfile, O_RDONLY);
+  ASSERT_SOME(fd);
+
+  // Reading into a buffer stops short at EOF.
+  char buffer[16];
+  EXPECT_SOME_EQ(4u, os::read(fd.get(), buffer, 4));
+  EXPECT_EQ("0123", string(buffer, 4));
+
+  // The rest of the file is read from the current offset.
+  EXPECT_SOME_EQ("456789", os::read(fd.get()));
+  EXPECT_SOME_EQ(0u, os::read(fd.get(), buffer, sizeof(buffer)));
+
+  // Hitting EOF early restores the offset.
+  ASSERT_EQ(2, lseek(fd.get(), 2, SEEK_SET));
+  EXPECT_TRUE(os::read(fd.get(), 100).isNone());
+  EXPECT_SOME_EQ("2345", os::read(fd.get(), 4));
+
+  // Positional reads leave the offset alone.
+  EXPECT_SOME_EQ(3u, os::pread(fd.get(), buffer, 3, 7));
+  EXPECT_EQ("789", string(buffer, 3));
+  EXPECT_SOME_EQ("89", os::pread(fd.get(), 2, 8));
+  EXPECT_TRUE(os::pread(fd.get(), 3, 8).isNone());
+  EXPECT_EQ(6, lseek(fd.get(), 0, SEEK_CUR));
+
+  // Reading into a string replaces its contents.
+  string contents = "a much longer string than the file";
+  ASSERT_SOME(os::read(fd.get(), &contents));
+  EXPECT_EQ("6789", contents);
+
+  os::close(fd.get());
+
+  // Files bigger than the initial guess (and files without a size).
+  const string& bigstr = string(100000, 'x') + "y";
+  ASSERT_SOME(os::write(testfile, bigstr));
+  EXPECT_SOME_EQ(bigstr, os::read(testfile));
+
+#ifdef __linux__
+  ASSERT_SOME(os::read("/proc/self/status", &contents));
+  EXPECT_NE(string::npos, contents.find("Name:"));
+#endif // __linux__
+}
+
+
+TEST_F(OsTest, DISABLED_BENCHMARK_read)
+{
+  const string& testfile  = tmpdir + "/" + UUID::random().toString();
+  ASSERT_SOME(os::write(testfile, string(64 * 1024 * 1024, 'x')));
+
+  Stopwatch stopwatch;
+  stopwatch.start();
+  for (int i = 0; i < 10; i++) {
+    ASSERT_SOME(os::read(testfile));
+  }
+  stopwatch.stop();
+
+  std::cout << "Read a 64MB file 10 times in " << stopwatch.elapsed()
+            << std::endl;
+
+  const string& smallfile  = tmpdir + "/" + UUID::random().toString();
+  ASSERT_SOME(os::write(smallfile, string(100, 'x')));
+
+  string contents;
+  stopwatch.start();
+  for (int i = 0; i < 10000; i++) {
+    ASSERT_SOME(os::read(smallfile, &contents));
+  }
+  stopwatch.stop();
+
+  std::cout << "Read a small file 10000 times in " << stopwatch.elapsed()
+            << std::endl;
+}
+
+
+TEST_F(OsTest, MappedFile)
+{
+  const string& testfile  = tmpdir + "/" + UUID::random().toString();
+  const string& teststr = "line 1\nline 2\n";
+
+  ASSERT_SOME(os::write(testfile, teststr));
+
+  Try<os::MappedFile*> file = os::MappedFile::create(testfile);
+  ASSERT_SOME(file);
+
+  EXPECT_EQ(teststr.size(), file.get()->size());
+  EXPECT_EQ(teststr, string(file.get()->begin(), file.get()->end()));
+  EXPECT_EQ('l', (*file.get())[7]);
+
+  const char* newline = file.get()->find('\n');
+  ASSERT_TRUE(newline != NULL);
+  EXPECT_EQ(6, newline - file.get()->data());
+  EXPECT_EQ(13, file.get()->find('\n', 7) - file.get()->data());
+  EXPECT_TRUE(file.get()->find('x') == NULL);
+  EXPECT_TRUE(file.get()->find('\n', 100) == NULL);
+
+  EXPECT_EQ("line 2\n", file.get()->substr(7));
+  EXPECT_EQ("line", file.get()->substr(7, 4));
+  EXPECT_EQ("", file.get()->substr(teststr.size()));
+
+  EXPECT_SOME(file.get()->advise(os::MappedFile::SEQUENTIAL));
+  EXPECT_SOME(file.get()->advise(os::MappedFile::WILLNEED, 3, 5));
+  EXPECT_SOME(file.get()->advise(os::MappedFile::NORMAL));
+
+  delete file.get();
+
+  // Empty files can be mapped too.
+  ASSERT_SOME(os::write(testfile, ""));
+  file = os::MappedFile::create(testfile);
+  ASSERT_SOME(file);
+  EXPECT_TRUE(file.get()->empty());
+  EXPECT_TRUE(file.get()->find('\n') == NULL);
+  EXPECT_SOME(file.get()->advise(os::MappedFile::WILLNEED));
+  delete file.get();
+
+  EXPECT_ERROR(os::MappedFile::create(tmpdir + "/missing"));
+}
+
+
+TEST_F(OsTest, DISABLED_BENCHMARK_MappedFile)
+{
+  const string& testfile  = tmpdir + "/" + UUID::random().toString();
+
+  string line = string(99, 'x') + "\n";
+  string contents;
+  while (contents.size() < 64 * 1024 * 1024) {
+    contents += line;
+  }
+  ASSERT_SOME(os::write(testfile, contents));
+  contents.clear();
+
+  // Count the lines by reading the file into memory.
+  Stopwatch stopwatch;
+  stopwatch.start();
+  size_t lines = 0;
+  for (int i = 0; i < 10; i++) {
+    ASSERT_SOME(os::read(testfile, &contents));
+    for (size_t offset = contents.find('\n');
+         offset != string::npos;
+         offset = contents.find('\n', offset + 1)) {
+      lines++;
+    }
+  }
+  stopwatch.stop();
+
+  std::cout << "Counted " << lines << " lines with os::read in "
+            << stopwatch.elapsed() << std::endl;
+
+  // Count them again in place.
+  stopwatch.start();
+  lines = 0;
+  for (int i = 0; i < 10; i++) {
+    Try<os::MappedFile*> file = os::MappedFile::create(testfile);
+    ASSERT_SOME(file);
+    file.get()->advise(os::MappedFile::SEQUENTIAL);
+    for (const char* newline = file.get()->find('\n');
+         newline != NULL;
+         newline = file.get()->find('\n', newline - file.get()->data() + 1)) {
+      lines++;
+    }
+    delete file.get();
+  }
+  stopwatch.stop();
+
+  std::cout << "Counted " << lines << " lines with os::MappedFile in "
+            << stopwatch.elapsed() << std::endl;
+}
+
+
+TEST_F(OsTest, writev)
+{
+  const string& testfile  = tmpdir + "/" + UUID::random().toString();
+
+  // More buffers than can be written with a single writev, some of
+  // which are empty.
+  std::vector<string> buffers;
+  string expected;
+  for (int i = 0; i < 3000; i++) {
+    buffers.push_back(string(i % 7, 'a' + i % 26));
+    expected += buffers.back();
+  }
+
+  Try<int> fd = os::open(testfile, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+  ASSERT_SOME(fd);
+  ASSERT_SOME(os::writev(fd.get(), buffers));
+  ASSERT_SOME(os::writev(fd.get(), std::vector<string>()));
+  os::close(fd.get());
+
+  EXPECT_SOME_EQ(expected, os::read(testfile));
+
+  // Writing with sync.
+  ASSERT_SOME(os::write(testfile, "synced", true));
+  EXPECT_SOME_EQ("synced", os::read(testfile));
+}
+
+
+// Drains the pipe (rather than waiting for it to be writable).
+static Try<Nothing> drain(int fd, string* output, int* calls)
+{
+  char buffer[4096];
+  ssize_t length;
+  while ((length = ::read(fd, buffer, sizeof(buffer))) > 0) {
+    output->append(buffer, length);
+  }
+  (*calls)++;
+  return Nothing();
+}
+
+
+TEST_F(OsTest, writeNonblocking)
+{
+  int pipes[2];
+  ASSERT_NE(-1, pipe(pipes));
+  ASSERT_SOME(os::nonblock(pipes[0]));
+  ASSERT_SOME(os::nonblock(pipes[1]));
+
+  // Much more than the pipe's buffer.
+  string data;
+  while (data.size() < 1024 * 1024) {
+    data += stringify(data.size()) + " ";
+  }
+
+  string output;
+  int calls = 0;
+  ASSERT_SOME(os::write(
+      pipes[1],
+      data.data(),
+      data.size(),
+      std::tr1::bind(&drain, pipes[0], &output, &calls)));
+
+  drain(pipes[0], &output, &calls);
+  EXPECT_EQ(data, output);
+  EXPECT_LT(1, calls);
+
+  // The same goes for vectored writes.
+  std::vector<string> buffers(3, data);
+  output.clear();
+  ASSERT_SOME(os::writev(
+      pipes[1],
+      buffers,
+      std::tr1::bind(&drain, pipes[0], &output, &calls)));
+
+  drain(pipes[0], &output, &calls);
+  EXPECT_EQ(data + data + data, output);
+
+  close(pipes[0]);
+  close(pipes[1]);
+}
+
+
+TEST_F(OsTest, AsyncWriter)
+{
+  const string& testfile  = tmpdir + "/" + UUID::random().toString();
+
+  string expected;
+  for (int i = 0; i < 1000; i++) {
+    expected += stringify(i % 10);
+  }
+
+  // Test both the asynchronous (if supported) and synchronous paths.
+  for (int synchronous = 0; synchronous < 2; synchronous++) {
+    Try<int> fd = os::open(
+        testfile, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    ASSERT_SOME(fd);
+
+    // Few enough entries that queuing has to wait for completions.
+    Try<os::AsyncWriter*> writer = os::AsyncWriter::create(4, synchronous);
+    ASSERT_SOME(writer);
+
+    if (synchronous) {
+      EXPECT_FALSE(writer.get()->asynchronous());
+    }
+
+    // Write the chunks in reverse.
+    for (int i = 9; i >= 0; i--) {
+      ASSERT_SOME(writer.get()->write(
+          fd.get(), expected.data() + i * 100, 100, i * 100, i));
+    }
+    ASSERT_SOME(writer.get()->fsync(fd.get(), 10, true));
+    ASSERT_SOME(writer.get()->submit());
+
+    std::vector<os::AsyncWriter::Completion> completions;
+    while (completions.size() < 11) {
+      ASSERT_SOME(writer.get()->wait(1, &completions));
+    }
+    EXPECT_EQ(0u, writer.get()->pending());
+
+    std::set<uint64_t> tags;
+    foreach (const os::AsyncWriter::Completion& completion, completions) {
+      EXPECT_EQ(0, completion.error);
+      tags.insert(completion.tag);
+    }
+    EXPECT_EQ(11u, tags.size());
+
+    // The fsync only ran after the writes before it.
+    EXPECT_EQ(10u, completions.back().tag);
+
+    // Errors are reported per operation.
+    completions.clear();
+    ASSERT_SOME(writer.get()->write(-1, "x", 1, 0, 42));
+    ASSERT_SOME(writer.get()->wait(1, &completions));
+    ASSERT_EQ(1u, completions.size());
+    EXPECT_EQ(42u, completions[0].tag);
+    EXPECT_EQ(EBADF, completions[0].error);
+
+    delete writer.get();
+    os::close(fd.get());
+
+    EXPECT_SOME_EQ(expected, os::read(testfile));
+  }
+}
+
+
+TEST_F(OsTest, DISABLED_BENCHMARK_AsyncWriter)
+{
+  const string& testfile  = tmpdir + "/" + UUID::random().toString();
+  const string data(64 * 1024, 'x');
+  const int count = 1024;
+
+  Try<int> fd = os::open(
+      testfile, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  ASSERT_SOME(fd);
+
+  Stopwatch stopwatch;
+  stopwatch.start();
+  for (int i = 0; i < count; i++) {
+    ASSERT_SOME(os::pwrite(fd.get(), data.data(), data.size(),
+                           static_cast<off_t>(i) * data.size()));
+  }
+  ASSERT_EQ(0, fdatasync(fd.get()));
+  stopwatch.stop();
+
+  std::cout << "Wrote and synced " << count * data.size() / (1024 * 1024)
+            << "MB with os::pwrite in " << stopwatch.elapsed() << std::endl;
+
+  for (int synchronous = 0; synchronous < 2; synchronous++) {
+    Try<os::AsyncWriter*> writer = os::AsyncWriter::create(64, synchronous);
+    ASSERT_SOME(writer);
+
+    std::vector<os::AsyncWriter::Completion> completions;
+
+    stopwatch.start();
+    for (int i = 0; i < count; i++) {
+      ASSERT_SOME(writer.get()->write(
+          fd.get(),
+          data.data(),
+          data.size(),
+          static_cast<off_t>(i) * data.size(),
+          i));
+      if (i % 16 == 15) {
+        ASSERT_SOME(writer.get()->submit());
+      }
+    }
+    ASSERT_SOME(writer.get()->fsync(fd.get(), count, true));
+    ASSERT_SOME(writer.get()->wait(writer.get()->pending(), &completions));
+    stopwatch.stop();
+
+    ASSERT_EQ(static_cast<size_t>(count + 1), completions.size());
+
+    std::cout << "Wrote and synced " << count * data.size() / (1024 * 1024)
+              << "MB with os::AsyncWriter ("
+              << (writer.get()->asynchronous() ? "io_uring" : "synchronous")
+              << ") in " << stopwatch.elapsed() << std::endl;
+
+    delete writer.get();
+  }
+
+  os::close(fd.get());
+}
+
+
+TEST_F(OsTest, AsyncWriterShortWrite)
+{
+  const string& testfile  = tmpdir + "/" + UUID::random().toString();
+
+  // Limit the size of files so that a write gets cut short and then
+  // fails (rather than raising SIGXFSZ) when writing the rest.
+  struct rlimit limit;
+  ASSERT_EQ(0, ::getrlimit(RLIMIT_FSIZE, &limit));
+  struct rlimit small = limit;
+  small.rlim_cur = 100;
+  ASSERT_EQ(0, ::setrlimit(RLIMIT_FSIZE, &small));
+  sighandler_t handler = ::signal(SIGXFSZ, SIG_IGN);
+
+  const string data(200, 'x');
+
+  for (int synchronous = 0; synchronous < 2; synchronous++) {
+    Try<int> fd = os::open(
+        testfile, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    ASSERT_SOME(fd);
+
+    Try<os::AsyncWriter*> writer = os::AsyncWriter::create(4, synchronous);
+    ASSERT_SOME(writer);
+
+    ASSERT_SOME(writer.get()->write(fd.get(), data.data(), 200, 0, 1));
+    ASSERT_SOME(writer.get()->fsync(fd.get(), 2));
+
+    std::vector<os::AsyncWriter::Completion> completions;
+    while (completions.size() < 2) {
+      ASSERT_SOME(writer.get()->wait(1, &completions));
+    }
+
+    // The fsync still completes after (all of) the write.
+    ASSERT_EQ(2u, completions.size());
+    EXPECT_EQ(1u, completions[0].tag);
+    EXPECT_EQ(EFBIG, completions[0].error);
+    EXPECT_EQ(2u, completions[1].tag);
+    EXPECT_EQ(0, completions[1].error);
+
+    delete writer.get();
+    os::close(fd.get());
+
+    EXPECT_SOME_EQ(string(100, 'x'), os::read(testfile));
+  }
+
+  ::signal(SIGXFSZ, handler);
+  ASSERT_EQ(0, ::setrlimit(RLIMIT_FSIZE, &limit));
+}
+
+
+TEST_F(OsTest, writeAtomic)
+{
+  const string& testfile  = tmpdir + "/" + UUID::random().toString();
+
+  // Creating and replacing a file.
+  ASSERT_SOME(os::writeAtomic(testfile, "first"));
+  EXPECT_SOME_EQ("first", os::read(testfile));
+  ASSERT_SOME(os::writeAtomic(testfile, "second"));
+  EXPECT_SOME_EQ("second", os::read(testfile));
+
+  // No temporary files are left behind.
+  EXPECT_EQ(1u, listfiles(tmpdir).size());
+
+  // New files are at most 0644 and replaced files keep their mode.
+  struct stat s;
+  ASSERT_EQ(0, ::stat(testfile.c_str(), &s));
+  EXPECT_EQ(0u, s.st_mode & ~0644 & 07777);
+  ASSERT_EQ(0, ::chmod(testfile.c_str(), 0600));
+  ASSERT_SOME(os::writeAtomic(testfile, "second"));
+  ASSERT_EQ(0, ::stat(testfile.c_str(), &s));
+  EXPECT_EQ(0600u, s.st_mode & 07777);
+
+  // A batch of files in different directories.
+  ASSERT_SOME(os::mkdir(tmpdir + "/a"));
+  ASSERT_SOME(os::mkdir(tmpdir + "/b"));
+  {
+    os::AtomicWriter writer;
+    for (int i = 0; i < 10; i++) {
+      const string& directory = tmpdir + (i % 2 == 0 ? "/a" : "/b");
+      ASSERT_SOME(writer.write(directory + "/" + stringify(i), stringify(i)));
+    }
+
+    // Nothing is replaced until the commit.
+    EXPECT_FALSE(os::exists(tmpdir + "/a/0"));
+
+    ASSERT_SOME(writer.commit());
+  }
+
+  for (int i = 0; i < 10; i++) {
+    const string& directory = tmpdir + (i % 2 == 0 ? "/a" : "/b");
+    EXPECT_SOME_EQ(stringify(i), os::read(directory + "/" + stringify(i)));
+  }
+  EXPECT_EQ(5u, listfiles(tmpdir + "/a").size());
+  EXPECT_EQ(5u, listfiles(tmpdir + "/b").size());
+
+  // Uncommitted writes are discarded.
+  {
+    os::AtomicWriter writer;
+    ASSERT_SOME(writer.write(testfile, "third"));
+  }
+  EXPECT_SOME_EQ("second", os::read(testfile));
+  EXPECT_EQ(3u, listfiles(tmpdir).size());
+
+  // A failed commit doesn't leave temporary files either.
+  {
+    os::AtomicWriter writer;
+    ASSERT_SOME(writer.write(tmpdir + "/a/0", "zero"));
+    ASSERT_SOME(os::rmdir(tmpdir + "/a"));
+    EXPECT_ERROR(writer.commit());
+  }
+  EXPECT_EQ(2u, listfiles(tmpdir).size());
+
+  EXPECT_ERROR(os::writeAtomic(tmpdir + "/missing/file", "data"));
+}
+
+
+TEST_F(OsTest, DISABLED_BENCHMARK_writeAtomic)
+{
+  const int count = 100;
+  const string data(4096, 'x');
+
+  Stopwatch stopwatch;
+  stopwatch.start();
+  for (int i = 0; i < count; i++) {
+    ASSERT_SOME(os::writeAtomic(tmpdir + "/" + stringify(i), data));
+  }
+  stopwatch.stop();
+
+  std::cout << "Replaced " << count << " files one at a time in "
+            << stopwatch.elapsed() << std::endl;
+
+  stopwatch.start();
+  os::AtomicWriter writer;
+  for (int i = 0; i < count; i++) {
+    ASSERT_SOME(writer.write(tmpdir + "/" + stringify(i), data));
+  }
+  ASSERT_SOME(writer.commit());
+  stopwatch.stop();
+
+  std::cout << "Replaced " << count << " files in a batch in "
+            << stopwatch.elapsed() << std::endl;
+}
+
+
+TEST_F(OsTest, DirectoryReader)
+{
+  ASSERT_SOME(os::mkdir(tmpdir + "/directory"));
+  ASSERT_SOME(os::touch(tmpdir + "/file"));
+
+  // A small buffer to read the entries in a number of chunks.
+  for (int i = 0; i < 100; i++) {
+    ASSERT_SOME(os::touch(tmpdir + "/" + stringify(i)));
+  }
+
+  Try<os::DirectoryReader*> reader =
+    os::DirectoryReader::create(tmpdir, 512);
+  ASSERT_SOME(reader);
+
+  std::map<string, unsigned char> types;
+  os::DirectoryReader::Entry entry;
+  while (reader.get()->next(&entry)) {
+    types[entry.name] = entry.type;
+    EXPECT_NE(0u, entry.inode);
+  }
+  EXPECT_TRUE(reader.get()->error().isNone());
+  EXPECT_FALSE(reader.get()->next(&entry));
+  delete reader.get();
+
+  EXPECT_EQ(102u, types.size());
+  EXPECT_EQ(DT_DIR, types["directory"]);
+  EXPECT_EQ(DT_REG, types["file"]);
+  EXPECT_EQ(0u, types.count("."));
+  EXPECT_EQ(0u, types.count(".."));
+
+  Try<std::list<string> > entries = os::ls(tmpdir);
+  ASSERT_SOME(entries);
+  EXPECT_EQ(102u, entries.get().size());
+
+  EXPECT_ERROR(os::DirectoryReader::create(tmpdir + "/missing"));
+  EXPECT_ERROR(os::DirectoryReader::create(tmpdir + "/file"));
+  EXPECT_ERROR(os::ls(tmpdir + "/missing"));
+  EXPECT_ERROR(os::ls(tmpdir + "/file"));
+}
+
+
 TEST_F(OsTest, find)
 {
   const string& testdir = tmpdir + "/" + UUID::random().toString();
@@ -157,6 +733,161 @@ TEST_F(OsTest, find)
   ASSERT_EQ(2u, files.size());
   ASSERT_TRUE(files.contains(file1));
   ASSERT_TRUE(files.contains(file2));
+
+  // The same with a wildcard, a regular expression and more threads.
+  result = os::find(testdir, "*.txt", os::WILDCARD);
+  ASSERT_SOME(result);
+  EXPECT_EQ(2u, result.get().size());
+
+  result = os::find(testdir + "/", "^file[23]", os::REGEX, 4);
+  ASSERT_SOME(result);
+  files.clear();
+  foreach (const string& file, result.get()) {
+    files.insert(file);
+  }
+  ASSERT_EQ(2u, files.size());
+  ASSERT_TRUE(files.contains(file2));
+  ASSERT_TRUE(files.contains(file3));
+
+  EXPECT_ERROR(os::find(testdir, "(", os::REGEX));
+  EXPECT_ERROR(os::find(file1, ".txt"));
+}
+
+
+// Collects what walk visits, pruning directories named "prune".
+struct Collector
+{
+  bool operator () (const string& path, unsigned char type)
+  {
+    pthread_mutex_lock(mutex);
+    (*types)[path] = type;
+    pthread_mutex_unlock(mutex);
+    return path.substr(path.rfind('/') + 1) != "prune";
+  }
+
+  pthread_mutex_t* mutex;
+  std::map<string, unsigned char>* types;
+};
+
+
+TEST_F(OsTest, walk)
+{
+  ASSERT_SOME(os::mkdir(tmpdir + "/a/b/c"));
+  ASSERT_SOME(os::mkdir(tmpdir + "/a/prune/d"));
+  ASSERT_SOME(os::touch(tmpdir + "/a/b/file"));
+  ASSERT_SOME(os::touch(tmpdir + "/a/prune/file"));
+  ASSERT_EQ(0, symlink("a", (tmpdir + "/link").c_str()));
+
+  pthread_mutex_t mutex;
+  pthread_mutex_init(&mutex, NULL);
+
+  for (size_t threads = 1; threads <= 4; threads *= 2) {
+    std::map<string, unsigned char> types;
+
+    Collector collector;
+    collector.mutex = &mutex;
+    collector.types = &types;
+
+    ASSERT_SOME(os::walk(tmpdir, collector, threads));
+
+    std::map<string, unsigned char> expected;
+    expected[tmpdir + "/a"] = DT_DIR;
+    expected[tmpdir + "/a/b"] = DT_DIR;
+    expected[tmpdir + "/a/b/c"] = DT_DIR;
+    expected[tmpdir + "/a/b/file"] = DT_REG;
+    expected[tmpdir + "/a/prune"] = DT_DIR;
+    expected[tmpdir + "/link"] = DT_LNK;
+
+    EXPECT_EQ(expected, types);
+  }
+
+  std::map<string, unsigned char> types;
+  Collector collector;
+  collector.mutex = &mutex;
+  collector.types = &types;
+  EXPECT_ERROR(os::walk(tmpdir + "/missing", collector));
+
+  // The directory being walked can be a symbolic link.
+  ASSERT_SOME(os::walk(tmpdir + "/link", collector));
+  EXPECT_EQ(DT_REG, types[tmpdir + "/link/b/file"]);
+
+  Try<std::list<string> > found = os::find(tmpdir + "/link", "file");
+  ASSERT_SOME(found);
+  EXPECT_EQ(2u, found.get().size());
+
+  // A wider tree keeps several threads busy (and idle) at once.
+  for (int i = 0; i < 100; i++) {
+    const string& directory = tmpdir + "/wide/" + stringify(i);
+    ASSERT_SOME(os::mkdir(directory + "/sub"));
+    ASSERT_SOME(os::touch(directory + "/sub/file"));
+  }
+
+  for (size_t threads = 1; threads <= 8; threads *= 2) {
+    types.clear();
+    ASSERT_SOME(os::walk(tmpdir + "/wide", collector, threads));
+    EXPECT_EQ(300u, types.size());
+  }
+
+  pthread_mutex_destroy(&mutex);
+}
+
+
+// The way os::find used to work: recursing with os::ls and stat'ing
+// each entry.
+static size_t count(const string& directory)
+{
+  Try<std::list<string> > entries = os::ls(directory);
+  CHECK(entries.isSome());
+
+  size_t files = 0;
+  foreach (const string& entry, entries.get()) {
+    const string& path = directory + "/" + entry;
+    if (os::isdir(path) && !os::islink(path)) {
+      files += count(path);
+    } else {
+      files++;
+    }
+  }
+  return files;
+}
+
+
+TEST_F(OsTest, DISABLED_BENCHMARK_find)
+{
+  // 100 directories of 10 directories of 50 files each.
+  for (int i = 0; i < 100; i++) {
+    for (int j = 0; j < 10; j++) {
+      const string& directory =
+        tmpdir + "/" + stringify(i) + "/" + stringify(j);
+      ASSERT_SOME(os::mkdir(directory));
+      for (int k = 0; k < 50; k++) {
+        ASSERT_SOME(os::touch(directory + "/" + stringify(k) + ".txt"));
+      }
+    }
+  }
+
+  Stopwatch stopwatch;
+  stopwatch.start();
+  size_t files = count(tmpdir);
+  stopwatch.stop();
+
+  std::cout << "Found " << files << " files with os::ls and stat in "
+            << stopwatch.elapsed() << std::endl;
+
+  size_t threads[] = { 1, 2, 4 };
+  for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+    stopwatch.start();
+    Try<std::list<string> > result =
+      os::find(tmpdir, ".txt", os::SUBSTRING, threads[i]);
+    stopwatch.stop();
+
+    ASSERT_SOME(result);
+    EXPECT_EQ(files, result.get().size());
+
+    std::cout << "Found " << result.get().size() << " files with os::find "
+              << "using " << threads[i] << " thread(s) in "
+              << stopwatch.elapsed() << std::endl;
+  }
 }
 
 
@@ -16,21 +16,33 @@
  * limitations under the License.
  */
 
+#include <fcntl.h> // For AT_FDCWD.
+#include <string.h> // For strerror.
 #include <unistd.h> // For getpid, getppid.
 
 #include <gmock/gmock.h>
 
+#include <iostream>
+#include <list>
 #include <set>
+#include <string>
 
+#include <stout/foreach.hpp>
 #include <stout/gtest.hpp>
+#include <stout/numify.hpp>
+#include <stout/os.hpp>
 #include <stout/proc.hpp>
+#include <stout/stopwatch.hpp>
 #include <stout/try.hpp>
 
 using proc::CPU;
 using proc::SystemStatus;
 using proc::ProcessStatus;
 
+using std::cout;
+using std::endl;
 using std::set;
+using std::string;
 
 
 TEST(ProcTest, pids)
@@ -44,6 +56,41 @@ TEST(ProcTest, pids)
 }
 
 
+TEST(ProcTest, DISABLED_BENCHMARK_pids)
+{
+  const int count = 1000;
+
+  // The way proc::pids used to work.
+  Stopwatch stopwatch;
+  stopwatch.start();
+  for (int i = 0; i < count; i++) {
+    Try<std::list<string> > files = os::ls("/proc");
+    ASSERT_SOME(files);
+
+    set<pid_t> pids;
+    foreach (const string& file, files.get()) {
+      Try<pid_t> pid = numify<pid_t>(file);
+      if (pid.isSome()) {
+        pids.insert(pid.get());
+      }
+    }
+  }
+  stopwatch.stop();
+
+  cout << "Listed pids " << count << " times with os::ls and numify in "
+       << stopwatch.elapsed() << endl;
+
+  stopwatch.start();
+  for (int i = 0; i < count; i++) {
+    ASSERT_SOME(proc::pids());
+  }
+  stopwatch.stop();
+
+  cout << "Listed pids " << count << " times with proc::pids in "
+       << stopwatch.elapsed() << endl;
+}
+
+
 TEST(ProcTest, children)
 {
   Try<set<pid_t> > children = proc::children(getpid());
@@ -160,3 +207,118 @@ TEST(ProcTest, ProcessStatus)
   EXPECT_EQ(getpid(), status.get().pid);
   EXPECT_EQ(getppid(), status.get().ppid);
 }
+
+
+TEST(ProcTest, ProcessStatusParse)
+{
+  // Command names can contain spaces and parentheses.
+  const string stat =
+    "42 (a (b) c) S 1 42 42 0 -1 4194560 100 0 0 0 7 3 0 0 20 0 1 0 "
+    "1234 5678 90 18446744073709551615 1 2 3 4 5 6 7 8 9 10 11 12 17 0 "
+    "0 0 0 0 0\n";
+
+  Option<ProcessStatus> status =
+    proc::internal::parse(stat.data(), stat.size());
+
+  ASSERT_TRUE(status.isSome());
+  EXPECT_EQ(42, status.get().pid);
+  EXPECT_EQ("(a (b) c)", status.get().comm);
+  EXPECT_EQ('S', status.get().state);
+  EXPECT_EQ(1, status.get().ppid);
+  EXPECT_EQ(-1, status.get().tpgid);
+  EXPECT_EQ(7u, status.get().utime);
+  EXPECT_EQ(3u, status.get().stime);
+  EXPECT_EQ(20, status.get().priority);
+  EXPECT_EQ(1234u, status.get().starttime);
+  EXPECT_EQ(5678u, status.get().vsize);
+  EXPECT_EQ(90, status.get().rss);
+  EXPECT_EQ(3u, status.get().startstack);
+  EXPECT_EQ(5u, status.get().kstkeip);
+  EXPECT_EQ(6u, status.get().signal);
+  EXPECT_EQ(7u, status.get().blocked);
+  EXPECT_EQ(9u, status.get().sigcatch);
+  EXPECT_EQ(10u, status.get().wchan);
+  EXPECT_EQ(11u, status.get().nswap);
+  EXPECT_EQ(12u, status.get().cnswap);
+
+  // Truncated.
+  EXPECT_TRUE(proc::internal::parse(stat.data(), 40).isNone());
+  EXPECT_TRUE(proc::internal::parse("42 (a", 5).isNone());
+}
+
+
+TEST(ProcTest, Snapshot)
+{
+  for (size_t threads = 1; threads <= 4; threads *= 2) {
+    Try<proc::Snapshot*> snapshot = proc::Snapshot::create(threads);
+    ASSERT_SOME(snapshot);
+
+    EXPECT_EQ(1u, snapshot.get()->pids().count(getpid()));
+    EXPECT_EQ(1u, snapshot.get()->pids().count(1));
+    EXPECT_EQ(snapshot.get()->size(), snapshot.get()->pids().size());
+
+    Option<ProcessStatus> status = snapshot.get()->status(getpid());
+    ASSERT_TRUE(status.isSome());
+    EXPECT_EQ(getppid(), status.get().ppid);
+
+    EXPECT_EQ(1u, snapshot.get()->children(getppid(), false).count(getpid()));
+    EXPECT_EQ(1u, snapshot.get()->children(0).count(getpid()));
+    EXPECT_TRUE(snapshot.get()->status(-1).isNone());
+
+    delete snapshot.get();
+  }
+}
+
+
+TEST(ProcTest, DISABLED_BENCHMARK_Snapshot)
+{
+  const int count = 100;
+
+  // The way proc::children used to get the processes.
+  Stopwatch stopwatch;
+  stopwatch.start();
+  size_t processes = 0;
+  for (int i = 0; i < count; i++) {
+    Try<set<pid_t> > pids = proc::pids();
+    ASSERT_SOME(pids);
+    foreach (pid_t pid, pids.get()) {
+      processes += proc::status(pid).isSome();
+    }
+  }
+  stopwatch.stop();
+
+  cout << "Read " << processes / count << " processes " << count
+       << " times with proc::status in " << stopwatch.elapsed() << endl;
+
+  size_t threads[] = { 1, 4 };
+  for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+    stopwatch.start();
+    for (int j = 0; j < count; j++) {
+      Try<proc::Snapshot*> snapshot = proc::Snapshot::create(threads[i]);
+      ASSERT_SOME(snapshot);
+      snapshot.get()->children(1);
+      delete snapshot.get();
+    }
+    stopwatch.stop();
+
+    cout << "Took " << count << " snapshots with " << threads[i]
+         << " thread(s) in " << stopwatch.elapsed() << endl;
+  }
+}
+
+
+TEST(ProcTest, ProcessStatusRead)
+{
+  Result<ProcessStatus> status =
+    proc::internal::status(AT_FDCWD, "/proc/self/stat");
+  ASSERT_SOME(status);
+  EXPECT_EQ(getpid(), status.get().pid);
+
+  // A process that doesn't exist isn't an error, unlike a file that
+  // can't be read (e.g., a directory).
+  EXPECT_TRUE(proc::internal::status(AT_FDCWD, "/proc/0/stat").isNone());
+
+  status = proc::internal::status(AT_FDCWD, "/proc/self");
+  ASSERT_ERROR(status);
+  EXPECT_NE(string::npos, status.error().find(strerror(EISDIR)));
+}
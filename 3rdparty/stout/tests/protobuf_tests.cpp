@@ -0,0 +1,767 @@
+#include <gtest/gtest.h>
+
+#include <gmock/gmock.h>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+
+#include <pthread.h>
+
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <stout/gtest.hpp>
+#include <stout/json.hpp>
+#include <stout/os.hpp>
+#include <stout/protobuf.hpp>
+#include <stout/stopwatch.hpp>
+#include <stout/stringify.hpp>
+
+using google::protobuf::DescriptorProto;
+using google::protobuf::FieldDescriptorProto;
+using google::protobuf::FileDescriptorProto;
+using google::protobuf::UninterpretedOption;
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+
+// Returns a (reasonably large) message with most kinds of fields: the
+// description of descriptor.proto itself.
+static FileDescriptorProto descriptor()
+{
+  FileDescriptorProto file;
+  FileDescriptorProto::descriptor()->file()->CopyTo(&file);
+  return file;
+}
+
+
+// Writes 'count' messages (of increasing size) to the file.
+static void write(const string& path, int count)
+{
+  Try<int> fd = os::open(
+      path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  ASSERT_SOME(fd);
+
+  for (int i = 0; i < count; i++) {
+    FieldDescriptorProto field;
+    field.set_name("field" + string(i % 1000, 'x'));
+    field.set_number(i);
+    ASSERT_SOME(protobuf::write(fd.get(), field));
+  }
+
+  os::close(fd.get());
+}
+
+
+TEST(ProtobufTest, Reader)
+{
+  Try<string> mkdtemp = os::mkdtemp();
+  ASSERT_SOME(mkdtemp);
+  const string path = mkdtemp.get() + "/file";
+
+  write(path, 2000);
+
+  // Use buffers smaller than, and bigger than, the messages.
+  size_t sizes[] = { 16, 512, 64 * 1024 };
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    Try<int> fd = os::open(path, O_RDONLY);
+    ASSERT_SOME(fd);
+
+    protobuf::Reader<FieldDescriptorProto> reader(fd.get(), sizes[i]);
+    for (int j = 0; j < 2000; j++) {
+      Result<FieldDescriptorProto> field = reader.read();
+      ASSERT_SOME(field);
+      EXPECT_EQ(j, field.get().number());
+    }
+    EXPECT_TRUE(reader.read().isNone());
+
+    // The offset is left at the end of the file.
+    EXPECT_SOME_EQ(lseek(fd.get(), 0, SEEK_END), reader.offset());
+    EXPECT_EQ(lseek(fd.get(), 0, SEEK_END), lseek(fd.get(), 0, SEEK_CUR));
+
+    os::close(fd.get());
+  }
+
+  // Truncate the file in the middle of the last message.
+  Try<int> fd = os::open(path, O_RDWR);
+  ASSERT_SOME(fd);
+  off_t size = lseek(fd.get(), 0, SEEK_END);
+  ASSERT_EQ(0, ftruncate(fd.get(), size - 10));
+  lseek(fd.get(), 0, SEEK_SET);
+
+  protobuf::Reader<FieldDescriptorProto> reader(fd.get(), 1024);
+  for (int i = 0; i < 1999; i++) {
+    ASSERT_SOME(reader.read());
+  }
+
+  Option<off_t> offset = reader.offset();
+  ASSERT_SOME(offset);
+  EXPECT_ERROR(reader.read());
+
+  // The file offset is restored to the start of the truncated message.
+  EXPECT_EQ(offset.get(), lseek(fd.get(), 0, SEEK_CUR));
+  EXPECT_SOME_EQ(offset.get(), reader.offset());
+
+  // Which is where the plain 'read' fails as well.
+  EXPECT_ERROR(protobuf::read<FieldDescriptorProto>(fd.get()));
+
+  // A partially written size is treated as the end of the file.
+  ASSERT_EQ(0, ftruncate(fd.get(), offset.get() + 2));
+  EXPECT_TRUE(reader.read().isNone());
+  EXPECT_EQ(offset.get(), lseek(fd.get(), 0, SEEK_CUR));
+
+  os::close(fd.get());
+
+  ASSERT_SOME(os::rmdir(mkdtemp.get()));
+}
+
+
+TEST(ProtobufTest, DISABLED_BENCHMARK_Reader)
+{
+  Try<string> mkdtemp = os::mkdtemp();
+  ASSERT_SOME(mkdtemp);
+  const string path = mkdtemp.get() + "/file";
+
+  const int count = 200000;
+  write(path, count);
+
+  Try<int> fd = os::open(path, O_RDONLY);
+  ASSERT_SOME(fd);
+
+  Stopwatch stopwatch;
+  stopwatch.start();
+  for (int i = 0; i < count; i++) {
+    ASSERT_SOME(protobuf::read<FieldDescriptorProto>(fd.get()));
+  }
+  stopwatch.stop();
+
+  cout << "Read " << count << " messages with protobuf::read in "
+       << stopwatch.elapsed() << endl;
+
+  lseek(fd.get(), 0, SEEK_SET);
+
+  stopwatch.start();
+  protobuf::Reader<FieldDescriptorProto> reader(fd.get());
+  for (int i = 0; i < count; i++) {
+    ASSERT_SOME(reader.read());
+  }
+  stopwatch.stop();
+
+  cout << "Read " << count << " messages with protobuf::Reader in "
+       << stopwatch.elapsed() << endl;
+
+  os::close(fd.get());
+
+  ASSERT_SOME(os::rmdir(mkdtemp.get()));
+}
+
+
+TEST(ProtobufTest, Records)
+{
+  Try<string> mkdtemp = os::mkdtemp();
+  ASSERT_SOME(mkdtemp);
+  const string path = mkdtemp.get() + "/file";
+
+  EXPECT_ERROR(protobuf::Records<FieldDescriptorProto>::create(path));
+
+  ASSERT_SOME(os::write(path, ""));
+
+  Try<protobuf::Records<FieldDescriptorProto>*> records =
+    protobuf::Records<FieldDescriptorProto>::create(path);
+  ASSERT_SOME(records);
+  EXPECT_EQ(0u, records.get()->size());
+  EXPECT_EQ(0u, records.get()->end());
+  delete records.get();
+
+  write(path, 2000);
+
+  records = protobuf::Records<FieldDescriptorProto>::create(path);
+  ASSERT_SOME(records);
+  ASSERT_EQ(2000u, records.get()->size());
+
+  Try<int> fd = os::open(path, O_RDWR);
+  ASSERT_SOME(fd);
+  off_t size = lseek(fd.get(), 0, SEEK_END);
+  EXPECT_EQ(size, static_cast<off_t>(records.get()->end()));
+
+  // Access the messages out of order.
+  for (int i = 0; i < 2000; i++) {
+    int index = (i * 7919) % 2000;
+    Try<FieldDescriptorProto> field = records.get()->get(index);
+    ASSERT_SOME(field);
+    EXPECT_EQ(index, field.get().number());
+  }
+
+  delete records.get();
+
+  // Only complete messages are indexed.
+  ASSERT_EQ(0, ftruncate(fd.get(), size - 10));
+  os::close(fd.get());
+
+  records = protobuf::Records<FieldDescriptorProto>::create(path);
+  ASSERT_SOME(records);
+  EXPECT_EQ(1999u, records.get()->size());
+
+  // The same place the buffered reader stops.
+  fd = os::open(path, O_RDONLY);
+  ASSERT_SOME(fd);
+  protobuf::Reader<FieldDescriptorProto> reader(fd.get());
+  for (int i = 0; i < 1999; i++) {
+    ASSERT_SOME(reader.read());
+  }
+  EXPECT_SOME_EQ(static_cast<off_t>(records.get()->end()), reader.offset());
+  os::close(fd.get());
+
+  delete records.get();
+
+  ASSERT_SOME(os::rmdir(mkdtemp.get()));
+}
+
+
+// Parses every 'stride'th message (starting at 'start') of some
+// records, counting the bytes in their names.
+struct Replay
+{
+  const protobuf::Records<FieldDescriptorProto>* records;
+  size_t start;
+  size_t stride;
+  size_t bytes;
+};
+
+
+static void* replay(void* arg)
+{
+  Replay* replay = static_cast<Replay*>(arg);
+  FieldDescriptorProto field;
+  size_t bytes = 0;
+  for (size_t i = replay->start;
+       i < replay->records->size();
+       i += replay->stride) {
+    CHECK(replay->records->get(i, &field).isSome());
+    bytes += field.name().size();
+  }
+  replay->bytes = bytes;
+  return NULL;
+}
+
+
+TEST(ProtobufTest, DISABLED_BENCHMARK_Records)
+{
+  Try<string> mkdtemp = os::mkdtemp();
+  ASSERT_SOME(mkdtemp);
+  const string path = mkdtemp.get() + "/file";
+
+  write(path, 200000);
+
+  Stopwatch stopwatch;
+  stopwatch.start();
+  Try<protobuf::Records<FieldDescriptorProto>*> records =
+    protobuf::Records<FieldDescriptorProto>::create(path);
+  ASSERT_SOME(records);
+  stopwatch.stop();
+
+  cout << "Indexed " << records.get()->size() << " messages in "
+       << stopwatch.elapsed() << endl;
+
+  size_t counts[] = { 1, 2, 4, 8 };
+  size_t expected = 0;
+
+  for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+    vector<Replay> replays(counts[i]);
+    vector<pthread_t> threads(counts[i]);
+
+    stopwatch.start();
+    for (size_t j = 0; j < counts[i]; j++) {
+      replays[j].records = records.get();
+      replays[j].start = j;
+      replays[j].stride = counts[i];
+      replays[j].bytes = 0;
+      ASSERT_EQ(0, pthread_create(&threads[j], NULL, replay, &replays[j]));
+    }
+
+    size_t bytes = 0;
+    for (size_t j = 0; j < counts[i]; j++) {
+      ASSERT_EQ(0, pthread_join(threads[j], NULL));
+      bytes += replays[j].bytes;
+    }
+    stopwatch.stop();
+
+    // Every thread count parses the same messages.
+    if (i == 0) {
+      expected = bytes;
+    }
+    EXPECT_EQ(expected, bytes);
+
+    cout << "Parsed " << records.get()->size() << " mapped messages with "
+         << counts[i] << " thread(s) in " << stopwatch.elapsed() << endl;
+  }
+
+  delete records.get();
+
+  ASSERT_SOME(os::rmdir(mkdtemp.get()));
+}
+
+
+TEST(ProtobufTest, Log)
+{
+  Try<string> mkdtemp = os::mkdtemp();
+  ASSERT_SOME(mkdtemp);
+  const string path = mkdtemp.get() + "/log";
+
+  Try<int> fd = os::open(
+      path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  ASSERT_SOME(fd);
+
+  {
+    protobuf::LogWriter writer(fd.get());
+    for (int i = 0; i < 1000; i++) {
+      FieldDescriptorProto field;
+      field.set_name("field" + string(i, 'x'));
+      field.set_number(i);
+      ASSERT_SOME(writer.append(field, i % 100 == 0));
+    }
+
+    // Uninitialized messages are rejected.
+    UninterpretedOption::NamePart part;
+    EXPECT_ERROR(writer.append(part));
+
+    ASSERT_SOME(writer.sync());
+  }
+
+  const off_t size = lseek(fd.get(), 0, SEEK_END);
+  lseek(fd.get(), 0, SEEK_SET);
+
+  off_t last = 0; // Offset of the last record.
+  {
+    protobuf::LogReader<FieldDescriptorProto> reader(fd.get(), 1024);
+    for (int i = 0; i < 1000; i++) {
+      last = reader.offset().get();
+      Result<FieldDescriptorProto> field = reader.read();
+      ASSERT_SOME(field);
+      EXPECT_EQ(i, field.get().number());
+    }
+    EXPECT_TRUE(reader.read().isNone());
+    EXPECT_SOME_EQ(size, reader.offset());
+  }
+
+  // A corrupted record is an error, the file offset is left at the
+  // start of the record.
+  ASSERT_EQ(1, pwrite(fd.get(), "?", 1, last - 100));
+  lseek(fd.get(), 0, SEEK_SET);
+  {
+    protobuf::LogReader<FieldDescriptorProto> reader(fd.get());
+    Result<FieldDescriptorProto> field = reader.read();
+    while (field.isSome()) {
+      field = reader.read();
+    }
+    EXPECT_ERROR(field);
+    EXPECT_GT(last, reader.offset().get());
+    EXPECT_EQ(reader.offset().get(), lseek(fd.get(), 0, SEEK_CUR));
+
+    // Skipping the corrupted record recovers the ones after it.
+    ASSERT_SOME(reader.skip());
+    field = reader.read();
+    ASSERT_SOME(field);
+    EXPECT_EQ(999, field.get().number());
+    EXPECT_TRUE(reader.read().isNone());
+  }
+
+  // A torn record at the end looks like the end of the log.
+  ASSERT_EQ(0, ftruncate(fd.get(), size - 1));
+  lseek(fd.get(), last, SEEK_SET);
+  {
+    protobuf::LogReader<FieldDescriptorProto> reader(fd.get());
+    EXPECT_TRUE(reader.read().isNone());
+    EXPECT_SOME_EQ(last, reader.offset());
+    EXPECT_EQ(last, lseek(fd.get(), 0, SEEK_CUR));
+  }
+
+  os::close(fd.get());
+
+  ASSERT_SOME(os::rmdir(mkdtemp.get()));
+}
+
+
+TEST(ProtobufTest, LogRecovery)
+{
+  Try<string> mkdtemp = os::mkdtemp();
+  ASSERT_SOME(mkdtemp);
+  const string path = mkdtemp.get() + "/log";
+
+  Try<int> fd = os::open(
+      path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  ASSERT_SOME(fd);
+
+  // Records separated by garbage, some of which looks like the start
+  // of a record (i.e., contains the magic and version).
+  const string garbage = "\xC7\x01\x05 junk \xC7\xC7!";
+
+  for (int i = 0; i < 10; i++) {
+    protobuf::LogWriter writer(fd.get());
+    FieldDescriptorProto field;
+    field.set_name("field");
+    field.set_number(i);
+    ASSERT_SOME(writer.append(field));
+    ASSERT_SOME(writer.flush());
+    ASSERT_SOME(os::write(fd.get(), garbage));
+  }
+
+  lseek(fd.get(), 0, SEEK_SET);
+
+  protobuf::LogReader<FieldDescriptorProto> reader(fd.get(), 16);
+  for (int i = 0; i < 10; i++) {
+    Result<FieldDescriptorProto> field = reader.read();
+    ASSERT_SOME(field);
+    EXPECT_EQ(i, field.get().number());
+
+    EXPECT_ERROR(reader.read());
+    EXPECT_SOME_EQ(garbage.size(), reader.skip());
+  }
+  EXPECT_TRUE(reader.read().isNone());
+  EXPECT_SOME_EQ(0u, reader.skip());
+
+  os::close(fd.get());
+
+  ASSERT_SOME(os::rmdir(mkdtemp.get()));
+}
+
+
+// Appends 'count' messages, numbered for the thread, syncing each.
+struct Appender
+{
+  protobuf::LogWriter* writer;
+  int thread;
+  int count;
+};
+
+
+static void* append(void* arg)
+{
+  Appender* appender = static_cast<Appender*>(arg);
+  for (int i = 0; i < appender->count; i++) {
+    FieldDescriptorProto field;
+    field.set_name("thread");
+    field.set_number(appender->thread * appender->count + i);
+    CHECK(appender->writer->append(field, true).isSome());
+  }
+  return NULL;
+}
+
+
+// Appends 'count' messages from each of 'threads' threads, returning
+// how long it took.
+static Duration append(protobuf::LogWriter* writer, int threads, int count)
+{
+  vector<Appender> appenders(threads);
+  vector<pthread_t> pthreads(threads);
+
+  Stopwatch stopwatch;
+  stopwatch.start();
+
+  for (int i = 0; i < threads; i++) {
+    appenders[i].writer = writer;
+    appenders[i].thread = i;
+    appenders[i].count = count;
+    CHECK_EQ(0, pthread_create(&pthreads[i], NULL, append, &appenders[i]));
+  }
+
+  for (int i = 0; i < threads; i++) {
+    CHECK_EQ(0, pthread_join(pthreads[i], NULL));
+  }
+
+  stopwatch.stop();
+  return stopwatch.elapsed();
+}
+
+
+TEST(ProtobufTest, LogGroupCommit)
+{
+  Try<string> mkdtemp = os::mkdtemp();
+  ASSERT_SOME(mkdtemp);
+  const string path = mkdtemp.get() + "/log";
+
+  Try<int> fd = os::open(
+      path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  ASSERT_SOME(fd);
+
+  protobuf::LogWriter writer(fd.get(), Milliseconds(1));
+  append(&writer, 8, 50);
+
+  // Every message from every thread made it (each exactly once).
+  lseek(fd.get(), 0, SEEK_SET);
+  vector<bool> seen(8 * 50, false);
+  protobuf::LogReader<FieldDescriptorProto> reader(fd.get());
+  for (int i = 0; i < 8 * 50; i++) {
+    Result<FieldDescriptorProto> field = reader.read();
+    ASSERT_SOME(field);
+    ASSERT_FALSE(seen[field.get().number()]);
+    seen[field.get().number()] = true;
+  }
+  EXPECT_TRUE(reader.read().isNone());
+
+  os::close(fd.get());
+
+  ASSERT_SOME(os::rmdir(mkdtemp.get()));
+}
+
+
+TEST(ProtobufTest, DISABLED_BENCHMARK_LogWriter)
+{
+  Try<string> mkdtemp = os::mkdtemp();
+  ASSERT_SOME(mkdtemp);
+  const string path = mkdtemp.get() + "/log";
+
+  Try<int> fd = os::open(
+      path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  ASSERT_SOME(fd);
+
+  const int count = 200;
+
+  FieldDescriptorProto field;
+  field.set_name("field");
+
+  Stopwatch stopwatch;
+  stopwatch.start();
+  for (int i = 0; i < count; i++) {
+    field.set_number(i);
+    ASSERT_SOME(protobuf::write(fd.get(), field));
+    ASSERT_EQ(0, fsync(fd.get()));
+  }
+  stopwatch.stop();
+
+  cout << "Appended " << count << " durable messages with protobuf::write "
+       << "and fsync in " << stopwatch.elapsed() << endl;
+
+  int threads[] = { 1, 8, 64 };
+  for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+    protobuf::LogWriter writer(fd.get());
+    Duration elapsed = append(&writer, threads[i], count);
+
+    cout << "Appended " << count << " durable messages from each of "
+         << threads[i] << " thread(s) with protobuf::LogWriter in "
+         << elapsed << " (" << threads[i] * count / elapsed.secs()
+         << " messages/s)" << endl;
+  }
+
+  os::close(fd.get());
+
+  ASSERT_SOME(os::rmdir(mkdtemp.get()));
+}
+
+
+TEST(ProtobufTest, JSON)
+{
+  FieldDescriptorProto field;
+  field.set_name("field");
+  field.set_number(7);
+  field.set_label(FieldDescriptorProto::LABEL_REPEATED);
+  field.set_type(FieldDescriptorProto::TYPE_STRING);
+
+  DescriptorProto message;
+  message.set_name("Message");
+  message.add_field()->CopyFrom(field);
+  message.add_field()->CopyFrom(field);
+  message.add_reserved_name("reserved");
+
+  JSON::Object object = JSON::Protobuf(message);
+
+  EXPECT_EQ(
+      "{\"field\":["
+      "{\"label\":\"LABEL_REPEATED\",\"name\":\"field\",\"number\":7,"
+      "\"type\":\"TYPE_STRING\"},"
+      "{\"label\":\"LABEL_REPEATED\",\"name\":\"field\",\"number\":7,"
+      "\"type\":\"TYPE_STRING\"}],"
+      "\"name\":\"Message\","
+      "\"reserved_name\":[\"reserved\"]}",
+      stringify(JSON::Value(object)));
+
+  Try<DescriptorProto> parse = protobuf::parse<DescriptorProto>(object);
+  ASSERT_SOME(parse);
+  EXPECT_EQ(message.SerializeAsString(), parse.get().SerializeAsString());
+
+  // A bigger message round trips too.
+  FileDescriptorProto file = descriptor();
+  Try<FileDescriptorProto> parsed =
+    protobuf::parse<FileDescriptorProto>(JSON::Protobuf(file));
+  ASSERT_SOME(parsed);
+  EXPECT_EQ(file.SerializeAsString(), parsed.get().SerializeAsString());
+}
+
+
+TEST(ProtobufTest, JSONScalars)
+{
+  UninterpretedOption option;
+  option.add_name()->set_name_part("part");
+  option.mutable_name(0)->set_is_extension(true);
+  option.set_positive_int_value(1234567890123ull);
+  option.set_negative_int_value(-42);
+  option.set_double_value(0.1);
+  option.set_string_value(string("\0\xFF bytes", 8));
+
+  JSON::Object object = JSON::Protobuf(option);
+
+  EXPECT_EQ(
+      "{\"double_value\":0.1,"
+      "\"name\":[{\"is_extension\":true,\"name_part\":\"part\"}],"
+      "\"negative_int_value\":-42,"
+      "\"positive_int_value\":1234567890123,"
+      "\"string_value\":\"AP8gYnl0ZXM=\"}",
+      stringify(JSON::Value(object)));
+
+  Try<UninterpretedOption> parse =
+    protobuf::parse<UninterpretedOption>(object);
+  ASSERT_SOME(parse);
+  EXPECT_EQ(option.SerializeAsString(), parse.get().SerializeAsString());
+
+  // Every length of bytes round trips through base64.
+  for (size_t i = 0; i < 10; i++) {
+    option.set_string_value(string("\x01\x80\xFF\x7F\x00\x10\xEE\x42\x99", i));
+    parse = protobuf::parse<UninterpretedOption>(JSON::Protobuf(option));
+    ASSERT_SOME(parse);
+    EXPECT_EQ(option.string_value(), parse.get().string_value());
+  }
+}
+
+
+TEST(ProtobufTest, JSONErrors)
+{
+  Try<JSON::Value> json = JSON::parse("[]");
+  ASSERT_SOME(json);
+  EXPECT_ERROR(protobuf::parse<DescriptorProto>(json.get()));
+
+  // Unknown members are ignored.
+  json = JSON::parse("{\"name\": \"Message\", \"unknown\": 1}");
+  ASSERT_SOME(json);
+  Try<DescriptorProto> message = protobuf::parse<DescriptorProto>(json.get());
+  ASSERT_SOME(message);
+  EXPECT_EQ("Message", message.get().name());
+
+  const char* invalid[] = {
+    "{\"name\": 1}",
+    "{\"field\": {}}",
+    "{\"field\": [1]}",
+    "{\"field\": [{\"number\": 1.5}]}",
+    "{\"field\": [{\"number\": 1e10}]}",
+    "{\"field\": [{\"label\": \"LABEL_BOGUS\"}]}",
+    "{\"options\": {\"message_set_wire_format\": 1}}"
+  };
+
+  for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+    json = JSON::parse(invalid[i]);
+    ASSERT_SOME(json);
+    EXPECT_ERROR(protobuf::parse<DescriptorProto>(json.get())) << invalid[i];
+  }
+
+  // Missing required fields.
+  json = JSON::parse("{\"name\": [{\"name_part\": \"part\"}]}");
+  ASSERT_SOME(json);
+  EXPECT_ERROR(protobuf::parse<UninterpretedOption>(json.get()));
+
+  json = JSON::parse("{\"string_value\": \"not base64!\"}");
+  ASSERT_SOME(json);
+  EXPECT_ERROR(protobuf::parse<UninterpretedOption>(json.get()));
+
+  // Integers just outside the range of 64-bit fields.
+  const char* outside[] = {
+    "{\"positive_int_value\": 18446744073709551616}", // 2^64.
+    "{\"positive_int_value\": -1}",
+    "{\"negative_int_value\": 9223372036854775808}", // 2^63.
+    "{\"negative_int_value\": -9223372036854777856}" // -2^63 - 2^11.
+  };
+
+  for (size_t i = 0; i < sizeof(outside) / sizeof(outside[0]); i++) {
+    json = JSON::parse(outside[i]);
+    ASSERT_SOME(json);
+    EXPECT_ERROR(protobuf::parse<UninterpretedOption>(json.get()))
+      << outside[i];
+  }
+
+  json = JSON::parse("{\"positive_int_value\": 18446744073709549568, "
+                     "\"negative_int_value\": -9223372036854775808}");
+  ASSERT_SOME(json);
+  Try<UninterpretedOption> option =
+    protobuf::parse<UninterpretedOption>(json.get());
+  ASSERT_SOME(option);
+  EXPECT_EQ(18446744073709549568ull, option.get().positive_int_value());
+  EXPECT_EQ(std::numeric_limits<int64_t>::min(),
+            option.get().negative_int_value());
+
+  // A JSON number is a double, so -2^63 - 1 can't be told apart from
+  // -2^63 (which is in range).
+  json = JSON::parse("{\"negative_int_value\": -9223372036854775809}");
+  ASSERT_SOME(json);
+  option = protobuf::parse<UninterpretedOption>(json.get());
+  ASSERT_SOME(option);
+  EXPECT_EQ(std::numeric_limits<int64_t>::min(),
+            option.get().negative_int_value());
+}
+
+
+TEST(ProtobufTest, JSONWriter)
+{
+  FileDescriptorProto file = descriptor();
+
+  bool pretties[] = { false, true };
+  for (size_t i = 0; i < 2; i++) {
+    string written;
+    JSON::Writer writer(&written, pretties[i]);
+    ASSERT_SOME(JSON::write(&writer, file));
+    ASSERT_SOME(writer.finish());
+
+    string rendered;
+    JSON::Object object = JSON::Protobuf(file);
+    JSON::render(&rendered, object, pretties[i]);
+    EXPECT_EQ(rendered, written);
+  }
+}
+
+
+TEST(ProtobufTest, DISABLED_BENCHMARK_JSON)
+{
+  const FileDescriptorProto file = descriptor();
+  const int count = 1000;
+
+  Stopwatch stopwatch;
+  stopwatch.start();
+  size_t size = 0;
+  for (int i = 0; i < count; i++) {
+    JSON::Object object = JSON::Protobuf(file);
+    size += stringify(JSON::Value(object)).size();
+  }
+  stopwatch.stop();
+
+  cout << "Converted " << count << " messages (" << size / count
+       << " bytes of JSON each) via JSON::Protobuf in "
+       << stopwatch.elapsed() << endl;
+
+  stopwatch.start();
+  size = 0;
+  for (int i = 0; i < count; i++) {
+    string s;
+    JSON::Writer writer(&s);
+    JSON::write(&writer, file);
+    writer.finish();
+    size += s.size();
+  }
+  stopwatch.stop();
+
+  cout << "Converted " << count << " messages (" << size / count
+       << " bytes of JSON each) via JSON::write in "
+       << stopwatch.elapsed() << endl;
+
+  const JSON::Object json = JSON::Protobuf(file);
+
+  stopwatch.start();
+  for (int i = 0; i < count; i++) {
+    protobuf::parse<FileDescriptorProto>(json);
+  }
+  stopwatch.stop();
+
+  cout << "Parsed " << count << " messages from JSON in "
+       << stopwatch.elapsed() << endl;
+}